@@ -1,4 +1,12 @@
 /*** includes ***/
+/**
+ * Feature test macros have to come before the includes, they decide which declarations the headers expose.
+ * getline() is a POSIX.1-2008 function and is hidden by glibc when compiling with -std=c99 unless we ask for it.
+ */
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
 #include <ctype.h>
 #include <stdio.h>
 #include <errno.h>
@@ -8,6 +16,32 @@
 #include <sys/ioctl.h>
 #include <string.h>
 #include <sys/types.h>
+#include <time.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <math.h>
+#include <sys/wait.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86 // The SSE2, AVX2 and AVX-512 kernels are built whatever the target, see simdSelect()
+#include <immintrin.h>
+#endif
 
 /** defines */
 #define CEDIT_VERSION "0.0.0"
@@ -23,34 +57,506 @@ enum editorKey
     PAGE_DOWN,
     HOME_KEY,
     END_KEY,
-    DEL_KEY
+    DEL_KEY,
+    F12_KEY,
+    STATS_TICK, // Nothing was typed for a while and the stats overlay wants fresh numbers, see editorReadKey()
+    INPUT_EOF   // The replayed input has ended
+};
+
+enum editorLineNumbers
+{
+    LINE_NUMBERS_OFF = 0,
+    LINE_NUMBERS_ABSOLUTE,
+    LINE_NUMBERS_RELATIVE
+};
+
+/** Character encodings recognized when a file is opened, see editorDetect() */
+enum editorEncoding
+{
+    ENCODING_UTF8 = 0, // Also plain ASCII
+    ENCODING_LATIN1,   // Bytes with the high bit set that are not valid UTF-8
+    ENCODING_UTF16LE,
+    ENCODING_UTF16BE
+};
+
+/** What the heap memory of the editor is used for, see memAlloc(). The kinds before MEM_BUDGETED count against the memory budget. */
+enum memKind
+{
+    MEM_RENDER = 0, // Render caches that are not just the row itself
+    MEM_DECODED,    // Rows of UTF-16 and Latin-1 files converted to UTF-8
+    MEM_ROWS,       // Text of the rows that are not in a mapping, see struct rowBlock
+    MEM_PACKED,     // The same text, compressed, for blocks of rows that went cold
+    MEM_INTERN,     // The one copy of each distinct line of the interning table, and the table
+    MEM_BUDGETED,
+    MEM_INDEX = MEM_BUDGETED, // Row arrays and row indexes, which everything else is rebuilt from
+    MEM_SEARCH,               // Grep results waiting to be added to their buffer, and the workers' read buffers
+    MEM_UNDO,                 // Rows replaced by edits, kept for Ctrl-Z
+    MEM_KINDS
 };
 
+/** What an edit does at every cursor, see editorEdit() */
+enum editorEditKind
+{
+    EDIT_INSERT,    // Insert text, which may contain newlines
+    EDIT_BACKSPACE, // Delete the character before the cursor, at the start of a row join it to the one above
+    EDIT_DELETE     // Delete the character under the cursor, at the end of a row join the one below to it
+};
+
+#define MEMORY_BUDGET_FRACTION 8 // By default the caches may use 1/8 of the physical memory
+
+#define GUTTER_MAX_DIGITS 20
+#define TAB_STOP 8
+#define HEX_LINE_BYTES 16 // Bytes per line of the hex view
+#define STATS_TICK_NS 250000000LL // The stats overlay is refreshed this often while no key is typed
+#define UNREAD_KEYS 64            // Keys typed ahead of a long job that are kept for after it
+
+/**
+ * TRACE_SCOPE(name) times the rest of the enclosing block as one trace event, the cleanup attribute ends it however the
+ * block is left. TRACE_ARG() attaches a number to it. With tracing off a scope costs a branch and a call that returns
+ * at once, and building with -DCEDIT_NO_TRACE removes them altogether.
+ */
+#ifdef CEDIT_NO_TRACE
+#define TRACE_SCOPE(name)
+#define TRACE_ARG(name, value) ((void)0)
+#else
+#define TRACE_SCOPE(name)                                                          \
+    struct traceScope trace_scope __attribute__((cleanup(traceScopeEnd))) = \
+        {name, E.tracing ? monotonicNs() : 0, NULL, 0}
+#define TRACE_ARG(name, value) (trace_scope.arg_name = (name), trace_scope.arg = (value))
+#endif
+#define DECODE_BLOCK_ROWS 64   // Rows of a UTF-16 or Latin-1 file are converted to UTF-8 this many at a time
+#define DECODE_CACHE_BLOCKS 64 // Converted blocks a buffer keeps, the least recently used one is dropped first
+#define STORE_BLOCK_ROWS 256   // Rows per block of the row store, a block is split at twice as many, see struct rowBlock
+
 /** data */
 
 /**
- * erow stands for “editor row”, and stores a line of text as a pointer to the dynamically-allocated character data and a length.
+ * erow stands for “editor row”, and stores a line of text as a pointer to the character data and a length.
+ * The character data points straight into the memory-mapped file, so it is not NUL-terminated: always use size.
+ * For a UTF-16 or Latin-1 file chars are the bytes on disk, editorRowText() gives the row converted to UTF-8.
+ * render holds the characters as they are drawn on screen, with tabs expanded. It is built the first time the row is drawn
+ * and lives in the row, so every window showing the row shares it. When a row has nothing to expand render is just chars.
  * The typedef lets us refer to the type as erow instead of struct erow.
  */
 typedef struct erow
 {
     int size;
+    int rsize;
     char *chars;
+    char *render;
 } erow;
 
-struct editorConfig
+/**
+ * rowIndex is a Fenwick tree (binary indexed tree) over one number per row block of a buffer. A buffer has two, over the
+ * rows of every block and over their bytes, line terminators included. tree[i] holds the sum of the numbers of the blocks
+ * (i - lowbit(i), i], where lowbit(i) = i & -i is the lowest set bit of i. That layout lets us answer "which block holds
+ * row n, and at which byte does it start?" and "which block contains byte b?" in O(log n), and a block whose rows
+ * change only touches O(log n) entries instead of invalidating a flat prefix-offset table.
+ * The tree is 1-indexed, so tree[0] is unused and block n lives at index n + 1.
+ */
+struct rowIndex
+{
+    long long *tree;
+    int size;
+    int cap;
+};
+
+/**
+ * A decodedBlock holds DECODE_BLOCK_ROWS rows of a UTF-16 or Latin-1 file converted to UTF-8, one after the other.
+ * The mapping stays the source of truth, a block can be dropped at any time and converted again when it is needed.
+ */
+struct decodedBlock
+{
+    int block;       // Block number, rows [block * DECODE_BLOCK_ROWS, ...), or -1 for a free slot
+    long long used;  // Tick of the last use, the block with the smallest one is dropped first
+    char *text;
+    size_t bytes;    // Size of text, as charged to the memory budget
+    int start[DECODE_BLOCK_ROWS + 1]; // Where each row starts in text, the last entry is the end of the last row
+};
+
+/**
+ * The rows of a buffer live in rowBlocks of about STORE_BLOCK_ROWS rows each, in order. A block holds its rows, the
+ * length each one takes in the file, and the text of the rows that do not point into the mapping, like edited lines or
+ * the lines of a grep buffer, in one arena per block instead of one malloc() per row.
+ * An edit only touches the blocks of the rows it edits: rows are inserted and removed within their block, a block that
+ * grows to twice its size is split and an emptied one is dropped, and the row index over the blocks finds any row.
+ * When the memory budget runs out, blocks nobody looked at for a while are frozen: the text of their arena is compressed
+ * with LZ4, the arena is freed and those rows' chars are set to NULL. Reading a row of a frozen block thaws it again.
+ * The rows of a frozen block are found by their order in it, so rows are only added to or taken out of thawed blocks.
+ * While no window shows the buffer, a block whose rows all lie one after the other in the mapping is unloaded: its row
+ * array is freed and only the lengths stay, which are all it takes to find the rows in the mapping again.
+ */
+struct rowBlock
+{
+    erow *row;       // NULL while the block is unloaded
+    int *lens;       // Bytes each row takes in the file, line terminator included
+    int num_rows, rows_cap;
+    long long map_off; // Where the rows of an unloaded block start in the mapping
+    long long bytes; // Sum of lens
+    char *text;      // Arena with the text of the block's own rows, NULL when the block is frozen or has none
+    size_t len, cap;
+    char *packed;    // LZ4 copy of the own rows' text, one after the other, or NULL
+    int packed_len, raw_len;
+    int dirty;       // The text changed since packed was made, so it must be compressed again before freezing
+    int frozen;
+    long long used;  // Tick of the last use on E.mem_tick, the least recently used blocks are frozen first
+    int rendered;    // Rows whose render cache is a copy of their own, see editorUpdateRender()
+    long long drawn; // Tick of the last row drawn from the block, the render caches drawn least recently go first
+};
+
+/**
+ * A blockList holds rows that are not in a buffer, in blocks like a buffer's: the new rows of an edit on their way in,
+ * or the old rows an undo step keeps. editorSpliceRows() takes them from the front, moving the rows of partly used
+ * blocks and whole blocks as they are.
+ */
+struct blockList
+{
+    struct rowBlock **blocks;
+    int num, cap;
+    int next; // First block with rows left to take
+};
+
+/** A place in the rows of a buffer, to walk them in order without looking every one up, see rowIterNext(). */
+struct rowIter
+{
+    struct editorBuffer *b;
+    int blk, off;
+};
+
+/**
+ * The interning table keeps one copy of every distinct line stored in it, so rows with the same text share it.
+ * It is an open-addressing hash table of entries pointing into `pool`, a list of chunks that never move,
+ * so interned text can be pointed at from any row of any buffer. A line no row points at any more leaves the table,
+ * and a chunk is freed once none of its lines are left.
+ */
+struct internEntry
+{
+    uint64_t hash;
+    char *text; // NULL for an empty slot
+    int len;
+    int refs;   // Rows pointing at text
+    struct internPool *chunk;
+};
+
+struct internPool
+{
+    struct internPool *next, *prev;
+    size_t len, cap;
+    int live;    // Entries whose text is in the chunk
+    char text[]; // Flexible array member, the chunk's bytes follow the header
+};
+
+/** A cursor of a window: a row of the buffer and a column of the screen, like the cx and cy of the window itself. */
+struct editorCursor
 {
     int cx, cy;
-    int screen_rows;
-    int screen_cols;
+};
+
+/** A rowSplice replaces `removed` rows at row `at` by `added` new ones, see editorSpliceRows(). */
+struct rowSplice
+{
+    int at, removed, added;
+};
+
+/**
+ * An undoStep puts back what one edit replaced. Its splices are the edit's turned around: at the row where the edit
+ * left them, `removed` rows are the ones it made and `added` are the old rows. The edit cut those out of the buffer
+ * into `rows` as they were, so rows of the mapping are kept as a pointer and a length and whole blocks as they are,
+ * frozen or not. The splices and cursors live in one block of `bytes` bytes.
+ */
+struct undoStep
+{
+    struct rowSplice *splices;
+    int num_splices;
+    struct blockList rows;
+    struct editorCursor *cursors; // Where the cursors of the window that made the edit were, its own cursor first
+    int num_cursors;
+    size_t bytes;
+    int *perm;                    // Or NULL: after the splices, rows [perm_at, perm_at + perm_len) go back in this order
+    int perm_at, perm_len;
+    long long kept;               // Bytes of everything the step keeps, counted once its edit is done
+};
+
+/**
+ * An editorBuffer is one open file. The file is mapped read-only with mmap() and the rows point into the mapping,
+ * so the only memory a buffer owns is its row blocks and the index over them, no matter how big the file is.
+ * Render caches are only kept while a window shows the buffer, every block counts the rows that have one so they can be dropped quickly.
+ * Everything that is about the terminal rather than the file lives in editorConfig and is shared by all buffers.
+ */
+struct editorBuffer
+{
+    int cx, cy, rowoff; // Cursor and scroll position to restore when a window switches back to this buffer
     int num_rows;
-    erow row;
+    struct rowBlock **blocks; // The rows, see struct rowBlock
+    int num_blocks, blocks_cap;
+    struct rowIndex index_rows, index_bytes; // Rows and bytes of every block
+    int no_eol;       // The last line has no terminator, it is counted in its length all the same and this many bytes too much
+    char *filename;
+    char *map; // Read-only mapping of the whole file, NULL for an empty file
+    size_t map_len;
+    int gutter_width; // Columns taken by the line numbers, digits plus one space
+    int gutter_limit; // Smallest row count that needs one more digit in the gutter
+    int grep;         // This is a grep results buffer, Enter opens the result under the cursor
+    int hex;          // Shown as a hex dump of the mapping, cursor rows are then 16-byte lines and columns are bytes
+    int hex_digits;   // Width of the offset column of the hex view
+    int indexed;      // The rows and the row index have been built, binary files only build them when shown as text
+    int encoding;     // One of enum editorEncoding
+    int crlf;         // Lines end with \r\n
+    struct decodedBlock *decoded; // DECODE_CACHE_BLOCKS converted blocks, NULL until a row of a transcoded file is needed
+    struct undoStep *undo; // Ring of UNDO_STEPS edits, the oldest at undo_first, allocated by the first edit
+    int num_undo, undo_first;
+    long long undo_kept;   // Bytes the undo steps keep, but for the last one while its edit is not counted yet
+    int undo_open;         // The last step is not counted in undo_kept yet
+};
+
+/**
+ * An editorWindow is a rectangle of the screen showing a buffer. Several windows can show the same buffer at different
+ * positions, they share the buffer's rows and render caches and only keep their own cursor and scroll position.
+ * Each window remembers what it last drew, so a refresh only redraws the windows that actually changed.
+ * The last line of a window is its status line, and a window that does not reach the right edge of the screen
+ * uses its last column as the separator with its neighbour.
+ */
+struct editorWindow
+{
+    struct editorBuffer *buf;
+    int cx, cy;
+    int rowoff; // Row of the file shown at the top of the window, cy is a row of the file and not of the screen
+    int top, left;
+    int rows, cols;
+    int redraw; // Set when the text area must be redrawn completely on the next refresh
+    int drawn_rowoff, drawn_cy; // Row offset and cursor row of the frame currently on the terminal
+    struct editorCursor *cursors; // Extra cursors that edit along with cx and cy, sorted by row and column
+    int num_cursors, cursors_cap;
+    int block;                    // A block selection from block_cx, block_cy to the cursor is active
+    int block_cx, block_cy;
+};
+
+/**
+ * A cancelToken is shared by all the tasks of one job. Setting it asks the tasks to stop as soon as they can,
+ * tasks poll it between units of work. It is read and written with the __atomic builtins, so no lock is needed.
+ */
+struct cancelToken
+{
+    int cancelled;
+};
+
+/** A taskGroup counts the tasks of one job that have not finished yet, so the submitter can wait for all of them. */
+struct taskGroup
+{
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    int pending;
+};
+
+/**
+ * A task is a function to run on a worker. It is always called, even once its token is cancelled,
+ * so that it can free its argument, it should just skip its work in that case.
+ */
+struct task
+{
+    void (*fn)(void *arg, struct cancelToken *token);
+    void *arg;
+    struct taskGroup *group;
+    struct cancelToken *token;
+};
+
+/**
+ * Every worker owns a deque of tasks. The owner pushes and pops at the tail, so a task that submits more work runs it
+ * next while its data is still in cache, and idle workers steal from the head of the others' deques, where the oldest
+ * and usually biggest tasks are. The padding keeps the hot fields of two workers off the same cache line.
+ */
+struct taskWorker
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    struct task *tasks;
+    int head, tail, cap;
+    long long busy_ns; // Time spent running tasks, for the utilization statistics
+    long tasks_run;
+    long steals;
+    char pad[64];
+};
+
+/** The task pool is created once by initEditor() and every parallel job of the editor submits to it. */
+struct taskPool
+{
+    struct taskWorker *workers;
+    int num_workers;
+    int queued;          // Tasks waiting in any deque, updated with __atomic builtins
+    unsigned int next;   // Round-robin cursor for tasks submitted from outside the pool
+    pthread_mutex_t lock; // Only used to put idle workers to sleep and wake them up
+    pthread_cond_t wake;
+    long long start_ns;
+};
+
+/**
+ * Trace events are written by each thread into its own traceBuffer, a list of chunks that only that thread appends to,
+ * so recording an event takes no lock and no atomic read-modify-write. The buffers themselves are pushed onto
+ * a global list once, when a thread records its first event, and read when the trace is written out at exit.
+ */
+#define TRACE_CHUNK_EVENTS 4096
+
+struct traceEvent
+{
+    const char *name, *arg_name; // Both are string literals, arg_name is NULL if the event has no argument
+    long long arg;
+    long long start_ns, dur_ns;
+};
+
+struct traceChunk
+{
+    struct traceChunk *next;
+    int count; // Events written, published with a release store after each event
+    struct traceEvent events[TRACE_CHUNK_EVENTS];
+};
+
+struct traceBuffer
+{
+    struct traceBuffer *next;
+    int tid;
+    char name[24]; // Room for "worker " and any int
+    struct traceChunk *first, *last;
+};
+
+/** A trace event being timed, see TRACE_SCOPE(). start_ns is 0 when tracing is off. */
+struct traceScope
+{
+    const char *name;
+    long long start_ns;
+    const char *arg_name;
+    long long arg;
+};
+
+/**
+ * The kernels of one SIMD level, see simdSelect(). Every level gives the same results as the scalar one, only faster,
+ * and simdSelfTest() checks that it does.
+ */
+struct simdKernels
+{
+    const char *name;
+    char *(*find_byte)(const char *p, size_t n, int c);                     // Like memchr()
+    char *(*find)(const char *p, size_t n, const char *needle, size_t m);  // Like memmem()
+    size_t (*ascii_span)(const unsigned char *p, size_t n);                 // Bytes before the first non-ASCII one
+    void (*count_controls)(const char *p, size_t n, int *tabs, int *ctrl);  // Tabs, and other control characters
+    void (*hex16)(char *hex, char *shown, const unsigned char *in);         // Hex digits and printable bytes of a line
+};
+
+/**
+ * A pipeMsg is what travels between the stages of the main loop: a key with the time it was read,
+ * or a frame of terminal output with the time the oldest key it answers was read.
+ */
+struct pipeMsg
+{
+    intptr_t value; // The key, or the frame's buffer
+    int len;        // Length of the frame
+    long long ns;
+};
+
+#define PIPE_SLOTS 4096 // Must be a power of two
+
+/**
+ * An spscRing is a lock-free queue between exactly one producer thread and one consumer thread.
+ * Only the consumer writes head and only the producer writes tail, and the two live on separate cache lines,
+ * so the threads never write to the same line and never take a lock. Both indexes count up forever,
+ * the slot is the index modulo PIPE_SLOTS, and tail - head is the number of messages in the ring.
+ */
+struct spscRing
+{
+    unsigned int head;
+    char pad0[64 - sizeof(unsigned int)];
+    unsigned int tail;
+    char pad1[64 - sizeof(unsigned int)];
+    struct pipeMsg slots[PIPE_SLOTS];
+};
+
+struct editorConfig
+{
+    int screen_rows; // Rows available to windows, the message bar is below them
+    int screen_cols;
+    struct editorBuffer **buffers; // Every open file, in the order they were opened
+    int num_buffers;
+    int current;             // Index in buffers of the buffer shown in the focused window
+    struct editorBuffer *buf; // Shortcut for buffers[current]
+    struct editorWindow **windows;
+    int num_windows;
+    int focus;               // Index in windows of the window the cursor is in
+    struct editorWindow *win; // Shortcut for windows[focus]
+    int line_numbers; // One of enum editorLineNumbers
+    size_t mem_budget;              // Bytes the caches may use before the coldest ones are dropped, see --memory-budget
+    long long mem_used[MEM_KINDS];  // Bytes in use now, per enum memKind, updated atomically as workers allocate too
+    long long mem_peak;
+    long mem_evicted;               // Caches dropped to stay in the budget
+    long mem_frozen, mem_thawed;    // Row blocks compressed and decompressed again
+    int intern;                     // Store the text of rows through the interning table, see --intern
+    struct internEntry *intern_table;
+    int intern_cap, intern_count;   // Slots, a power of two, and distinct lines
+    struct internPool *intern_pool;
+    long long intern_refs, intern_bytes, intern_unique_bytes; // Lines and bytes stored, and bytes actually kept
+    long long mem_tick;             // Clock of the converted blocks' least recently used order, shared by all buffers
+    struct taskPool pool;
+    const struct simdKernels *simd; // Kernels picked for this CPU, see simdSelect()
+    int pipeline;                   // Keys and frames go through the rings below and the input and render threads
+    struct spscRing *keys, *frames; // Input stage -> edit stage, edit stage -> render stage
+    long frames_sent, frames_written;
+    pthread_mutex_t pipe_lock;      // A stage with nothing to do sleeps on pipe_wake, see pipeWait()
+    pthread_cond_t pipe_wake;
+    int pipe_sleepers;
+    long long frame_key_ns; // When the oldest key not yet answered by a frame was read
+    int input_fd, output_fd;
+    int replay;             // Keys come from a file and output goes to /dev/null, see --replay
+    int input_ended;
+    long keys_read;
+    long long bytes_sent;
+    char *bench_path;       // Run the benchmark scenarios and write their results here, see --bench
+    int bench_runs;         // Times the scenarios are repeated, see --bench-runs
+    char *bench_baseline;   // Earlier results to compare with, see --bench-baseline
+    int tracing;            // Record trace events, see --trace
+    char *trace_path;
+    long long trace_start_ns;
+    struct traceBuffer *trace_buffers; // One per thread that recorded an event
+    int trace_threads;
+    int stats_overlay;      // F12 shows live counters over the windows, see editorDrawStatsOverlay()
+    long frames_built;
+    long long frame_ns, frame_total_ns; // Time it took to build the last frame, and all of them
+    int frame_bytes;        // Size of the last frame
+    long long rate_start_ns; // Keys per second are counted over windows of one second starting here
+    int rate_keys, keys_per_sec;
+    long long replay_start_ns;
+    long long load_ns, load_bytes; // Time spent opening files and their size, for the replay report
+    long replay_rate;       // Keys per second the replayed keys arrive at, 0 to send them all at once
+    long replay_bps;        // Bytes per second the pretend terminal of a replay can take, 0 for no limit
+    long keys_arrived;
+    long long *latencies;   // Key-to-frame latencies, in nanoseconds
+    int num_latencies, latencies_cap;
+    int *macro;             // Keys of the keyboard macro, see editorRunMacro()
+    int macro_len, macro_cap;
+    int macro_pos;          // Next key of the macro while it runs
+    int recording, playing; // The keys the edit stage gets are recorded, or come from the macro
+    int unread[UNREAD_KEYS]; // Keys typed while a long job looked for Escape, read again once it is done
+    int num_unread;
+    char statusmsg[80];
+    time_t statusmsg_time;
     struct termios orig_termios;
 };
 struct editorConfig E;
 
 struct termios orig_termios; // Original termios structure, needed to restore once the user exits the program
 
+/** prototypes */
+long long monotonicNs();
+void traceScopeEnd(struct traceScope *s);
+unsigned long long corpusRandom(unsigned long long *x);
+int editorRowsNearView(struct editorBuffer *b, int first, int last);
+double internRatio();
+void editorSetStatusMessage(const char *fmt, ...);
+void editorRefreshScreen();
+void editorRedrawBuffer(struct editorBuffer *b);
+void editorProcessKeypress();
+void editorRecordKey(int c);
+int encodingUnit(int encoding);
+char *editorPrompt(char *prompt);
+void initEditor();
+
 /** Print error message and exit */
 void die(const char *s)
 {
@@ -142,12 +648,19 @@ int editorReadKey()
 {
     int nread;
     char c;
-    /** Read from Standard input */
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1)
+    long long idle_ns = monotonicNs();
+    /** Read from Standard input, or from the key file when replaying */
+    while ((nread = read(E.input_fd, &c, 1)) != 1)
     {
         if (nread == -1 && errno != EAGAIN)
             die("read");
+        if (nread == 0 && E.replay)
+            return INPUT_EOF;
+        // read() times out every 100 ms, which keeps the numbers of the stats overlay moving while nothing is typed
+        if (__atomic_load_n(&E.stats_overlay, __ATOMIC_RELAXED) && monotonicNs() - idle_ns >= STATS_TICK_NS)
+            return STATS_TICK;
     }
+    TRACE_SCOPE("editorReadKey"); // From the first byte of the key, waiting for it is not work
     /**
      * Pressing an arrow key sends multiple bytes as input to our program.
      * These bytes are in the form of an escape sequence that starts with '\x1b', '[', followed by an 'A', 'B', 'C', or 'D'
@@ -156,9 +669,9 @@ int editorReadKey()
     if (c == '\x1b')
     {
         char seq[3];
-        if (read(STDIN_FILENO, &seq[0], 1) != 1)
+        if (read(E.input_fd, &seq[0], 1) != 1)
             return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1)
+        if (read(E.input_fd, &seq[1], 1) != 1)
             return '\x1b';
         if (seq[0] == '[')
         {
@@ -168,8 +681,18 @@ int editorReadKey()
              */
             if (seq[1] >= '0' && seq[1] <= '9')
             {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1)
+                if (read(E.input_fd, &seq[2], 1) != 1)
                     return '\x1b';
+                // Function keys have two digits, F12 is <esc>[24~
+                if (seq[2] >= '0' && seq[2] <= '9')
+                {
+                    char end;
+                    if (read(E.input_fd, &end, 1) != 1 || end != '~')
+                        return '\x1b';
+                    if (seq[1] == '2' && seq[2] == '4')
+                        return F12_KEY;
+                    return '\x1b';
+                }
                 if (seq[2] == '~')
                 {
                     switch (seq[1])
@@ -221,10 +744,11 @@ int editorReadKey()
             }
             return '\x1b';
         }
+        return '\x1b';
     }
     else
     {
-        return c;
+        return (unsigned char)c; // Bytes of UTF-8 characters are keys 128 to 255, not negative numbers
     }
 }
 
@@ -303,153 +827,6629 @@ int getWindowSize(int *rows, int *cols)
     }
 }
 
+/** memory accounting */
+
 /**
- * editorOpen() will eventually be for opening and reading a file from disk, so we put it in a new file i/o section.
- * To load our “Hello, world” message into the editor’s erow struct, we set the size field to the length of our message, malloc() the necessary memory,
- * and memcpy() the message to the chars field which points to the memory we allocated. Finally, we set the E.numrows variable to 1,
- * to indicate that the erow now contains a line that should be displayed.
+ * Bytes counted against E.mem_budget, which editorEnforceBudget() keeps under it by dropping the coldest ones.
+ * All of it can be rebuilt from the mapping, like render caches and converted blocks, or compressed, like row text.
+ * The row arrays and row indexes are not counted, they are what everything else is rebuilt from,
+ * and the mapped file is page cache that the kernel can always take back without swapping.
  */
-
-void editorOpen(char *filename)
+long long editorMemUsed()
 {
-    FILE *fp = fopen(filename, "r");
-    if (!fp)
-        die("fopen");
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    linelen = getline(&line, &linecap, fp);
-    if (linelen != -1)
-    {
-        while (linelen > 0 && (line[linelen - 1] == '\n' ||
-                               line[linelen - 1] == '\r'))
-            linelen--;
-        E.row.size = linelen;
-        E.row.chars = malloc(linelen + 1);
-        memcpy(E.row.chars, line, linelen);
-        E.row.chars[linelen] = '\0';
-        E.num_rows = 1;
-    }
-    free(line);
-    fclose(fp);
+    long long total = 0;
+    int i;
+    for (i = 0; i < MEM_BUDGETED; i++)
+        total += __atomic_load_n(&E.mem_used[i], __ATOMIC_RELAXED);
+    return total;
 }
+
 /**
- * We want to replace all our write() calls with code that appends the string to a buffer,
- * and then write() this buffer out at the end. Unfortunately, C doesn’t have dynamic strings, so we’ll create our own dynamic string
- * type that supports one operation: appending.
- * An append buffer consists of a pointer to our buffer in memory,
- * and a length. We define an ABUF_INIT constant which represents an empty buffer. This acts as a constructor for our abuf type.
+ * Every heap allocation that grows with the files goes through memAlloc() and friends, which tell editorMemCharge() what it
+ * is for. That gives live per-subsystem numbers for the stats overlay without a profiler, and the memory budget.
+ * The counters are updated with atomic adds because the task pool workers allocate too.
  */
-struct abuf
+void editorMemCharge(int kind, long long bytes)
 {
-    char *b;
-    int len;
-};
-#define ABUF_INIT {NULL, 0}
+    __atomic_add_fetch(&E.mem_used[kind], bytes, __ATOMIC_RELAXED);
+    if (kind < MEM_BUDGETED && bytes > 0 && editorMemUsed() > E.mem_peak)
+        E.mem_peak = editorMemUsed();
+}
 
-/**
- * realloc() and free() come from <stdlib.h>. memcpy() comes from <string.h>
- * To append a string s to an abuf, the first thing we do is make sure we allocate enough memory to hold the new string.
- * We ask realloc() to give us a block of memory that is the size of the current string plus the size of the string we are appending.
- * realloc() will either extend the size of the block of memory we already have allocated, or it will take care of free()ing the
- * current block of memory and allocating a new block of memory somewhere else that is big enough for our new string.
- * Then we use memcpy() to copy the string s after the end of the current data in the buffer,
- * and we update the pointer and length of the abuf to the new values.
- */
-void abAppend(struct abuf *ab, const char *s, int len)
+void *memAlloc(int kind, size_t size)
 {
-    char *new = realloc(ab->b, ab->len + len);
-    if (new == NULL)
+    void *p = malloc(size ? size : 1);
+    if (p == NULL)
+        die("malloc");
+    editorMemCharge(kind, size);
+    return p;
+}
+
+void *memCalloc(int kind, size_t n, size_t size)
+{
+    void *p = calloc(n ? n : 1, size);
+    if (p == NULL)
+        die("calloc");
+    editorMemCharge(kind, n * size);
+    return p;
+}
+
+/** realloc() a block of `old` bytes to `size` bytes. */
+void *memRealloc(int kind, void *p, size_t old, size_t size)
+{
+    p = realloc(p, size ? size : 1);
+    if (p == NULL)
+        die("realloc");
+    editorMemCharge(kind, (long long)size - (long long)old);
+    return p;
+}
+
+/** free() a block of `size` bytes. */
+void memFree(int kind, void *p, size_t size)
+{
+    if (p == NULL)
         return;
-    memcpy(&new[ab->len], s, len);
-    ab->b = new;
-    ab->len += len;
+    free(p);
+    editorMemCharge(kind, -(long long)size);
 }
 
-/**
- * abFree() is a destructor that deallocates the dynamic memory used by an abuf.
- */
-void abFree(struct abuf *ab)
+/** task pool */
+
+/** Index of the pool worker running the current thread, -1 on the main thread. */
+__thread int poolWorkerId = -1;
+
+long long monotonicNs()
 {
-    free(ab->b);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
-void editorMoveCursor(int key)
+void cancelTokenSet(struct cancelToken *token)
 {
-    switch (key)
+    __atomic_store_n(&token->cancelled, 1, __ATOMIC_RELEASE);
+}
+
+int cancelTokenIsSet(struct cancelToken *token)
+{
+    return token && __atomic_load_n(&token->cancelled, __ATOMIC_ACQUIRE);
+}
+
+void taskGroupInit(struct taskGroup *g)
+{
+    pthread_mutex_init(&g->lock, NULL);
+    pthread_cond_init(&g->done, NULL);
+    g->pending = 0;
+}
+
+void taskGroupDestroy(struct taskGroup *g)
+{
+    pthread_mutex_destroy(&g->lock);
+    pthread_cond_destroy(&g->done);
+}
+
+/** Wait until every task of the group has finished. */
+void taskGroupWait(struct taskGroup *g)
+{
+    pthread_mutex_lock(&g->lock);
+    while (g->pending > 0)
+        pthread_cond_wait(&g->done, &g->lock);
+    pthread_mutex_unlock(&g->lock);
+}
+
+/** Wait at most `ms` milliseconds for the group to finish and return the number of tasks still pending. */
+int taskGroupWaitFor(struct taskGroup *g, int ms)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L)
     {
-    case ARROW_LEFT:
-        if (E.cx != 0)
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&g->lock);
+    if (g->pending > 0)
+        pthread_cond_timedwait(&g->done, &g->lock, &ts);
+    int pending = g->pending;
+    pthread_mutex_unlock(&g->lock);
+    return pending;
+}
+
+/** Take a task from the tail of our own deque or, when `steal` is set, from the head of someone else's. */
+int poolTake(struct taskWorker *w, struct task *t, int steal)
+{
+    int ok = 0;
+    pthread_mutex_lock(&w->lock);
+    if (w->head < w->tail)
+    {
+        *t = steal ? w->tasks[w->head++] : w->tasks[--w->tail];
+        ok = 1;
+    }
+    pthread_mutex_unlock(&w->lock);
+    if (ok)
+        __atomic_sub_fetch(&E.pool.queued, 1, __ATOMIC_ACQ_REL);
+    return ok;
+}
+
+/**
+ * Queue a task. From inside a task it goes on the current worker's own deque, from the main thread the deques
+ * are used round-robin. A sleeping worker is woken up, the others will find the task by stealing.
+ */
+void poolSubmit(struct taskGroup *group, struct cancelToken *token, void (*fn)(void *, struct cancelToken *), void *arg)
+{
+    struct taskPool *p = &E.pool;
+    int self = poolWorkerId >= 0 ? poolWorkerId
+                                 : (int)(__atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED) % p->num_workers);
+    struct taskWorker *w = &p->workers[self];
+    struct task t = {fn, arg, group, token};
+
+    if (group)
+    {
+        pthread_mutex_lock(&group->lock);
+        group->pending++;
+        pthread_mutex_unlock(&group->lock);
+    }
+
+    pthread_mutex_lock(&w->lock);
+    if (w->tail == w->cap)
+    {
+        // Slide the live part to the front before growing, the head only moves forward
+        memmove(w->tasks, &w->tasks[w->head], sizeof(struct task) * (w->tail - w->head));
+        w->tail -= w->head;
+        w->head = 0;
+        if (w->tail == w->cap)
         {
-            E.cx--;
+            w->cap = w->cap ? w->cap * 2 : 64;
+            w->tasks = realloc(w->tasks, sizeof(struct task) * w->cap);
+            if (w->tasks == NULL)
+                die("realloc");
         }
-        break;
-    case ARROW_RIGHT:
-        if (E.cx != E.screen_cols - 1)
+    }
+    w->tasks[w->tail++] = t;
+    pthread_mutex_unlock(&w->lock);
+
+    __atomic_add_fetch(&p->queued, 1, __ATOMIC_ACQ_REL);
+    pthread_mutex_lock(&p->lock);
+    pthread_cond_signal(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void *poolWorkerThread(void *arg)
+{
+    struct taskPool *p = &E.pool;
+    int self = (int)(long)arg;
+    struct taskWorker *w = &p->workers[self];
+    poolWorkerId = self;
+
+    while (1)
+    {
+        struct task t;
+        int i, found = poolTake(w, &t, 0);
+        for (i = 1; !found && i < p->num_workers; i++)
         {
-            E.cx++;
+            found = poolTake(&p->workers[(self + i) % p->num_workers], &t, 1);
+            if (found)
+                __atomic_add_fetch(&w->steals, 1, __ATOMIC_RELAXED);
         }
-        break;
-    case ARROW_UP:
-        if (E.cy != 0)
+        if (!found)
         {
-            E.cy--;
+            pthread_mutex_lock(&p->lock);
+            while (__atomic_load_n(&p->queued, __ATOMIC_ACQUIRE) == 0)
+                pthread_cond_wait(&p->wake, &p->lock);
+            pthread_mutex_unlock(&p->lock);
+            continue;
         }
-        break;
-    case ARROW_DOWN:
-        if (E.cy != E.screen_rows - 1)
+
+        long long start = monotonicNs();
+        t.fn(t.arg, t.token);
+        __atomic_add_fetch(&w->busy_ns, monotonicNs() - start, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&w->tasks_run, 1, __ATOMIC_RELAXED);
+
+        if (t.group)
         {
-            E.cy++;
+            pthread_mutex_lock(&t.group->lock);
+            if (--t.group->pending == 0)
+                pthread_cond_broadcast(&t.group->done);
+            pthread_mutex_unlock(&t.group->lock);
         }
-        break;
     }
+    return NULL;
 }
-void editorProcessKeypress()
+
+/** Start one worker per online CPU. The workers live as long as the editor and sleep when there is nothing to do. */
+void poolInit()
 {
-    int c = editorReadKey();
-    switch (c)
+    struct taskPool *p = &E.pool;
+    int i;
+    p->num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (p->num_workers < 1)
+        p->num_workers = 1;
+    p->workers = calloc(p->num_workers, sizeof(struct taskWorker));
+    if (p->workers == NULL)
+        die("calloc");
+    p->queued = 0;
+    p->next = 0;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->wake, NULL);
+    p->start_ns = monotonicNs();
+    for (i = 0; i < p->num_workers; i++)
     {
-    case CTRL_KEY('q'):
-        write(STDOUT_FILENO, "\x1b[2J", 4);
-        write(STDOUT_FILENO, "\x1b[H", 3);
-        exit(0);
-        break;
+        pthread_mutex_init(&p->workers[i].lock, NULL);
+        if (pthread_create(&p->workers[i].thread, NULL, poolWorkerThread, (void *)(long)i) != 0)
+            die("pthread_create");
+    }
+}
 
-    case PAGE_UP:
-    case PAGE_DOWN:
-    { // We create a code block with that pair of braces so that we’re allowed to declare the times variable. (You can’t declare variables directly inside a switch statement.)
-        int times = E.screen_rows;
-        while (times--)
-            editorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+/** Share of the time since the pool started that worker `i` spent running tasks, in percent. */
+int poolUtilization(int i)
+{
+    long long elapsed = monotonicNs() - E.pool.start_ns;
+    if (elapsed <= 0)
+        return 0;
+    return (int)(__atomic_load_n(&E.pool.workers[i].busy_ns, __ATOMIC_RELAXED) * 100 / elapsed);
+}
+
+/** Show what the pool has been doing in the message bar: tasks run, tasks stolen, and how busy each worker was. */
+void editorShowPoolStats()
+{
+    char buf[80];
+    long tasks = 0, steals = 0;
+    int i, len;
+    for (i = 0; i < E.pool.num_workers; i++)
+    {
+        tasks += __atomic_load_n(&E.pool.workers[i].tasks_run, __ATOMIC_RELAXED);
+        steals += __atomic_load_n(&E.pool.workers[i].steals, __ATOMIC_RELAXED);
     }
-    break;
+    len = snprintf(buf, sizeof(buf), "%d workers, %ld tasks, %ld stolen, busy%%:", E.pool.num_workers, tasks, steals);
+    for (i = 0; i < E.pool.num_workers && len < (int)sizeof(buf) - 5; i++)
+        len += snprintf(&buf[len], sizeof(buf) - len, " %d", poolUtilization(i));
+    editorSetStatusMessage("%s", buf);
+}
 
-    case HOME_KEY:
-        E.cx = 0;
-        break;
-    case END_KEY:
-        E.cx = E.screen_cols - 1;
-        break;
+/** tracing */
+
+/** Name of the current thread in the trace, pool workers are named after their index instead. */
+__thread const char *traceThreadName = "main";
+__thread struct traceBuffer *traceBuf = NULL;
+
+struct traceBuffer *traceThreadBuffer()
+{
+    if (traceBuf != NULL)
+        return traceBuf;
+    struct traceBuffer *b = calloc(1, sizeof(struct traceBuffer));
+    if (b == NULL)
+        die("calloc");
+    b->tid = __atomic_add_fetch(&E.trace_threads, 1, __ATOMIC_RELAXED);
+    if (poolWorkerId >= 0)
+        snprintf(b->name, sizeof(b->name), "worker %d", poolWorkerId);
+    else
+        snprintf(b->name, sizeof(b->name), "%s", traceThreadName);
+    b->next = __atomic_load_n(&E.trace_buffers, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&E.trace_buffers, &b->next, b, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    traceBuf = b;
+    return b;
+}
+
+/** End of a TRACE_SCOPE(): append the event to this thread's buffer. */
+void traceScopeEnd(struct traceScope *s)
+{
+    if (s->start_ns == 0)
+        return;
+    long long end = monotonicNs();
+    struct traceBuffer *b = traceThreadBuffer();
+    struct traceChunk *c = b->last;
+    if (c == NULL || c->count == TRACE_CHUNK_EVENTS)
+    {
+        struct traceChunk *fresh = calloc(1, sizeof(struct traceChunk));
+        if (fresh == NULL)
+            die("calloc");
+        if (c == NULL)
+            __atomic_store_n(&b->first, fresh, __ATOMIC_RELEASE);
+        else
+            __atomic_store_n(&c->next, fresh, __ATOMIC_RELEASE);
+        b->last = c = fresh;
+    }
+    struct traceEvent *e = &c->events[c->count];
+    e->name = s->name;
+    e->arg_name = s->arg_name;
+    e->arg = s->arg;
+    e->start_ns = s->start_ns;
+    e->dur_ns = end - s->start_ns;
+    __atomic_store_n(&c->count, c->count + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Write every event recorded so far to E.trace_path in the Chrome trace event format, which chrome://tracing and
+ * ui.perfetto.dev open directly. Each event is a complete ("X") event with microsecond timestamps, and a metadata event
+ * names each thread. Threads may still be recording while this runs, it only reads events already published.
+ */
+void traceWrite()
+{
+    FILE *f = fopen(E.trace_path, "w");
+    struct traceBuffer *b;
+    long events = 0;
+    if (f == NULL)
+    {
+        perror(E.trace_path);
+        return;
+    }
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"cedit\"}}", (int)getpid());
+    for (b = __atomic_load_n(&E.trace_buffers, __ATOMIC_ACQUIRE); b != NULL; b = b->next)
+    {
+        struct traceChunk *c;
+        fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                (int)getpid(), b->tid, b->name);
+        for (c = __atomic_load_n(&b->first, __ATOMIC_ACQUIRE); c != NULL; c = __atomic_load_n(&c->next, __ATOMIC_ACQUIRE))
+        {
+            int i, n = __atomic_load_n(&c->count, __ATOMIC_ACQUIRE);
+            for (i = 0; i < n; i++, events++)
+            {
+                struct traceEvent *e = &c->events[i];
+                fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                        e->name, (int)getpid(), b->tid, (e->start_ns - E.trace_start_ns) / 1e3, e->dur_ns / 1e3);
+                if (e->arg_name)
+                    fprintf(f, ",\"args\":{\"%s\":%lld}", e->arg_name, e->arg);
+                fputc('}', f);
+            }
+        }
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+    fprintf(stderr, "trace: %ld events from %d threads written to %s\n", events, E.trace_threads, E.trace_path);
+}
+
+/** pipeline */
+
+/**
+ * The main loop runs as three stages: the input thread parses keys and queues them, the main thread applies them and
+ * builds frames, and the render thread writes the frames to the terminal. A slow terminal therefore never holds up key
+ * parsing, and when keys arrive faster than we can draw, the main thread applies all of them before building one frame.
+ */
+
+struct spscRing *spscNew()
+{
+    void *r;
+    if (posix_memalign(&r, 64, sizeof(struct spscRing)) != 0)
+        die("posix_memalign");
+    memset(r, 0, sizeof(struct spscRing));
+    return r;
+}
+
+/** Queue a message, returns 0 if the ring is full. Only the producer thread may call this. */
+int spscPush(struct spscRing *r, struct pipeMsg msg)
+{
+    unsigned int tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == PIPE_SLOTS)
+        return 0;
+    r->slots[tail & (PIPE_SLOTS - 1)] = msg;
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/** Take the oldest message, returns 0 if the ring is empty. Only the consumer thread may call this. */
+int spscPop(struct spscRing *r, struct pipeMsg *msg)
+{
+    unsigned int head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    if (head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+        return 0;
+    *msg = r->slots[head & (PIPE_SLOTS - 1)];
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+int spscEmpty(struct spscRing *r)
+{
+    return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+/** Whether the ring has room for another message. */
+int spscWritable(void *r)
+{
+    struct spscRing *ring = r;
+    return __atomic_load_n(&ring->tail, __ATOMIC_RELAXED) - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != PIPE_SLOTS;
+}
+
+int spscReadable(void *r)
+{
+    return !spscEmpty(r);
+}
+
+/**
+ * Wait until `ready(arg)` holds. We spin a little and then yield, which is all it takes while keys and frames are flowing,
+ * and then sleep on the pipeline's condition variable until another stage calls pipeSignal(), so an idle editor does not
+ * wake up at all. A sleeper counts itself in pipe_sleepers before checking `ready` one last time under the lock.
+ */
+void pipeWait(int (*ready)(void *), void *arg)
+{
+    int spins;
+    for (spins = 0; spins < 128; spins++)
+    {
+        if (ready(arg))
+            return;
+        if (spins >= 64)
+            sched_yield();
+    }
+    pthread_mutex_lock(&E.pipe_lock);
+    __atomic_add_fetch(&E.pipe_sleepers, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    while (!ready(arg))
+        pthread_cond_wait(&E.pipe_wake, &E.pipe_lock);
+    __atomic_sub_fetch(&E.pipe_sleepers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&E.pipe_lock);
+}
+
+/**
+ * Wake the stages sleeping in pipeWait() after changing something they may wait for.
+ * The fence orders our change before reading pipe_sleepers, and a sleeper counts itself before its last check,
+ * so either it sees the change or we see it and take the lock, which it holds until it is really asleep.
+ * Nobody sleeping, which is the common case while busy, costs no lock and no system call.
+ */
+void pipeSignal()
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&E.pipe_sleepers, __ATOMIC_SEQ_CST) == 0)
+        return;
+    pthread_mutex_lock(&E.pipe_lock);
+    pthread_cond_broadcast(&E.pipe_wake);
+    pthread_mutex_unlock(&E.pipe_lock);
+}
+
+void pipeSend(struct spscRing *r, struct pipeMsg msg)
+{
+    while (!spscPush(r, msg))
+        pipeWait(spscWritable, r);
+    pipeSignal();
+}
+
+struct pipeMsg pipeReceive(struct spscRing *r)
+{
+    struct pipeMsg msg;
+    while (!spscPop(r, &msg))
+        pipeWait(spscReadable, r);
+    pipeSignal();
+    return msg;
+}
+
+void sleepUntil(long long ns)
+{
+    long long now = monotonicNs();
+    if (now < ns)
+    {
+        struct timespec nap = {(ns - now) / 1000000000LL, (ns - now) % 1000000000LL};
+        nanosleep(&nap, NULL);
+    }
+}
+
+/**
+ * Read a key and tell when it arrived. A replay with --replay-rate makes the keys arrive at a steady pace like a typist would,
+ * and a key's arrival time is when it was due, so time spent waiting for the editor to get around to reading it counts as latency.
+ */
+int editorReadKeyTimed(long long *ns)
+{
+    int c = editorReadKey();
+    if (E.replay_rate > 0 && c != INPUT_EOF)
+    {
+        *ns = E.replay_start_ns + E.keys_arrived++ * 1000000000LL / E.replay_rate;
+        sleepUntil(*ns);
+    }
+    else
+        *ns = monotonicNs();
+    return c;
+}
+
+/** Input stage: parse keys as soon as they arrive and queue them. */
+void *inputThread(void *arg)
+{
+    (void)arg;
+    traceThreadName = "input";
+    while (1)
+    {
+        struct pipeMsg msg = {0, 0, 0};
+        msg.value = editorReadKeyTimed(&msg.ns);
+        pipeSend(E.keys, msg);
+        if (msg.value == INPUT_EOF)
+            return NULL;
+    }
+}
+
+/** Record how long the oldest key answered by a frame waited for that frame to be written. */
+void editorRecordLatency(long long key_ns)
+{
+    if (key_ns == 0 || E.num_latencies == E.latencies_cap)
+        return;
+    E.latencies[E.num_latencies++] = monotonicNs() - key_ns;
+}
+
+void editorWriteAll(const char *b, int len)
+{
+    TRACE_SCOPE("editorWriteAll");
+    TRACE_ARG("bytes", len);
+    // A replay can pretend to write to a terminal that only takes --replay-bps bytes per second
+    if (E.replay_bps > 0)
+        sleepUntil(monotonicNs() + len * 1000000000LL / E.replay_bps);
+    while (len > 0)
+    {
+        ssize_t n = write(E.output_fd, b, len);
+        if (n == -1)
+        {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return;
+        }
+        b += n;
+        len -= n;
+    }
+}
+
+/** Render stage: write frames to the terminal in order. */
+void *renderThread(void *arg)
+{
+    (void)arg;
+    traceThreadName = "render";
+    while (1)
+    {
+        struct pipeMsg msg = pipeReceive(E.frames);
+        editorWriteAll((char *)msg.value, msg.len);
+        editorRecordLatency(msg.ns);
+        free((char *)msg.value);
+        __atomic_add_fetch(&E.frames_written, 1, __ATOMIC_RELEASE);
+        pipeSignal();
+    }
+    return NULL;
+}
+
+/** Start the input and render stages. Without the pipeline the main thread reads and writes the terminal itself. */
+void editorStartPipeline()
+{
+    pthread_t t;
+    E.keys = spscNew();
+    E.frames = spscNew();
+    pthread_mutex_init(&E.pipe_lock, NULL);
+    pthread_cond_init(&E.pipe_wake, NULL);
+    if (pthread_create(&t, NULL, inputThread, NULL) != 0 || pthread_create(&t, NULL, renderThread, NULL) != 0)
+        die("pthread_create");
+    E.pipeline = 1;
+}
+
+/** Count keys per second for the stats overlay. Ticks close the window too, so the rate drops to 0 when typing stops. */
+void editorCountKey(int typed)
+{
+    long long now = monotonicNs(), elapsed = now - E.rate_start_ns;
+    E.rate_keys += typed;
+    if (elapsed >= 1000000000LL)
+    {
+        E.keys_per_sec = E.rate_keys * 1000000000LL / elapsed;
+        E.rate_start_ns = now;
+        E.rate_keys = 0;
+    }
+}
+
+/** Next key from the input, past the macro and the keys put aside. Once the input has ended every call returns INPUT_EOF. */
+int editorReadInputKey()
+{
+    if (E.input_ended)
+        return INPUT_EOF;
+    struct pipeMsg msg;
+    if (E.pipeline)
+        msg = pipeReceive(E.keys);
+    else
+        msg.value = editorReadKeyTimed(&msg.ns);
+    editorCountKey(msg.value != STATS_TICK);
+    if (msg.value == STATS_TICK)
+        return msg.value;
+    if (E.frame_key_ns == 0)
+        E.frame_key_ns = msg.ns;
+    if (msg.value == INPUT_EOF)
+        E.input_ended = 1;
+    else if (E.recording)
+        editorRecordKey(msg.value);
+    E.keys_read++;
+    return msg.value;
+}
+
+/**
+ * Next key for the edit stage: from the running macro, then the keys put aside by editorCancelRequested(), then the input.
+ * A macro that runs out of keys in the middle of a prompt or a two-key command gets Escape, which ends it, rather
+ * than keys from the terminal while nothing is drawn.
+ */
+int editorNextKey()
+{
+    if (E.playing)
+        return E.macro_pos < E.macro_len ? E.macro[E.macro_pos++] : '\x1b';
+    if (E.num_unread > 0)
+    {
+        int c = E.unread[0];
+        memmove(E.unread, E.unread + 1, --E.num_unread * sizeof(int));
+        return c;
+    }
+    return editorReadInputKey();
+}
+
+/** Whether the input has a key waiting, without blocking. */
+int editorInputPending()
+{
+    if (E.input_ended)
+        return 1;
+    if (E.pipeline)
+        return !spscEmpty(E.keys);
+    struct pollfd pfd = {E.input_fd, POLLIN, 0};
+    return poll(&pfd, 1, 0) == 1;
+}
+
+/** Whether a key is waiting, without blocking. */
+int editorKeyPending()
+{
+    return E.num_unread > 0 || editorInputPending();
+}
+
+/**
+ * Whether the user pressed Escape or Ctrl-C, for long jobs that look now and then without blocking. The other keys typed
+ * meanwhile are put aside, up to UNREAD_KEYS of them, and editorNextKey() hands them out once the job is done.
+ * Keys are read from the input even while a macro runs, the macro's own keys are not the user's.
+ */
+int editorCancelRequested()
+{
+    while (E.num_unread < UNREAD_KEYS && !E.input_ended && editorInputPending())
+    {
+        int c = editorReadInputKey();
+        if (c == '\x1b' || c == CTRL_KEY('c'))
+            return 1;
+        if (c != STATS_TICK)
+            E.unread[E.num_unread++] = c;
+    }
+    return 0;
+}
+
+/** Whether the render stage has written every frame sent so far. */
+int editorRenderDone(void *arg)
+{
+    (void)arg;
+    return __atomic_load_n(&E.frames_written, __ATOMIC_ACQUIRE) == E.frames_sent;
+}
+
+int editorRenderDoneOrKey(void *arg)
+{
+    return editorKeyPending() || editorRenderDone(arg);
+}
+
+/** Wait until the render stage has written every frame or a key is pending. Returns whether a key is pending. */
+int editorWaitForRenderOrKey()
+{
+    pipeWait(editorRenderDoneOrKey, NULL);
+    return editorKeyPending();
+}
+
+/** Hand a frame built in a malloc()'d buffer to the render stage, which frees it once written. */
+void editorWriteFrame(char *b, int len)
+{
+    E.frames_sent++;
+    E.bytes_sent += len;
+    if (!E.pipeline)
+    {
+        editorWriteAll(b, len);
+        editorRecordLatency(E.frame_key_ns);
+        free(b);
+    }
+    else
+    {
+        struct pipeMsg msg = {(intptr_t)b, len, E.frame_key_ns};
+        pipeSend(E.frames, msg);
+    }
+    E.frame_key_ns = 0;
+}
+
+/** Wait until the render stage has written every frame sent so far. */
+void editorFlushOutput()
+{
+    if (E.pipeline)
+        pipeWait(editorRenderDone, NULL);
+}
+
+/** Write a string to the terminal through the render stage, keeping it in order with the frames. */
+void editorWriteString(const char *s)
+{
+    editorWriteFrame(strdup(s), strlen(s));
+}
+
+int compareLongLong(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * End of a replay: print throughput and the distribution of key-to-frame latencies, the time between a key being read
+ * and the frame showing its effect being written out.
+ */
+void editorReplayReport()
+{
+    double secs = (monotonicNs() - E.replay_start_ns) / 1e9;
+    long long sum = 0;
+    int i;
+    qsort(E.latencies, E.num_latencies, sizeof(long long), compareLongLong);
+    for (i = 0; i < E.num_latencies; i++)
+        sum += E.latencies[i];
+    printf("replay: %s, %ld keys, %ld frames, %lld bytes in %.3f s, %.0f keys/s\n",
+           E.pipeline ? "pipeline" : "synchronous", E.keys_read, E.frames_sent, E.bytes_sent, secs,
+           secs > 0 ? E.keys_read / secs : 0);
+    if (E.load_ns > 0)
+        printf("load: %lld bytes in %.3f s, %.1f MB/s\n", E.load_bytes, E.load_ns / 1e9,
+               E.load_bytes / (1024.0 * 1024) / (E.load_ns / 1e9));
+    if (E.num_latencies > 0)
+        printf("latency us: mean %.1f p50 %.1f p99 %.1f max %.1f\n",
+               sum / 1e3 / E.num_latencies, E.latencies[E.num_latencies / 2] / 1e3,
+               E.latencies[(int)(E.num_latencies * 0.99)] / 1e3, E.latencies[E.num_latencies - 1] / 1e3);
+    printf("memory: caches peaked at %lld bytes, budget %zu bytes, %ld evicted, %ld row blocks frozen, %ld thawed\n",
+           E.mem_peak, E.mem_budget, E.mem_evicted, E.mem_frozen, E.mem_thawed);
+    printf("row store: %lld bytes of text in memory, %lld bytes compressed\n", E.mem_used[MEM_ROWS], E.mem_used[MEM_PACKED]);
+    if (E.intern)
+        printf("interning: %lld lines, %d distinct, %lld bytes kept as %lld, dedup ratio %.1fx\n",
+               E.intern_refs, E.intern_count, E.intern_bytes, E.intern_unique_bytes, internRatio());
+}
+
+/** row index */
+
+/** Sum of the numbers of the blocks before block `at`: the first row of that block, or the byte offset at which it starts. */
+long long rowIndexOffset(struct rowIndex *idx, int at)
+{
+    long long sum = 0;
+    int i;
+    if (at > idx->size)
+        at = idx->size;
+    for (i = at; i > 0; i -= i & -i)
+        sum += idx->tree[i];
+    return sum;
+}
+
+/** Sum of the numbers of all blocks. */
+long long rowIndexTotal(struct rowIndex *idx)
+{
+    return rowIndexOffset(idx, idx->size);
+}
+
+/** Add `delta` to the number of block `at`. Every tree node covering that block is updated. */
+void rowIndexAdd(struct rowIndex *idx, int at, long long delta)
+{
+    int i;
+    for (i = at + 1; i <= idx->size; i += i & -i)
+        idx->tree[i] += delta;
+}
+
+/**
+ * Append a block numbered `len` to the end of the index.
+ * The new node i covers blocks (i - lowbit(i), i], so its value is len plus the numbers of the blocks already in that
+ * range, which we can read off two prefix sums. That keeps appending rows to a grep buffer O(log n) per block.
+ */
+void rowIndexAppend(struct rowIndex *idx, long long len)
+{
+    if (idx->size + 1 >= idx->cap)
+    {
+        int cap = idx->cap ? idx->cap * 2 : 1024;
+        idx->tree = memRealloc(MEM_INDEX, idx->tree, sizeof(long long) * idx->cap, sizeof(long long) * cap);
+        idx->cap = cap;
+    }
+    int i = ++idx->size;
+    idx->tree[i] = len + rowIndexOffset(idx, i - 1) - rowIndexOffset(idx, i - (i & -i));
+}
+
+/**
+ * Turn tree[1..n], filled with the plain number of every block, into a Fenwick tree in O(n):
+ * every node adds its total into the next node that covers it, i + lowbit(i).
+ */
+void rowIndexBuild(struct rowIndex *idx, int n)
+{
+    int i;
+    idx->size = n;
+    for (i = 1; i <= n; i++)
+    {
+        int parent = i + (i & -i);
+        if (parent <= n)
+            idx->tree[parent] += idx->tree[i];
+    }
+}
+
+/** Make room for `n` blocks in the index. */
+void rowIndexReserve(struct rowIndex *idx, int n)
+{
+    if (n + 1 <= idx->cap)
+        return;
+    int cap = idx->cap ? idx->cap : 1024;
+    while (cap < n + 1)
+        cap *= 2;
+    idx->tree = memRealloc(MEM_INDEX, idx->tree, sizeof(long long) * idx->cap, sizeof(long long) * cap);
+    idx->cap = cap;
+}
+
+/**
+ * Find the block that contains `offset`, a row number or a byte offset.
+ * Instead of binary searching over prefix sums (O(log² n)) we walk down the tree from its highest power of two,
+ * skipping every node whose whole range still ends before `offset`. Offsets past the end map to the last block.
+ */
+int rowIndexFind(struct rowIndex *idx, long long offset)
+{
+    int pos = 0, step = 1;
+    if (idx->size == 0)
+        return 0;
+    while (step * 2 <= idx->size)
+        step *= 2;
+    for (; step > 0; step /= 2)
+    {
+        if (pos + step <= idx->size && idx->tree[pos + step] <= offset)
+        {
+            pos += step;
+            offset -= idx->tree[pos];
+        }
+    }
+    return pos < idx->size ? pos : idx->size - 1;
+}
+
+/** gutter */
+
+/**
+ * The gutter width only depends on the number of digits of the row count, so we only recompute it
+ * when the row count crosses a power of ten. Between those points this is a single comparison.
+ */
+void editorUpdateGutter(struct editorBuffer *b)
+{
+    if (E.line_numbers == LINE_NUMBERS_OFF || b->hex)
+    {
+        if (b->gutter_width != 0)
+            editorRedrawBuffer(b);
+        b->gutter_width = 0;
+        b->gutter_limit = 0;
+        return;
+    }
+    if (b->gutter_width != 0 && b->num_rows < b->gutter_limit &&
+        (b->gutter_limit == 10 || b->num_rows >= b->gutter_limit / 10))
+        return;
+
+    int digits = 1;
+    b->gutter_limit = 10;
+    while (b->num_rows >= b->gutter_limit && digits < GUTTER_MAX_DIGITS - 1)
+    {
+        digits++;
+        b->gutter_limit *= 10;
+    }
+    b->gutter_width = digits + 1;
+    editorRedrawBuffer(b);
+}
+
+/**
+ * A gutterLabel holds the digits of a line number right-aligned in a fixed-width field.
+ * Consecutive rows have consecutive numbers (or, in relative mode, numbers that count down to the cursor and back up),
+ * so we format the first visible number once and then increment or decrement the decimal string in place,
+ * which only touches the digits that carry. That saves calling snprintf() for every row of every frame.
+ */
+struct gutterLabel
+{
+    char digits[GUTTER_MAX_DIGITS];
+    int width;
+};
+
+void gutterLabelSet(struct gutterLabel *l, long long n)
+{
+    char buf[GUTTER_MAX_DIGITS + 1];
+    snprintf(buf, sizeof(buf), "%*lld", l->width, n);
+    memcpy(l->digits, buf, l->width);
+}
+
+void gutterLabelIncrement(struct gutterLabel *l)
+{
+    int i;
+    for (i = l->width - 1; i >= 0; i--)
+    {
+        if (l->digits[i] == ' ')
+        {
+            l->digits[i] = '1';
+            return;
+        }
+        if (l->digits[i] != '9')
+        {
+            l->digits[i]++;
+            return;
+        }
+        l->digits[i] = '0';
+    }
+}
+
+void gutterLabelDecrement(struct gutterLabel *l)
+{
+    int i;
+    for (i = l->width - 1; i >= 0; i--)
+    {
+        if (l->digits[i] != '0')
+        {
+            l->digits[i]--;
+            // A leading zero becomes a space again, "10" counts down to " 9"
+            if (l->digits[i] == '0' && i < l->width - 1 && (i == 0 || l->digits[i - 1] == ' '))
+                l->digits[i] = ' ';
+            return;
+        }
+        l->digits[i] = '9';
+    }
+}
+
+/**
+ * gutterCounter walks the labels of consecutive rows starting at `filerow`, for a cursor on row `cy`.
+ * In relative mode the cursor row shows its absolute number and every other row its distance from the cursor.
+ */
+struct gutterCounter
+{
+    struct gutterLabel label;
+    int filerow;
+    int cy;
+};
+
+void gutterCounterStart(struct gutterCounter *g, struct editorBuffer *b, int filerow, int cy)
+{
+    g->label.width = b->gutter_width - 1;
+    g->filerow = filerow;
+    g->cy = cy;
+    if (E.line_numbers == LINE_NUMBERS_RELATIVE && filerow != cy)
+        gutterLabelSet(&g->label, filerow < cy ? cy - filerow : filerow - cy);
+    else
+        gutterLabelSet(&g->label, filerow + 1);
+}
+
+void gutterCounterNext(struct gutterCounter *g)
+{
+    g->filerow++;
+    if (E.line_numbers != LINE_NUMBERS_RELATIVE)
+        gutterLabelIncrement(&g->label);
+    else if (g->filerow < g->cy)
+        gutterLabelDecrement(&g->label);
+    else if (g->filerow == g->cy)
+        gutterLabelSet(&g->label, g->filerow + 1);
+    else if (g->filerow == g->cy + 1)
+        gutterLabelSet(&g->label, 1);
+    else
+        gutterLabelIncrement(&g->label);
+}
+
+/** interning */
+
+/**
+ * A 64-bit hash in the style of wyhash: the input is read 8 or 16 bytes at a time and mixed with one 64x64->128-bit
+ * multiply per step, folding the high half back into the low one. Short lines, the common case, take a couple of
+ * overlapping loads and two multiplies. __int128 is a GCC extension, __extension__ keeps -pedantic quiet about it.
+ */
+__extension__ typedef unsigned __int128 hashU128;
+
+uint64_t hashMix(uint64_t a, uint64_t b)
+{
+    hashU128 r = (hashU128)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+uint64_t hashRead8(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+uint64_t hashRead4(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+uint64_t hashBytes(const char *key, size_t len)
+{
+    static const uint64_t s[4] = {0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull,
+                                  0x589965cc75374cc3ull};
+    const unsigned char *p = (const unsigned char *)key;
+    uint64_t seed = s[0], a, b;
+    if (len <= 16)
+    {
+        if (len >= 4)
+        {
+            a = hashRead4(p) << 32 | hashRead4(p + (len >> 3 << 2));
+            b = hashRead4(p + len - 4) << 32 | hashRead4(p + len - 4 - (len >> 3 << 2));
+        }
+        else if (len > 0)
+        {
+            a = (uint64_t)p[0] << 16 | (uint64_t)p[len >> 1] << 8 | p[len - 1];
+            b = 0;
+        }
+        else
+            a = b = 0;
+    }
+    else
+    {
+        size_t i = len;
+        while (i > 16)
+        {
+            seed = hashMix(hashRead8(p) ^ s[1], hashRead8(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = hashRead8(p + i - 16);
+        b = hashRead8(p + i - 8);
+    }
+    return hashMix(s[1] ^ len, hashMix(a ^ s[1], b ^ seed));
+}
+
+/** Copy `len` bytes into the interning pool for entry `e`, starting a new chunk when the current one is full. */
+char *internPoolCopy(struct internEntry *e, const char *s, int len)
+{
+    struct internPool *c = E.intern_pool;
+    if (c == NULL || c->len + len > c->cap)
+    {
+        size_t cap = len > 65536 ? len : 65536;
+        c = memAlloc(MEM_INTERN, sizeof(struct internPool) + cap);
+        c->next = E.intern_pool;
+        c->prev = NULL;
+        if (c->next != NULL)
+            c->next->prev = c;
+        c->len = 0;
+        c->cap = cap;
+        c->live = 0;
+        E.intern_pool = c;
+    }
+    char *p = c->text + c->len;
+    memcpy(p, s, len);
+    c->len += len;
+    c->live++;
+    e->chunk = c;
+    return p;
+}
+
+/** Entry `e` left chunk `c`: free the chunk if it was the last, or start over in it if it is the one being filled. */
+void internPoolRelease(struct internPool *c)
+{
+    if (--c->live > 0)
+        return;
+    if (c == E.intern_pool)
+    {
+        c->len = 0;
+        return;
+    }
+    c->prev->next = c->next;
+    if (c->next != NULL)
+        c->next->prev = c->prev;
+    memFree(MEM_INTERN, c, sizeof(struct internPool) + c->cap);
+}
+
+/** Double the table and put every entry back in its new slot. */
+void internGrow()
+{
+    int cap = E.intern_cap ? E.intern_cap * 2 : 4096, i;
+    struct internEntry *table = memCalloc(MEM_INTERN, cap, sizeof(struct internEntry));
+    for (i = 0; i < E.intern_cap; i++)
+    {
+        struct internEntry *e = &E.intern_table[i];
+        if (e->text == NULL)
+            continue;
+        int slot = e->hash & (cap - 1);
+        while (table[slot].text != NULL)
+            slot = (slot + 1) & (cap - 1);
+        table[slot] = *e;
+    }
+    memFree(MEM_INTERN, E.intern_table, sizeof(struct internEntry) * E.intern_cap);
+    E.intern_table = table;
+    E.intern_cap = cap;
+}
+
+/**
+ * Return the interned copy of the `len` bytes at `s`, adding it if this is the first time we see them.
+ * Slots are probed linearly from the hash, and the table is kept at most half full so probes stay short.
+ */
+char *internText(const char *s, int len)
+{
+    if (2 * (E.intern_count + 1) > E.intern_cap)
+        internGrow();
+    uint64_t h = hashBytes(s, len);
+    int slot = h & (E.intern_cap - 1);
+    while (E.intern_table[slot].text != NULL)
+    {
+        struct internEntry *e = &E.intern_table[slot];
+        if (e->hash == h && e->len == len && memcmp(e->text, s, len) == 0)
+        {
+            e->refs++;
+            E.intern_refs++;
+            E.intern_bytes += len;
+            return e->text;
+        }
+        slot = (slot + 1) & (E.intern_cap - 1);
+    }
+    struct internEntry *e = &E.intern_table[slot];
+    e->hash = h;
+    e->len = len;
+    e->refs = 1;
+    // Empty lines still need a pointer that is not NULL, so they get one byte
+    e->text = internPoolCopy(e, len ? s : "", len ? len : 1);
+    E.intern_count++;
+    E.intern_refs++;
+    E.intern_bytes += len;
+    E.intern_unique_bytes += len;
+    return e->text;
+}
+
+/**
+ * A row no longer points at `text`, `len` bytes returned by internText(). The last row to let go of a line takes it
+ * out of the table, shifting back the entries probed past its slot so that no probe stops early at the hole. Text
+ * that is not in the table is left alone.
+ */
+void internRelease(const char *text, int len)
+{
+    if (E.intern_cap == 0 || text == NULL)
+        return;
+    int mask = E.intern_cap - 1, slot = hashBytes(text, len) & mask, j;
+    while (E.intern_table[slot].text != text)
+    {
+        if (E.intern_table[slot].text == NULL)
+            return;
+        slot = (slot + 1) & mask;
+    }
+    struct internEntry *e = &E.intern_table[slot];
+    e->refs--;
+    E.intern_refs--;
+    E.intern_bytes -= len;
+    if (e->refs > 0)
+        return;
+    internPoolRelease(e->chunk);
+    E.intern_count--;
+    E.intern_unique_bytes -= len;
+    e->text = NULL;
+    for (j = (slot + 1) & mask; E.intern_table[j].text != NULL; j = (j + 1) & mask)
+    {
+        int home = E.intern_table[j].hash & mask;
+        // The entry at j may fill the hole unless its home slot lies cyclically in (slot, j]
+        if (slot <= j ? (home <= slot || home > j) : (home <= slot && home > j))
+        {
+            E.intern_table[slot] = E.intern_table[j];
+            E.intern_table[j].text = NULL;
+            slot = j;
+        }
+    }
+}
+
+/** How many times less memory the interned lines take than separate copies, or 1 when nothing was interned. */
+double internRatio()
+{
+    return E.intern_unique_bytes ? (double)E.intern_bytes / E.intern_unique_bytes : 1;
+}
+
+/** row store */
+
+#define LZ4_HASH_LOG 12      // The compressor remembers the last position of 4096 hashes of 4 bytes
+#define LZ4_LAST_LITERALS 5  // The format wants the last 5 bytes to be literals
+#define LZ4_MFLIMIT 12       // and no match to start in the last 12
+
+/**
+ * A compressor for the LZ4 block format, small enough to live here instead of adding a dependency. The output is a list
+ * of sequences: a token byte with the literal count in its high nibble and the match length minus 4 in its low nibble,
+ * extra length bytes when a nibble is 15, the literals, then a 2-byte offset back to the match. The last sequence only
+ * has literals. We hash every 4 bytes into a table of positions and take the first match it offers, which is what
+ * the reference implementation does at its fastest level and gives 3-5x on text for a few hundred MB/s.
+ */
+int lz4Bound(int n)
+{
+    return n + n / 255 + 16;
+}
+
+void lz4PutLength(unsigned char **op, int len)
+{
+    while (len >= 255)
+    {
+        *(*op)++ = 255;
+        len -= 255;
+    }
+    *(*op)++ = len;
+}
+
+/** Compress `n` bytes from `src` to `dst`, which must have room for lz4Bound(n) bytes. Returns the compressed size. */
+int lz4Compress(const char *src, int n, char *dst)
+{
+    const unsigned char *base = (const unsigned char *)src, *ip = base, *anchor = base, *end = base + n;
+    unsigned char *op = (unsigned char *)dst;
+    int table[1 << LZ4_HASH_LOG]; // Positions plus one, 0 is an empty slot
+    int lit;
+    memset(table, 0, sizeof(table));
+
+    if (n > LZ4_MFLIMIT)
+    {
+        const unsigned char *mflimit = end - LZ4_MFLIMIT, *matchlimit = end - LZ4_LAST_LITERALS;
+        while (ip <= mflimit)
+        {
+            uint32_t seq;
+            memcpy(&seq, ip, 4);
+            int h = (seq * 2654435761u) >> (32 - LZ4_HASH_LOG);
+            const unsigned char *ref = table[h] ? base + table[h] - 1 : NULL;
+            table[h] = ip - base + 1;
+            if (ref == NULL || ip - ref > 65535 || memcmp(ref, ip, 4) != 0)
+            {
+                ip++;
+                continue;
+            }
+
+            const unsigned char *m = ip + 4, *r = ref + 4;
+            while (m < matchlimit && *m == *r)
+            {
+                m++;
+                r++;
+            }
+            int mlen = m - ip - 4, offset = ip - ref;
+            lit = ip - anchor;
+            unsigned char *token = op++;
+            *token = (lit >= 15 ? 15 : lit) << 4 | (mlen >= 15 ? 15 : mlen);
+            if (lit >= 15)
+                lz4PutLength(&op, lit - 15);
+            memcpy(op, anchor, lit);
+            op += lit;
+            *op++ = offset & 0xff;
+            *op++ = offset >> 8;
+            if (mlen >= 15)
+                lz4PutLength(&op, mlen - 15);
+            ip = anchor = m;
+        }
+    }
+
+    lit = end - anchor;
+    *op++ = (lit >= 15 ? 15 : lit) << 4;
+    if (lit >= 15)
+        lz4PutLength(&op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    return op - (unsigned char *)dst;
+}
+
+/**
+ * Decompress `n` bytes of LZ4 from `src` into `dst`, which has room for `cap` bytes.
+ * Returns the decompressed size, or -1 if the input is not valid LZ4 or does not fit.
+ */
+int lz4Decompress(const char *src, int n, char *dst, int cap)
+{
+    const unsigned char *ip = (const unsigned char *)src, *end = ip + n;
+    unsigned char *op = (unsigned char *)dst, *oend = op + cap;
+    while (ip < end)
+    {
+        int token = *ip++, lit = token >> 4, mlen = token & 15, b;
+        if (lit == 15)
+            do
+            {
+                if (ip >= end)
+                    return -1;
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        if (lit > end - ip || lit > oend - op)
+            return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == end)
+            break;
+
+        if (end - ip < 2)
+            return -1;
+        int offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > op - (unsigned char *)dst)
+            return -1;
+        if (mlen == 15)
+            do
+            {
+                if (ip >= end)
+                    return -1;
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        mlen += 4;
+        if (mlen > oend - op)
+            return -1;
+        // A match can overlap the bytes it produces, like a run of one repeated byte, then it is copied a byte at a time
+        const unsigned char *ref = op - offset;
+        if (offset >= mlen)
+            memcpy(op, ref, mlen);
+        else
+            for (b = 0; b < mlen; b++)
+                op[b] = ref[b];
+        op += mlen;
+    }
+    return op - (unsigned char *)dst;
+}
+
+/** Whether the text of a row belongs to the row store rather than to the mapping. Rows of a frozen block have NULL chars. */
+int editorRowOwned(struct editorBuffer *b, erow *row)
+{
+    return b->map == NULL || row->chars < b->map || row->chars >= b->map + b->map_len;
+}
+
+/** Whether the text of a row is in its block's arena: it belongs to the row store and was not interned. */
+int editorRowInArena(struct editorBuffer *b, erow *row)
+{
+    return !E.intern && editorRowOwned(b, row);
+}
+
+/** A new block with no rows and room for `cap` of them. */
+struct rowBlock *blockNew(int cap)
+{
+    struct rowBlock *k = memCalloc(MEM_INDEX, 1, sizeof(struct rowBlock));
+    k->row = memAlloc(MEM_INDEX, sizeof(erow) * cap);
+    k->lens = memAlloc(MEM_INDEX, sizeof(int) * cap);
+    k->rows_cap = cap;
+    return k;
+}
+
+/** Make room for `n` rows in block `k`. */
+void blockReserveRows(struct rowBlock *k, int n)
+{
+    if (n <= k->rows_cap)
+        return;
+    int cap = k->rows_cap ? k->rows_cap * 2 : STORE_BLOCK_ROWS;
+    while (cap < n)
+        cap *= 2;
+    k->row = memRealloc(MEM_INDEX, k->row, sizeof(erow) * k->rows_cap, sizeof(erow) * cap);
+    k->lens = memRealloc(MEM_INDEX, k->lens, sizeof(int) * k->rows_cap, sizeof(int) * cap);
+    k->rows_cap = cap;
+}
+
+/** Free the render cache of a row of block `k`. */
+void editorFreeRender(struct rowBlock *k, erow *row)
+{
+    if (row->render != NULL && row->render != row->chars)
+    {
+        memFree(MEM_RENDER, row->render, row->rsize + 1);
+        k->rendered--;
+    }
+    row->render = NULL;
+    row->rsize = 0;
+}
+
+/** Free the render caches of the rows of block `k`, if it has any that are not the row text itself. */
+void blockDropRender(struct rowBlock *k)
+{
+    int i;
+    for (i = 0; i < k->num_rows && k->rendered > 0; i++)
+        editorFreeRender(k, &k->row[i]);
+}
+
+/** Let go of the interned text of `n` rows of block `k` of `b` from row `at` on, see internRelease(). */
+void blockReleaseRows(struct editorBuffer *b, struct rowBlock *k, int at, int n)
+{
+    int i;
+    if (!E.intern || k->row == NULL)
+        return;
+    for (i = at; i < at + n; i++)
+        if (editorRowOwned(b, &k->row[i]))
+            internRelease(k->row[i].chars, k->row[i].size);
+}
+
+/** Free block `k` of `b` and everything it holds. */
+void blockFree(struct editorBuffer *b, struct rowBlock *k)
+{
+    blockReleaseRows(b, k, 0, k->num_rows);
+    blockDropRender(k);
+    memFree(MEM_ROWS, k->text, k->cap);
+    memFree(MEM_PACKED, k->packed, k->packed_len);
+    memFree(MEM_INDEX, k->row, sizeof(erow) * k->rows_cap);
+    memFree(MEM_INDEX, k->lens, sizeof(int) * k->rows_cap);
+    memFree(MEM_INDEX, k, sizeof(struct rowBlock));
+}
+
+/**
+ * Point `row` at the line of the mapping in map[start, end), `end` being where its terminator starts. The carriage
+ * returns before the terminator are not part of the row.
+ */
+void rowMap(struct editorBuffer *b, erow *row, size_t start, size_t end)
+{
+    row->chars = b->map + start;
+    row->size = end - start;
+    if (b->encoding == ENCODING_UTF16LE)
+        while (row->size >= 2 && row->chars[row->size - 2] == '\r' && row->chars[row->size - 1] == '\0')
+            row->size -= 2;
+    else if (b->encoding == ENCODING_UTF16BE)
+        while (row->size >= 2 && row->chars[row->size - 2] == '\0' && row->chars[row->size - 1] == '\r')
+            row->size -= 2;
+    else
+        while (row->size > 0 && row->chars[row->size - 1] == '\r')
+            row->size--;
+    row->render = NULL;
+    row->rsize = 0;
+}
+
+/** Find the rows of unloaded block `k` in the mapping again, from where they start and their lengths. */
+void editorLoadBlock(struct editorBuffer *b, struct rowBlock *k)
+{
+    long long off = k->map_off;
+    int i, unit = encodingUnit(b->encoding);
+    k->row = memAlloc(MEM_INDEX, sizeof(erow) * k->rows_cap);
+    for (i = 0; i < k->num_rows; i++)
+    {
+        long long end = off + k->lens[i] - unit;
+        rowMap(b, &k->row[i], off, end < (long long)b->map_len ? end : (long long)b->map_len);
+        off += k->lens[i];
+    }
+}
+
+/**
+ * Unload block `k` of `b` if all its rows lie one after the other in the mapping, just as editorLoadBlock() would find
+ * them again. Blocks with rows of their own, or rows moved around by edits, stay as they are.
+ */
+void editorUnloadBlock(struct editorBuffer *b, struct rowBlock *k)
+{
+    int i, unit = encodingUnit(b->encoding);
+    if (k->row == NULL || k->num_rows == 0 || k->rendered > 0 || k->text != NULL || k->frozen ||
+        editorRowOwned(b, &k->row[0]))
+        return;
+    long long start = k->row[0].chars - b->map, off = start;
+    for (i = 0; i < k->num_rows; i++)
+    {
+        erow *row = &k->row[i], mapped;
+        long long end = off + k->lens[i] - unit;
+        if (editorRowOwned(b, row) || row->chars != b->map + off)
+            return;
+        rowMap(b, &mapped, off, end < (long long)b->map_len ? end : (long long)b->map_len);
+        if (mapped.size != row->size)
+            return;
+        off += k->lens[i];
+    }
+    for (i = 0; i < k->num_rows; i++)
+        k->row[i].render = NULL; // Render caches that were the row text itself
+    memFree(MEM_INDEX, k->row, sizeof(erow) * k->rows_cap);
+    k->row = NULL;
+    k->map_off = start;
+}
+
+/** Decompress frozen block `k` into a new arena, and point its rows back at their text. */
+void editorThawBlock(struct rowBlock *k)
+{
+    TRACE_SCOPE("editorThawBlock");
+    int i;
+    size_t off = 0;
+    k->cap = k->raw_len ? k->raw_len : 1;
+    k->text = memAlloc(MEM_ROWS, k->cap);
+    if (lz4Decompress(k->packed, k->packed_len, k->text, k->raw_len) != k->raw_len)
+        die("lz4Decompress");
+    k->len = k->raw_len;
+    for (i = 0; i < k->num_rows; i++)
+    {
+        if (k->row[i].chars == NULL)
+        {
+            k->row[i].chars = k->text + off;
+            off += k->row[i].size;
+        }
+    }
+    k->frozen = 0;
+    k->dirty = 0;
+    E.mem_thawed++;
+}
+
+/**
+ * Freeze block `k` of `b`: compress the text of the rows in its arena, unless the compressed copy made by an earlier freeze is
+ * still good, and free the arena. Only the live text of each row is compressed, so text left behind in the arena
+ * by rows that got new text is dropped here. Render caches that were the row text itself go with it.
+ */
+void editorFreezeBlock(struct editorBuffer *b, struct rowBlock *k)
+{
+    TRACE_SCOPE("editorFreezeBlock");
+    int i;
+    if (k->frozen || k->text == NULL)
+        return;
+
+    if (k->dirty || k->packed == NULL)
+    {
+        size_t raw = 0;
+        for (i = 0; i < k->num_rows; i++)
+            if (editorRowInArena(b, &k->row[i]))
+                raw += k->row[i].size;
+        char *run = malloc(raw + 1), *packed = memAlloc(MEM_PACKED, lz4Bound(raw));
+        if (run == NULL)
+            die("malloc");
+        raw = 0;
+        for (i = 0; i < k->num_rows; i++)
+        {
+            if (editorRowInArena(b, &k->row[i]))
+            {
+                memcpy(run + raw, k->row[i].chars, k->row[i].size);
+                raw += k->row[i].size;
+            }
+        }
+        int n = lz4Compress(run, raw, packed);
+        free(run);
+        memFree(MEM_PACKED, k->packed, k->packed_len);
+        k->packed = memRealloc(MEM_PACKED, packed, lz4Bound(raw), n);
+        k->packed_len = n;
+        k->raw_len = raw;
+    }
+
+    for (i = 0; i < k->num_rows; i++)
+    {
+        erow *row = &k->row[i];
+        if (!editorRowInArena(b, row))
+            continue;
+        if (row->render == row->chars)
+        {
+            row->render = NULL;
+            row->rsize = 0;
+        }
+        row->chars = NULL;
+    }
+    memFree(MEM_ROWS, k->text, k->cap);
+    k->text = NULL;
+    k->len = k->cap = 0;
+    k->frozen = 1;
+    E.mem_frozen++;
+}
+
+/**
+ * Make room for `len` more bytes of text in the arena of block `k`, thawing it if it is frozen. A full arena is replaced
+ * by one that holds only the live text of the rows, so the text left behind by rows that got new text is dropped, with
+ * room to spare for twice as much. `len` bytes that are already in the arena would go with the old one.
+ */
+void blockReserveText(struct editorBuffer *b, struct rowBlock *k, size_t len)
+{
+    if (k->frozen)
+        editorThawBlock(k);
+    if (k->len + len <= k->cap)
+        return;
+    size_t live = 0, cap = 4096;
+    int i;
+    for (i = 0; i < k->num_rows; i++)
+        if (editorRowInArena(b, &k->row[i]))
+            live += k->row[i].size;
+    while (cap < 2 * (live + len))
+        cap *= 2;
+    char *text = memAlloc(MEM_ROWS, cap);
+    live = 0;
+    for (i = 0; i < k->num_rows; i++)
+    {
+        erow *row = &k->row[i];
+        if (!editorRowInArena(b, row))
+            continue;
+        if (row->size > 0)
+            memcpy(text + live, row->chars, row->size);
+        if (row->render == row->chars)
+            row->render = text + live;
+        row->chars = text + live;
+        live += row->size;
+    }
+    memFree(MEM_ROWS, k->text, k->cap);
+    k->text = text;
+    k->len = live;
+    k->cap = cap;
+    k->dirty = 1;
+}
+
+/** Copy `len` bytes of text into the arena of block `k` and return where they went. */
+char *editorStoreText(struct editorBuffer *b, struct rowBlock *k, const char *s, size_t len)
+{
+    blockReserveText(b, k, len);
+    char *p = k->text + k->len;
+    if (len > 0)
+        memcpy(p, s, len);
+    k->len += len;
+    k->dirty = 1;
+    k->used = ++E.mem_tick;
+    return p;
+}
+
+/**
+ * Give `row` of block `k` its own copy of `len` bytes of text: in the interning table with --intern, so identical lines share one copy,
+ * or else in the arena of the block.
+ */
+void editorSetRowText(struct editorBuffer *b, struct rowBlock *k, erow *row, const char *s, size_t len)
+{
+    if (E.intern && row->chars != NULL && editorRowOwned(b, row))
+        internRelease(row->chars, row->size);
+    char *chars = E.intern ? internText(s, len) : editorStoreText(b, k, s, len);
+    row->chars = chars;
+    row->size = len;
+}
+
+/** Make sure the text of the rows of block `k` is in memory, thawing it if it is frozen, and mark it as used. */
+void editorTouchBlock(struct rowBlock *k)
+{
+    if (k->frozen)
+        editorThawBlock(k);
+    k->used = ++E.mem_tick;
+}
+
+/**
+ * Put `n` rows of block `src`, from row `from` on, in block `dst` at row `at`. Their text that was in the arena of `src`
+ * is copied into the arena of `dst`, the rest keeps pointing where it did. The rows stay in `src` until
+ * blockRemoveRows() takes them out.
+ */
+void blockMoveRows(struct editorBuffer *b, struct rowBlock *dst, int at, struct rowBlock *src, int from, int n)
+{
+    size_t text = 0;
+    int i, rendered = 0;
+    if (src->row == NULL)
+        editorLoadBlock(b, src);
+    if (dst->row == NULL)
+        editorLoadBlock(b, dst);
+    if (src->frozen)
+        editorThawBlock(src);
+    for (i = from; i < from + n; i++)
+        if (editorRowInArena(b, &src->row[i]))
+            text += src->row[i].size;
+    if (text > 0 || dst->frozen)
+        blockReserveText(b, dst, text);
+    blockReserveRows(dst, dst->num_rows + n);
+    memmove(&dst->row[at + n], &dst->row[at], sizeof(erow) * (dst->num_rows - at));
+    memmove(&dst->lens[at + n], &dst->lens[at], sizeof(int) * (dst->num_rows - at));
+    for (i = 0; i < n; i++)
+    {
+        erow *row = &dst->row[at + i];
+        *row = src->row[from + i];
+        dst->lens[at + i] = src->lens[from + i];
+        dst->bytes += dst->lens[at + i];
+        if (row->render != NULL && row->render != row->chars)
+            rendered++;
+        if (editorRowInArena(b, row))
+        {
+            char *p = dst->text + dst->len;
+            if (row->size > 0)
+                memcpy(p, row->chars, row->size);
+            if (row->render == row->chars)
+                row->render = p;
+            row->chars = p;
+            dst->len += row->size;
+        }
+    }
+    if (text > 0)
+        dst->dirty = 1;
+    dst->num_rows += n;
+    dst->rendered += rendered;
+    src->rendered -= rendered;
+    if (rendered > 0 && src->drawn > dst->drawn)
+        dst->drawn = src->drawn;
+    dst->used = ++E.mem_tick;
+}
+
+/** Take `n` rows out of block `k` from row `at` on. Whatever they own must have been freed or moved elsewhere. */
+void blockRemoveRows(struct rowBlock *k, int at, int n)
+{
+    int i;
+    for (i = at; i < at + n; i++)
+        k->bytes -= k->lens[i];
+    memmove(&k->row[at], &k->row[at + n], sizeof(erow) * (k->num_rows - at - n));
+    memmove(&k->lens[at], &k->lens[at + n], sizeof(int) * (k->num_rows - at - n));
+    k->num_rows -= n;
+}
+
+/** Free what `n` rows of block `k` of `b` own from row `at` on, and take them out of it. */
+void blockFreeRows(struct editorBuffer *b, struct rowBlock *k, int at, int n)
+{
+    int i;
+    blockReleaseRows(b, k, at, n);
+    for (i = at; i < at + n && k->rendered > 0; i++)
+        editorFreeRender(k, &k->row[i]);
+    blockRemoveRows(k, at, n);
+}
+
+/** Add block `k` to the end of `list`. */
+void blockListPush(struct blockList *list, struct rowBlock *k)
+{
+    if (list->num == list->cap)
+    {
+        int cap = list->cap ? list->cap * 2 : 16;
+        list->blocks = memRealloc(MEM_INDEX, list->blocks, sizeof(struct rowBlock *) * list->cap, sizeof(struct rowBlock *) * cap);
+        list->cap = cap;
+    }
+    list->blocks[list->num++] = k;
+}
+
+/** The last block of `list` if rows can still be added to it, or else a new one. */
+struct rowBlock *blockListTail(struct blockList *list)
+{
+    struct rowBlock *k = list->num > 0 ? list->blocks[list->num - 1] : NULL;
+    if (k == NULL || k->frozen || k->num_rows >= STORE_BLOCK_ROWS)
+        blockListPush(list, k = blockNew(STORE_BLOCK_ROWS));
+    return k;
+}
+
+/** Add a row of `len` bytes of `s` to the end of `list`, with its own copy of the text. `linelen` is as for editorAppendRow(). */
+void blockListAdd(struct editorBuffer *b, struct blockList *list, const char *s, int len, int linelen)
+{
+    struct rowBlock *k = blockListTail(list);
+    erow *row = &k->row[k->num_rows];
+    row->chars = NULL;
+    row->size = 0;
+    row->render = NULL;
+    row->rsize = 0;
+    k->lens[k->num_rows++] = linelen;
+    k->bytes += linelen;
+    editorSetRowText(b, k, row, s, len);
+}
+
+/** Move `n` rows of block `k` of `b`, from row `at` on, to the end of `list`. Their render caches are dropped. */
+void blockListTake(struct editorBuffer *b, struct blockList *list, struct rowBlock *k, int at, int n)
+{
+    int i;
+    for (i = at; i < at + n && k->rendered > 0; i++)
+        editorFreeRender(k, &k->row[i]);
+    struct rowBlock *tail = blockListTail(list);
+    blockMoveRows(b, tail, tail->num_rows, k, at, n);
+    blockRemoveRows(k, at, n);
+}
+
+/** Move the text of the rows of `list`, all in the arenas of their blocks, into the interning table, and free the arenas. */
+void blockListIntern(struct blockList *list)
+{
+    int i, j;
+    for (i = list->next; i < list->num; i++)
+    {
+        struct rowBlock *k = list->blocks[i];
+        for (j = 0; j < k->num_rows; j++)
+            k->row[j].chars = internText(k->row[j].chars, k->row[j].size);
+        memFree(MEM_ROWS, k->text, k->cap);
+        k->text = NULL;
+        k->len = k->cap = 0;
+    }
+}
+
+/** Bytes the blocks of `list` keep: rows, lengths, arenas and compressed copies. */
+long long blockListBytes(struct blockList *list)
+{
+    long long bytes = sizeof(struct rowBlock *) * list->cap;
+    int i;
+    for (i = list->next; i < list->num; i++)
+    {
+        struct rowBlock *k = list->blocks[i];
+        bytes += sizeof(struct rowBlock) + (k->row ? sizeof(erow) : 0) * k->rows_cap + sizeof(int) * k->rows_cap + k->cap +
+                 k->packed_len;
+    }
+    return bytes;
+}
+
+/** Free the blocks of `list` whose rows were not taken, rows of `b`. */
+void blockListFree(struct editorBuffer *b, struct blockList *list)
+{
+    int i;
+    for (i = list->next; i < list->num; i++)
+        blockFree(b, list->blocks[i]);
+    memFree(MEM_INDEX, list->blocks, sizeof(struct rowBlock *) * list->cap);
+    memset(list, 0, sizeof(*list));
+}
+
+/** row lookup */
+
+/** Build the row index of `b` over its blocks again, in O(number of blocks). */
+void editorIndexRebuild(struct editorBuffer *b)
+{
+    int i;
+    rowIndexReserve(&b->index_rows, b->num_blocks);
+    rowIndexReserve(&b->index_bytes, b->num_blocks);
+    for (i = 0; i < b->num_blocks; i++)
+    {
+        b->index_rows.tree[i + 1] = b->blocks[i]->num_rows;
+        b->index_bytes.tree[i + 1] = b->blocks[i]->bytes;
+    }
+    rowIndexBuild(&b->index_rows, b->num_blocks);
+    rowIndexBuild(&b->index_bytes, b->num_blocks);
+}
+
+/** Bring the row index up to date with block `blk` of `b`, whose rows changed, in O(log n). */
+void editorIndexSync(struct editorBuffer *b, int blk)
+{
+    struct rowBlock *k = b->blocks[blk];
+    rowIndexAdd(&b->index_rows, blk, k->num_rows - (rowIndexOffset(&b->index_rows, blk + 1) - rowIndexOffset(&b->index_rows, blk)));
+    rowIndexAdd(&b->index_bytes, blk, k->bytes - (rowIndexOffset(&b->index_bytes, blk + 1) - rowIndexOffset(&b->index_bytes, blk)));
+}
+
+/** Make room for `n` blocks in `b`. */
+void editorReserveBlocks(struct editorBuffer *b, int n)
+{
+    if (n <= b->blocks_cap)
+        return;
+    int cap = b->blocks_cap ? b->blocks_cap * 2 : 16;
+    while (cap < n)
+        cap *= 2;
+    b->blocks = memRealloc(MEM_INDEX, b->blocks, sizeof(struct rowBlock *) * b->blocks_cap, sizeof(struct rowBlock *) * cap);
+    b->blocks_cap = cap;
+}
+
+/** Insert `n` blocks into `b` before block `at`. The row index must be built again afterwards. */
+void editorInsertBlocks(struct editorBuffer *b, int at, struct rowBlock **blocks, int n)
+{
+    editorReserveBlocks(b, b->num_blocks + n);
+    memmove(&b->blocks[at + n], &b->blocks[at], sizeof(struct rowBlock *) * (b->num_blocks - at));
+    memcpy(&b->blocks[at], blocks, sizeof(struct rowBlock *) * n);
+    b->num_blocks += n;
+}
+
+/**
+ * The block of `b` that holds row `at`, with the row's place in it in `*off`. Row num_rows is found just past the
+ * end of the last block. A buffer with no rows has no blocks, then this is 0 with `*off` 0.
+ */
+int editorFindRow(struct editorBuffer *b, int at, int *off)
+{
+    if (b->num_blocks == 0)
+    {
+        *off = 0;
+        return 0;
+    }
+    int blk = rowIndexFind(&b->index_rows, at);
+    *off = at - rowIndexOffset(&b->index_rows, blk);
+    return blk;
+}
+
+/** Block `blk` of `b`, loading its rows again if it was unloaded while the buffer was hidden. */
+struct rowBlock *editorBlock(struct editorBuffer *b, int blk)
+{
+    struct rowBlock *k = b->blocks[blk];
+    if (k->row == NULL)
+        editorLoadBlock(b, k);
+    return k;
+}
+
+/** Row `at` of `b`, in O(log n). */
+erow *editorRow(struct editorBuffer *b, int at)
+{
+    int off, blk = editorFindRow(b, at, &off);
+    return &editorBlock(b, blk)->row[off];
+}
+
+/** Start walking the rows of `b` from row `at` on. */
+void rowIterStart(struct rowIter *it, struct editorBuffer *b, int at)
+{
+    it->b = b;
+    it->blk = editorFindRow(b, at, &it->off);
+}
+
+/**
+ * The next row of a walk, there must be one. An unloaded block is loaded on the way, so walks on other threads only
+ * go over rows that editorThawRows() got ready.
+ */
+erow *rowIterNext(struct rowIter *it)
+{
+    struct rowBlock *k = editorBlock(it->b, it->blk);
+    while (it->off == k->num_rows)
+    {
+        k = editorBlock(it->b, ++it->blk);
+        it->off = 0;
+    }
+    return &k->row[it->off++];
+}
+
+/** The row a walk is at, without moving past it. */
+erow *rowIterPeek(struct rowIter *it)
+{
+    erow *row = rowIterNext(it);
+    it->off--;
+    return row;
+}
+
+/** Bytes of the file, as it would be written out. */
+long long editorTotalBytes(struct editorBuffer *b)
+{
+    long long total = rowIndexTotal(&b->index_bytes) - b->no_eol;
+    return total > 0 ? total : 0;
+}
+
+/** Byte offset at which row `at` starts: the offset of its block from the row index, and the rows before it in the block. */
+long long editorRowOffset(struct editorBuffer *b, int at)
+{
+    int off, blk = editorFindRow(b, at, &off), i;
+    if (b->num_blocks == 0)
+        return 0;
+    long long offset = rowIndexOffset(&b->index_bytes, blk);
+    for (i = 0; i < off; i++)
+        offset += b->blocks[blk]->lens[i];
+    return offset;
+}
+
+/** The row that contains byte `offset`. Offsets past the end map to the last row. */
+int editorRowAtOffset(struct editorBuffer *b, long long offset)
+{
+    int i;
+    if (b->num_blocks == 0)
+        return 0;
+    int blk = rowIndexFind(&b->index_bytes, offset);
+    struct rowBlock *k = b->blocks[blk];
+    offset -= rowIndexOffset(&b->index_bytes, blk);
+    for (i = 0; i < k->num_rows - 1 && offset >= k->lens[i]; i++)
+        offset -= k->lens[i];
+    return rowIndexOffset(&b->index_rows, blk) + i;
+}
+
+/** Percentage of the file that lies before row `at`. */
+int editorRowPercent(struct editorBuffer *b, int at)
+{
+    long long total = editorTotalBytes(b);
+    if (total == 0)
+        return 100;
+    return (int)(editorRowOffset(b, at) * 100 / total);
+}
+
+/** memory budget */
+
+/** The default budget is a fraction of the physical memory, 256 MB if we cannot find out how much there is. */
+size_t memDefaultBudget()
+{
+    long pages = sysconf(_SC_PHYS_PAGES), page_size = sysconf(_SC_PAGESIZE);
+    if (pages <= 0 || page_size <= 0)
+        return (size_t)256 * 1024 * 1024;
+    return (size_t)pages * page_size / MEMORY_BUDGET_FRACTION;
+}
+
+/** Parse a size in bytes with an optional K, M or G suffix, like 512K or 2G. Returns 0 if it is not one. */
+size_t parseSize(const char *s)
+{
+    char *end;
+    double n = strtod(s, &end);
+    if (end == s || n <= 0)
+        return 0;
+    switch (toupper((unsigned char)*end))
+    {
+    case 'G':
+        n *= 1024;
+        /* fall through */
+    case 'M':
+        n *= 1024;
+        /* fall through */
+    case 'K':
+        n *= 1024;
+        end++;
+        break;
+    }
+    return *end == '\0' ? (size_t)n : 0;
+}
+
+/**
+ * Whether rows [first, last) of `b` are on screen in some window, or within a screen of it and so likely to be
+ * scrolled to next. A window showing the buffer in hex does not use its rows at all.
+ */
+int editorRowsNearView(struct editorBuffer *b, int first, int last)
+{
+    int i;
+    for (i = 0; i < E.num_windows; i++)
+    {
+        struct editorWindow *w = E.windows[i];
+        if (w->buf == b && !b->hex && first < w->rowoff + 2 * w->rows && last > w->rowoff - w->rows)
+            return 1;
+    }
+    return 0;
+}
+
+/** qsort() comparator for row blocks, the one drawn least recently first. */
+int compareBlockDrawn(const void *a, const void *b)
+{
+    long long x = (*(struct rowBlock *const *)a)->drawn, y = (*(struct rowBlock *const *)b)->drawn;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Bring the caches back under the budget. We go down to 3/4 of it, so the next frames do not have to evict again.
+ * Converted blocks go first, least recently used first across all buffers. Then render caches, a row block at a time,
+ * those drawn least recently first.
+ * Then the row blocks get compressed, least recently used first.
+ * Nothing on screen or within a screen of it is ever dropped, and whatever is dropped is simply rebuilt,
+ * or decompressed, the next time it is needed.
+ */
+void editorEnforceBudget()
+{
+    long long target = E.mem_budget / 4 * 3;
+    int i, j;
+    if (editorMemUsed() <= (long long)E.mem_budget)
+        return;
+    TRACE_SCOPE("editorEnforceBudget");
+
+    while (editorMemUsed() > target)
+    {
+        struct decodedBlock *victim = NULL;
+        for (i = 0; i < E.num_buffers; i++)
+        {
+            struct editorBuffer *b = E.buffers[i];
+            for (j = 0; b->decoded && j < DECODE_CACHE_BLOCKS; j++)
+            {
+                struct decodedBlock *d = &b->decoded[j];
+                if (d->block != -1 && (victim == NULL || d->used < victim->used) &&
+                    !editorRowsNearView(b, d->block * DECODE_BLOCK_ROWS, (d->block + 1) * DECODE_BLOCK_ROWS))
+                    victim = d;
+            }
+        }
+        if (victim == NULL)
+            break;
+        memFree(MEM_DECODED, victim->text, victim->bytes);
+        victim->text = NULL;
+        victim->bytes = 0;
+        victim->block = -1;
+        victim->used = 0;
+        E.mem_evicted++;
+    }
+
+    if (editorMemUsed() > target)
+    {
+        struct rowBlock **drop = NULL;
+        int n = 0, cap = 0;
+        for (i = 0; i < E.num_buffers; i++)
+        {
+            struct editorBuffer *b = E.buffers[i];
+            int start = 0;
+            for (j = 0; j < b->num_blocks; j++)
+            {
+                struct rowBlock *k = b->blocks[j];
+                if (k->rendered > 0 && !editorRowsNearView(b, start, start + k->num_rows))
+                {
+                    if (n == cap)
+                    {
+                        cap = cap ? cap * 2 : 64;
+                        drop = realloc(drop, sizeof(struct rowBlock *) * cap);
+                        if (drop == NULL)
+                            die("realloc");
+                    }
+                    drop[n++] = k;
+                }
+                start += k->num_rows;
+            }
+        }
+        qsort(drop, n, sizeof(struct rowBlock *), compareBlockDrawn);
+        for (i = 0; i < n && editorMemUsed() > target; i++)
+        {
+            E.mem_evicted += drop[i]->rendered;
+            blockDropRender(drop[i]);
+        }
+        free(drop);
+    }
+
+    // Last, compress the text of the row blocks that were used least recently
+    while (editorMemUsed() > target)
+    {
+        struct editorBuffer *vb = NULL;
+        struct rowBlock *victim = NULL;
+        for (i = 0; i < E.num_buffers; i++)
+        {
+            struct editorBuffer *b = E.buffers[i];
+            int start = 0;
+            for (j = 0; j < b->num_blocks; j++)
+            {
+                struct rowBlock *k = b->blocks[j];
+                if (k->text != NULL && !k->frozen && (victim == NULL || k->used < victim->used) &&
+                    !editorRowsNearView(b, start, start + k->num_rows))
+                {
+                    vb = b;
+                    victim = k;
+                }
+                start += k->num_rows;
+            }
+        }
+        if (victim == NULL)
+            break;
+        editorFreezeBlock(vb, victim);
+    }
+}
+
+/** SIMD kernels */
+
+/**
+ * The loops that go over every byte of a file or a row come in several versions: plain C, SSE2, AVX2 and AVX-512.
+ * Every x86-64 CPU has SSE2 but only some have the wider ones, so each version is compiled for its instruction set with
+ * the target attribute, whatever flags the rest of the editor is built with, and simdSelect() asks the CPU through
+ * cpuid which ones it can run. That keeps a single binary that is fast on every machine. The plain C versions are the
+ * reference the others are checked against by simdSelfTest(), and the libc level leaves the searches to memchr() and
+ * memmem(), which libc vectorizes its own way.
+ */
+enum simdLevel
+{
+    SIMD_SCALAR,
+    SIMD_LIBC,
+    SIMD_SSE2,
+    SIMD_AVX2,
+    SIMD_AVX512
+};
+
+#define SIMD_TEST_CASES 20000 // Random inputs simdSelfTest() runs every kernel on
+#define SIMD_TEST_MAX 300     // Longest of them, enough for the unrolled loops and their tails
+
+/** Find byte `c` in the `n` bytes at `p`, like memchr(). */
+char *scalarFindByte(const char *p, size_t n, int c)
+{
+    size_t i;
+    for (i = 0; i < n; i++)
+        if (p[i] == (char)c)
+            return (char *)p + i;
+    return NULL;
+}
+
+/** Find the `m` bytes of `needle` in the `n` bytes at `p`, like memmem(). */
+char *scalarFind(const char *p, size_t n, const char *needle, size_t m)
+{
+    size_t i;
+    for (i = 0; i + m <= n; i++)
+        if (memcmp(p + i, needle, m) == 0)
+            return (char *)p + i;
+    return NULL;
+}
+
+/** Number of bytes at `p` before the first one with the high bit set, `n` if they are all ASCII. */
+size_t scalarAsciiSpan(const unsigned char *p, size_t n)
+{
+    size_t i = 0;
+    while (i < n && p[i] < 0x80)
+        i++;
+    return i;
+}
+
+/** Count the tabs of the `n` bytes at `p`, and the other control characters: below 0x20, and 0x7f. */
+void scalarCountControls(const char *p, size_t n, int *tabs, int *ctrl)
+{
+    size_t i;
+    *tabs = *ctrl = 0;
+    for (i = 0; i < n; i++)
+    {
+        if (p[i] == '\t')
+            (*tabs)++;
+        else if (iscntrl((unsigned char)p[i]))
+            (*ctrl)++;
+    }
+}
+
+/**
+ * Write the 32 hex digits of the 16 bytes at `in` to `hex`, and the bytes themselves to `shown` with everything but
+ * printable ASCII replaced by a dot.
+ */
+void scalarHex16(char *hex, char *shown, const unsigned char *in)
+{
+    static const char digits[] = "0123456789abcdef";
+    int i;
+    for (i = 0; i < 16; i++)
+    {
+        hex[2 * i] = digits[in[i] >> 4];
+        hex[2 * i + 1] = digits[in[i] & 0x0f];
+        shown[i] = in[i] >= 0x20 && in[i] < 0x7f ? in[i] : '.';
+    }
+}
+
+char *libcFindByte(const char *p, size_t n, int c)
+{
+    return memchr(p, c, n);
+}
+
+char *libcFind(const char *p, size_t n, const char *needle, size_t m)
+{
+    return memmem(p, n, needle, m);
+}
+
+#ifdef SIMD_X86
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2,popcnt")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512bw,popcnt")))
+
+/**
+ * The byte searches compare a whole vector with the byte repeated in every lane and turn the result into a bit mask,
+ * one bit per byte, whose lowest set bit is the first match. SSE2 and AVX2 look at 64 bytes per step to keep several
+ * loads in flight, and finish the last few bytes in plain C. AVX-512 compares into mask registers directly, and its
+ * masked loads stop at the end of the input without faulting, so it needs no tail at all.
+ */
+TARGET_SSE2 unsigned long long sse2Match64(const char *p, __m128i c)
+{
+    unsigned long long m0 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), c));
+    unsigned long long m1 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 16)), c));
+    unsigned long long m2 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 32)), c));
+    unsigned long long m3 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 48)), c));
+    return m0 | m1 << 16 | m2 << 32 | m3 << 48;
+}
+
+TARGET_SSE2 char *sse2FindByte(const char *p, size_t n, int c)
+{
+    __m128i v = _mm_set1_epi8(c);
+    unsigned long long mask;
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64)
+        if ((mask = sse2Match64(p + i, v)) != 0)
+            return (char *)p + i + __builtin_ctzll(mask);
+    for (; i + 16 <= n; i += 16)
+        if ((mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), v))) != 0)
+            return (char *)p + i + __builtin_ctzll(mask);
+    return scalarFindByte(p + i, n - i, c);
+}
+
+TARGET_AVX2 char *avx2FindByte(const char *p, size_t n, int c)
+{
+    __m256i v = _mm256_set1_epi8(c);
+    unsigned long long mask;
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64)
+    {
+        unsigned long long m0 = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), v));
+        unsigned long long m1 = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i + 32)), v));
+        if ((mask = m0 | m1 << 32) != 0)
+            return (char *)p + i + __builtin_ctzll(mask);
+    }
+    for (; i + 32 <= n; i += 32)
+        if ((mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), v))) != 0)
+            return (char *)p + i + __builtin_ctzll(mask);
+    return scalarFindByte(p + i, n - i, c);
+}
+
+/** Mask of the first `n` of 64 lanes, for the masked loads at the end of an input. */
+unsigned long long simdLanes(size_t n)
+{
+    return n >= 64 ? ~0ULL : (1ULL << n) - 1;
+}
+
+TARGET_AVX512 char *avx512FindByte(const char *p, size_t n, int c)
+{
+    __m512i v = _mm512_set1_epi8(c);
+    size_t i;
+    for (i = 0; i < n; i += 64)
+    {
+        __mmask64 live = simdLanes(n - i);
+        __mmask64 mask = _mm512_mask_cmpeq_epi8_mask(live, _mm512_maskz_loadu_epi8(live, p + i), v);
+        if (mask != 0)
+            return (char *)p + i + __builtin_ctzll(mask);
+    }
+    return NULL;
+}
+
+/**
+ * The substring searches test many positions at once: a position is a candidate when its byte is the first byte of the
+ * needle and the byte m - 1 further is the last one. Two loads and two compares give the candidates of a whole vector,
+ * and only those are checked with memcmp(), which on text is rarely more than the real matches.
+ */
+TARGET_SSE2 char *sse2Find(const char *p, size_t n, const char *needle, size_t m)
+{
+    if (m < 2 || m > n)
+        return m == 1 ? sse2FindByte(p, n, needle[0]) : scalarFind(p, n, needle, m);
+    __m128i first = _mm_set1_epi8(needle[0]), last = _mm_set1_epi8(needle[m - 1]);
+    size_t i = 0;
+    for (; i + m - 1 + 16 <= n; i += 16)
+    {
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), first),
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i + m - 1)), last)));
+        for (; mask != 0; mask &= mask - 1)
+        {
+            size_t at = i + __builtin_ctz(mask);
+            if (memcmp(p + at + 1, needle + 1, m - 2) == 0)
+                return (char *)p + at;
+        }
+    }
+    return scalarFind(p + i, n - i, needle, m);
+}
+
+TARGET_AVX2 char *avx2Find(const char *p, size_t n, const char *needle, size_t m)
+{
+    if (m < 2 || m > n)
+        return m == 1 ? avx2FindByte(p, n, needle[0]) : scalarFind(p, n, needle, m);
+    __m256i first = _mm256_set1_epi8(needle[0]), last = _mm256_set1_epi8(needle[m - 1]);
+    size_t i = 0;
+    for (; i + m - 1 + 32 <= n; i += 32)
+    {
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), first),
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i + m - 1)), last)));
+        for (; mask != 0; mask &= mask - 1)
+        {
+            size_t at = i + __builtin_ctz(mask);
+            if (memcmp(p + at + 1, needle + 1, m - 2) == 0)
+                return (char *)p + at;
+        }
+    }
+    return scalarFind(p + i, n - i, needle, m);
+}
+
+TARGET_AVX512 char *avx512Find(const char *p, size_t n, const char *needle, size_t m)
+{
+    if (m < 2 || m > n)
+        return m == 1 ? avx512FindByte(p, n, needle[0]) : scalarFind(p, n, needle, m);
+    __m512i first = _mm512_set1_epi8(needle[0]), last = _mm512_set1_epi8(needle[m - 1]);
+    size_t i, positions = n - m + 1;
+    for (i = 0; i < positions; i += 64)
+    {
+        __mmask64 live = simdLanes(positions - i);
+        __mmask64 mask = _mm512_mask_cmpeq_epi8_mask(live, _mm512_maskz_loadu_epi8(live, p + i), first);
+        mask = _mm512_mask_cmpeq_epi8_mask(mask, _mm512_maskz_loadu_epi8(live, p + i + m - 1), last);
+        for (; mask != 0; mask &= mask - 1)
+        {
+            size_t at = i + __builtin_ctzll(mask);
+            if (memcmp(p + at + 1, needle + 1, m - 2) == 0)
+                return (char *)p + at;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * ASCII bytes have the high bit clear, and movemask gathers exactly the high bits, so a vector of ASCII gives 0.
+ * The 64-byte steps OR their vectors together first and only look closer when one of them has a high bit set.
+ */
+TARGET_SSE2 size_t sse2AsciiSpan(const unsigned char *p, size_t n)
+{
+    size_t i = 0;
+    unsigned mask;
+    for (; i + 64 <= n; i += 64)
+    {
+        __m128i v = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i *)(p + i)), _mm_loadu_si128((const __m128i *)(p + i + 16))),
+                                 _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + i + 32)), _mm_loadu_si128((const __m128i *)(p + i + 48))));
+        if (_mm_movemask_epi8(v) != 0)
+            break;
+    }
+    for (; i + 16 <= n; i += 16)
+        if ((mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(p + i)))) != 0)
+            return i + __builtin_ctz(mask);
+    return i + scalarAsciiSpan(p + i, n - i);
+}
+
+TARGET_AVX2 size_t avx2AsciiSpan(const unsigned char *p, size_t n)
+{
+    size_t i = 0;
+    unsigned mask;
+    for (; i + 64 <= n; i += 64)
+    {
+        __m256i v = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(p + i)), _mm256_loadu_si256((const __m256i *)(p + i + 32)));
+        if (_mm256_movemask_epi8(v) != 0)
+            break;
+    }
+    for (; i + 32 <= n; i += 32)
+        if ((mask = _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)(p + i)))) != 0)
+            return i + __builtin_ctz(mask);
+    return i + scalarAsciiSpan(p + i, n - i);
+}
+
+TARGET_AVX512 size_t avx512AsciiSpan(const unsigned char *p, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; i += 64)
+    {
+        __mmask64 mask = _mm512_movepi8_mask(_mm512_maskz_loadu_epi8(simdLanes(n - i), p + i));
+        if (mask != 0)
+            return i + __builtin_ctzll(mask);
+    }
+    return n;
+}
+
+/**
+ * Control characters are the bytes up to 0x1f, and 0x7f. SSE2 and AVX2 have no unsigned compare, but a byte is at
+ * most 0x1f exactly when min(byte, 0x1f) is the byte itself. Tabs are counted as control characters too and taken
+ * off at the end.
+ */
+TARGET_SSE2 void sse2CountControls(const char *p, size_t n, int *tabs, int *ctrl)
+{
+    __m128i limit = _mm_set1_epi8(0x1f), del = _mm_set1_epi8(0x7f), tab = _mm_set1_epi8('\t');
+    int t = 0, c = 0;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i low = _mm_cmpeq_epi8(_mm_min_epu8(v, limit), v);
+        c += __builtin_popcount(_mm_movemask_epi8(_mm_or_si128(low, _mm_cmpeq_epi8(v, del))));
+        t += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, tab)));
+    }
+    scalarCountControls(p + i, n - i, tabs, ctrl);
+    *tabs += t;
+    *ctrl += c - t;
+}
+
+TARGET_AVX2 void avx2CountControls(const char *p, size_t n, int *tabs, int *ctrl)
+{
+    __m256i limit = _mm256_set1_epi8(0x1f), del = _mm256_set1_epi8(0x7f), tab = _mm256_set1_epi8('\t');
+    int t = 0, c = 0;
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i low = _mm256_cmpeq_epi8(_mm256_min_epu8(v, limit), v);
+        c += __builtin_popcount(_mm256_movemask_epi8(_mm256_or_si256(low, _mm256_cmpeq_epi8(v, del))));
+        t += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, tab)));
+    }
+    scalarCountControls(p + i, n - i, tabs, ctrl);
+    *tabs += t;
+    *ctrl += c - t;
+}
+
+TARGET_AVX512 void avx512CountControls(const char *p, size_t n, int *tabs, int *ctrl)
+{
+    __m512i limit = _mm512_set1_epi8(0x1f), del = _mm512_set1_epi8(0x7f), tab = _mm512_set1_epi8('\t');
+    int t = 0, c = 0;
+    size_t i;
+    for (i = 0; i < n; i += 64)
+    {
+        __mmask64 live = simdLanes(n - i);
+        __m512i v = _mm512_maskz_loadu_epi8(live, p + i);
+        c += __builtin_popcountll(_mm512_mask_cmple_epu8_mask(live, v, limit) | _mm512_cmpeq_epi8_mask(v, del));
+        t += __builtin_popcountll(_mm512_cmpeq_epi8_mask(v, tab));
+    }
+    *tabs = t;
+    *ctrl = c - t;
+}
+
+/**
+ * A nibble n becomes the hex digit '0' + n, plus 'a' - '0' - 10 more when it is above 9, which is a compare, an AND and
+ * two adds for a whole vector of nibbles. SSE2 splits the 16 bytes into high and low nibbles and interleaves them back
+ * in order. AVX2 widens every byte to 16 bits first, so both nibbles of a byte sit side by side in one lane and the 32
+ * digits come out of a single register. A line is only 16 bytes, so AVX-512 has nothing to add and uses the AVX2 version.
+ * The printable test compares bytes as signed: the ones with the high bit set are negative and fail "greater than 0x1f"
+ * along with the control characters.
+ */
+TARGET_SSE2 __m128i sse2HexDigits(__m128i n)
+{
+    __m128i letters = _mm_and_si128(_mm_cmpgt_epi8(n, _mm_set1_epi8(9)), _mm_set1_epi8('a' - '0' - 10));
+    return _mm_add_epi8(_mm_add_epi8(n, _mm_set1_epi8('0')), letters);
+}
+
+TARGET_SSE2 __m128i sse2Printable(__m128i v)
+{
+    __m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(0x1f)), _mm_cmplt_epi8(v, _mm_set1_epi8(0x7f)));
+    return _mm_or_si128(_mm_and_si128(ok, v), _mm_andnot_si128(ok, _mm_set1_epi8('.')));
+}
+
+TARGET_SSE2 void sse2Hex16(char *hex, char *shown, const unsigned char *in)
+{
+    __m128i v = _mm_loadu_si128((const __m128i *)in);
+    __m128i mask = _mm_set1_epi8(0x0f);
+    __m128i hi = sse2HexDigits(_mm_and_si128(_mm_srli_epi16(v, 4), mask));
+    __m128i lo = sse2HexDigits(_mm_and_si128(v, mask));
+    _mm_storeu_si128((__m128i *)hex, _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128((__m128i *)(hex + 16), _mm_unpackhi_epi8(hi, lo));
+    _mm_storeu_si128((__m128i *)shown, sse2Printable(v));
+}
+
+TARGET_AVX2 void avx2Hex16(char *hex, char *shown, const unsigned char *in)
+{
+    __m128i v = _mm_loadu_si128((const __m128i *)in);
+    __m256i w = _mm256_cvtepu8_epi16(v);
+    __m256i n = _mm256_or_si256(_mm256_srli_epi16(w, 4), _mm256_slli_epi16(_mm256_and_si256(w, _mm256_set1_epi16(0x0f)), 8));
+    __m256i letters = _mm256_and_si256(_mm256_cmpgt_epi8(n, _mm256_set1_epi8(9)), _mm256_set1_epi8('a' - '0' - 10));
+    _mm256_storeu_si256((__m256i *)hex, _mm256_add_epi8(_mm256_add_epi8(n, _mm256_set1_epi8('0')), letters));
+    __m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(0x1f)), _mm_cmplt_epi8(v, _mm_set1_epi8(0x7f)));
+    _mm_storeu_si128((__m128i *)shown, _mm_blendv_epi8(_mm_set1_epi8('.'), v, ok));
+}
+#endif
+
+/** The kernels of every level, indexed by enum simdLevel. Levels the compiler cannot build for are left out. */
+static const struct simdKernels simdLevels[] = {
+    {"scalar", scalarFindByte, scalarFind, scalarAsciiSpan, scalarCountControls, scalarHex16},
+    {"libc", libcFindByte, libcFind, scalarAsciiSpan, scalarCountControls, scalarHex16},
+#ifdef SIMD_X86
+    {"sse2", sse2FindByte, sse2Find, sse2AsciiSpan, sse2CountControls, sse2Hex16},
+    {"avx2", avx2FindByte, avx2Find, avx2AsciiSpan, avx2CountControls, avx2Hex16},
+    {"avx512", avx512FindByte, avx512Find, avx512AsciiSpan, avx512CountControls, avx2Hex16},
+#endif
+};
+#define SIMD_LEVELS (int)(sizeof(simdLevels) / sizeof(simdLevels[0]))
+
+/**
+ * Whether this CPU can run the kernels of `level`. __builtin_cpu_supports() reads the cpuid bits once, and for AVX2
+ * and AVX-512 also checks that the kernel saves the wider registers on a context switch.
+ */
+int simdSupported(int level)
+{
+    if (level >= SIMD_LEVELS)
+        return 0;
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if (level == SIMD_SSE2)
+        return __builtin_cpu_supports("sse2");
+    if (level == SIMD_AVX2)
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+    if (level == SIMD_AVX512)
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+               __builtin_cpu_supports("popcnt");
+#endif
+    return 1;
+}
+
+/**
+ * Pick the kernels the editor runs: the ones named by --simd, or the widest this CPU supports. The choice is made once,
+ * before any worker starts, so the workers read E.simd without a lock.
+ */
+void simdSelect(const char *name)
+{
+    int i;
+    for (i = SIMD_LEVELS - 1; i >= 0; i--)
+    {
+        if (name != NULL ? strcmp(name, simdLevels[i].name) != 0 : !simdSupported(i))
+            continue;
+        if (!simdSupported(i))
+        {
+            fprintf(stderr, "This CPU cannot run the %s kernels\n", name);
+            exit(1);
+        }
+        E.simd = &simdLevels[i];
+        return;
+    }
+    fprintf(stderr, "Unknown SIMD level: %s, the levels are", name);
+    for (i = 0; i < SIMD_LEVELS; i++)
+        fprintf(stderr, " %s", simdLevels[i].name);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+/** Fill `n` bytes at `p` with random bytes from `alphabet`, or any byte at all when it is NULL. */
+void simdTestFill(unsigned char *p, size_t n, const char *alphabet, size_t alphabet_len, unsigned long long *x)
+{
+    size_t i;
+    for (i = 0; i < n; i++)
+    {
+        unsigned long long r = corpusRandom(x);
+        p[i] = alphabet ? (unsigned char)alphabet[r % alphabet_len] : (unsigned char)r;
+    }
+}
+
+/**
+ * Run every kernel of every level the CPU supports on SIMD_TEST_CASES random inputs and compare the results with the
+ * scalar kernels, see --simd-self-test. The inputs are drawn from a few small alphabets so that searches match and
+ * miss, rows have tabs and control characters, and text is ASCII with the odd high-bit byte, as well as from every byte
+ * value. Each one ends right before an unreadable page, so a kernel that reads past the end of its input crashes the
+ * test instead of passing it. Returns the number of mismatches.
+ */
+int simdSelfTest()
+{
+    static const char *alphabets[] = {"ab\n", "aaaaaaaaaaaaaaab\t\x7f\x1f \x80\n", "the cat\t\xc3\xa9\n", NULL};
+    long page = sysconf(_SC_PAGESIZE);
+    unsigned char *area = mmap(NULL, 2 * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (area == MAP_FAILED || mprotect(area + page, page, PROT_NONE) == -1)
+        die("mmap");
+    const struct simdKernels *ref = &simdLevels[SIMD_SCALAR];
+    int level, failures = 0;
+
+    for (level = SIMD_SCALAR + 1; level < SIMD_LEVELS; level++)
+    {
+        const struct simdKernels *k = &simdLevels[level];
+        unsigned long long x = 0x9e3779b97f4a7c15ULL;
+        int i, bad = 0;
+        if (!simdSupported(level))
+        {
+            printf("%-8s not supported by this CPU\n", k->name);
+            continue;
+        }
+        for (i = 0; i < SIMD_TEST_CASES; i++)
+        {
+            const char *alphabet = alphabets[i % 4];
+            size_t n = corpusRandom(&x) % (SIMD_TEST_MAX + 1);
+            unsigned char *p = area + page - n;
+            simdTestFill(p, n, alphabet, alphabet ? strlen(alphabet) : 0, &x);
+
+            int c = alphabet ? alphabet[corpusRandom(&x) % strlen(alphabet)] : (int)(corpusRandom(&x) & 0xff);
+            const char *s = (const char *)p;
+            const char *what = NULL;
+            if (k->find_byte(s, n, c) != ref->find_byte(s, n, c))
+                what = "find_byte";
+
+            // Needles are cut from the input half of the time, so they are found, and may be longer than it
+            char needle[12];
+            size_t m = corpusRandom(&x) % sizeof(needle);
+            if (n > m && corpusRandom(&x) % 2)
+                memcpy(needle, s + corpusRandom(&x) % (n - m + 1), m);
+            else
+                simdTestFill((unsigned char *)needle, m, alphabet, alphabet ? strlen(alphabet) : 0, &x);
+            if (k->find(s, n, needle, m) != ref->find(s, n, needle, m))
+                what = "find";
+
+            if (k->ascii_span(p, n) != ref->ascii_span(p, n))
+                what = "ascii_span";
+
+            int tabs, ctrl, ref_tabs, ref_ctrl;
+            k->count_controls(s, n, &tabs, &ctrl);
+            ref->count_controls(s, n, &ref_tabs, &ref_ctrl);
+            if (tabs != ref_tabs || ctrl != ref_ctrl)
+                what = "count_controls";
+
+            if (n >= 16)
+            {
+                char hex[32], shown[16], ref_hex[32], ref_shown[16];
+                k->hex16(hex, shown, p);
+                ref->hex16(ref_hex, ref_shown, p);
+                if (memcmp(hex, ref_hex, 32) != 0 || memcmp(shown, ref_shown, 16) != 0)
+                    what = "hex16";
+            }
+
+            if (what != NULL && bad++ < 5)
+                printf("%-8s %s differs from scalar on input %d, %zu bytes\n", k->name, what, i, n);
+        }
+        printf("%-8s %s, %d inputs\n", k->name, bad ? "FAILED" : "ok", SIMD_TEST_CASES);
+        fflush(stdout); // Keep the results so far if the next level crashes
+        failures += bad;
+    }
+    munmap(area, 2 * page);
+    return failures;
+}
+
+/** encodings */
+
+/** Width in bytes of a code unit, and so of a line terminator, in encoding `encoding`. */
+int encodingUnit(int encoding)
+{
+    return encoding == ENCODING_UTF16LE || encoding == ENCODING_UTF16BE ? 2 : 1;
+}
+
+/**
+ * Find the next line terminator in [p, end) of a file that starts at `base` and is `len` bytes long. Returns its first byte,
+ * or NULL. In UTF-16 a newline is the unit 0x000a, so a '\n' byte only counts when it is the right half of a unit at
+ * an even offset. We still scan bytes with the find_byte kernel and only check the bytes it stops at.
+ */
+char *findNewline(const char *base, size_t len, char *p, char *end, int encoding)
+{
+    char *nl;
+    while ((nl = E.simd->find_byte(p, end - p, '\n')) != NULL)
+    {
+        size_t off = nl - base;
+        if (encoding == ENCODING_UTF16LE)
+        {
+            if (off % 2 == 0 && off + 1 < len && base[off + 1] == '\0')
+                return nl;
+        }
+        else if (encoding == ENCODING_UTF16BE)
+        {
+            if (off % 2 == 1 && base[off - 1] == '\0')
+                return nl - 1;
+        }
+        else
+            return nl;
+        p = nl + 1;
+    }
+    return NULL;
+}
+
+/** Write code point `cp` to `dst` as UTF-8 and return the number of bytes written. */
+int utf8Encode(char *dst, unsigned int cp)
+{
+    if (cp < 0x80)
+    {
+        dst[0] = cp;
+        return 1;
+    }
+    if (cp < 0x800)
+    {
+        dst[0] = 0xc0 | cp >> 6;
+        dst[1] = 0x80 | (cp & 0x3f);
+        return 2;
+    }
+    if (cp < 0x10000)
+    {
+        dst[0] = 0xe0 | cp >> 12;
+        dst[1] = 0x80 | (cp >> 6 & 0x3f);
+        dst[2] = 0x80 | (cp & 0x3f);
+        return 3;
+    }
+    dst[0] = 0xf0 | cp >> 18;
+    dst[1] = 0x80 | (cp >> 12 & 0x3f);
+    dst[2] = 0x80 | (cp >> 6 & 0x3f);
+    dst[3] = 0x80 | (cp & 0x3f);
+    return 4;
+}
+
+/**
+ * Convert `n` bytes of Latin-1 to UTF-8, `dst` must have room for 2 * n bytes. Every byte is its own code point,
+ * so runs of 16 ASCII bytes, the common case, are copied as they are.
+ */
+size_t transcodeLatin1(char *dst, const unsigned char *src, size_t n)
+{
+    size_t i = 0, out = 0;
+    while (i < n)
+    {
+#ifdef __SSE2__
+        if (i + 16 <= n && _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(src + i))) == 0)
+        {
+            memcpy(dst + out, src + i, 16);
+            i += 16;
+            out += 16;
+            continue;
+        }
+#endif
+        out += utf8Encode(dst + out, src[i++]);
+    }
+    return out;
+}
+
+/**
+ * Convert `n` bytes of UTF-16 to UTF-8, `dst` must have room for 2 * n bytes. Surrogate pairs are combined, and lone
+ * surrogates and a dangling odd byte become U+FFFD. With SSE2, 8 units that are all ASCII are narrowed to 8 bytes at once
+ * with a saturating pack, after swapping the bytes of big-endian units.
+ */
+size_t transcodeUtf16(char *dst, const unsigned char *src, size_t n, int be)
+{
+    size_t i = 0, out = 0;
+    while (i + 1 < n)
+    {
+#ifdef __SSE2__
+        if (i + 16 <= n)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+            if (be)
+                v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+            __m128i ascii = _mm_cmpeq_epi16(_mm_and_si128(v, _mm_set1_epi16((short)0xff80)), _mm_setzero_si128());
+            if (_mm_movemask_epi8(ascii) == 0xffff)
+            {
+                _mm_storel_epi64((__m128i *)(dst + out), _mm_packus_epi16(v, v));
+                i += 16;
+                out += 8;
+                continue;
+            }
+        }
+#endif
+        unsigned int u = be ? src[i] << 8 | src[i + 1] : src[i] | src[i + 1] << 8;
+        i += 2;
+        if (u >= 0xd800 && u < 0xdc00 && i + 1 < n)
+        {
+            unsigned int l = be ? src[i] << 8 | src[i + 1] : src[i] | src[i + 1] << 8;
+            if (l >= 0xdc00 && l < 0xe000)
+            {
+                u = 0x10000 + ((u - 0xd800) << 10) + (l - 0xdc00);
+                i += 2;
+            }
+            else
+                u = 0xfffd;
+        }
+        else if (u >= 0xd800 && u < 0xe000)
+            u = 0xfffd;
+        out += utf8Encode(dst + out, u);
+    }
+    if (i < n)
+        out += utf8Encode(dst + out, 0xfffd);
+    return out;
+}
+
+/** Convert the `n` bytes at `src` from the encoding of buffer `b` to UTF-8, `dst` must have room for 2 * n bytes. */
+size_t editorTranscode(struct editorBuffer *b, char *dst, const char *src, size_t n)
+{
+    if (b->encoding == ENCODING_LATIN1)
+        return transcodeLatin1(dst, (const unsigned char *)src, n);
+    return transcodeUtf16(dst, (const unsigned char *)src, n, b->encoding == ENCODING_UTF16BE);
+}
+
+/**
+ * Return block `block` of a transcoded buffer, converting it if it is not cached. When all the slots are taken the least
+ * recently used block is dropped, so memory stays bounded by DECODE_CACHE_BLOCKS blocks however big the file is,
+ * and opening a file converts nothing: only the blocks that are drawn ever are.
+ */
+struct decodedBlock *editorDecodeBlock(struct editorBuffer *b, int block)
+{
+    int i, victim = 0;
+    if (b->decoded == NULL)
+    {
+        b->decoded = memCalloc(MEM_DECODED, DECODE_CACHE_BLOCKS, sizeof(struct decodedBlock));
+        for (i = 0; i < DECODE_CACHE_BLOCKS; i++)
+            b->decoded[i].block = -1;
+    }
+    for (i = 0; i < DECODE_CACHE_BLOCKS; i++)
+    {
+        if (b->decoded[i].block == block)
+        {
+            b->decoded[i].used = ++E.mem_tick;
+            return &b->decoded[i];
+        }
+        if (b->decoded[i].used < b->decoded[victim].used)
+            victim = i;
+    }
+
+    TRACE_SCOPE("editorDecodeBlock");
+    struct decodedBlock *d = &b->decoded[victim];
+    int first = block * DECODE_BLOCK_ROWS, n = b->num_rows - first, at;
+    size_t src = 0, out = 0;
+    struct rowIter it;
+    if (n > DECODE_BLOCK_ROWS)
+        n = DECODE_BLOCK_ROWS;
+    for (rowIterStart(&it, b, first), at = first; at < first + n; at++)
+        src += rowIterNext(&it)->size;
+    memFree(MEM_DECODED, d->text, d->bytes);
+    d->bytes = 2 * src + 1;
+    d->text = memAlloc(MEM_DECODED, d->bytes);
+    for (rowIterStart(&it, b, first), at = first; at < first + n; at++)
+    {
+        erow *row = rowIterNext(&it);
+        char *chars = row->chars;
+        int size = row->size;
+        // The byte order mark is not part of the text
+        if (at == 0 && encodingUnit(b->encoding) == 2 && size >= 2)
+        {
+            chars += 2;
+            size -= 2;
+        }
+        d->start[at - first] = out;
+        out += editorTranscode(b, d->text + out, chars, size);
+    }
+    d->start[n] = out;
+    d->block = block;
+    d->used = ++E.mem_tick;
+    return d;
+}
+
+/** Free the converted blocks of a buffer, they are converted again when the buffer is shown. */
+void editorDropDecoded(struct editorBuffer *b)
+{
+    int i;
+    if (b->decoded == NULL)
+        return;
+    for (i = 0; i < DECODE_CACHE_BLOCKS; i++)
+        memFree(MEM_DECODED, b->decoded[i].text, b->decoded[i].bytes);
+    memFree(MEM_DECODED, b->decoded, sizeof(struct decodedBlock) * DECODE_CACHE_BLOCKS);
+    b->decoded = NULL;
+}
+
+/**
+ * The text of row `at` as UTF-8, with its length in `*len`. For a UTF-8 file that is the row itself, in the mapping
+ * or in the row store, which is decompressed first if it went cold.
+ * Otherwise it points into a converted block, which stays valid until the next call that converts a block.
+ */
+char *editorRowText(struct editorBuffer *b, int at, int *len)
+{
+    if (b->encoding == ENCODING_UTF8)
+    {
+        int off;
+        struct rowBlock *k = editorBlock(b, editorFindRow(b, at, &off));
+        if (editorRowOwned(b, &k->row[off]))
+            editorTouchBlock(k);
+        *len = k->row[off].size;
+        return k->row[off].chars;
+    }
+    struct decodedBlock *d = editorDecodeBlock(b, at / DECODE_BLOCK_ROWS);
+    int i = at % DECODE_BLOCK_ROWS;
+    *len = d->start[i + 1] - d->start[i];
+    return d->text + d->start[i];
+}
+
+/** row operations */
+
+/**
+ * Build the render cache of a row. Tabs are expanded to the next multiple of TAB_STOP and other control characters are
+ * drawn as '?', so they cannot move the terminal cursor. Most rows have neither, those share their chars as render.
+ * Rows of a transcoded file always get their own copy, the converted block they come from can be dropped at any time.
+ */
+void editorUpdateRender(struct editorBuffer *b, int at)
+{
+    int j, len, tabs, ctrl, off;
+    struct rowBlock *k = editorBlock(b, editorFindRow(b, at, &off));
+    erow *row = &k->row[off];
+    char *text = editorRowText(b, at, &len);
+    E.simd->count_controls(text, len, &tabs, &ctrl);
+
+    if (tabs == 0 && ctrl == 0 && text == row->chars)
+    {
+        row->render = row->chars;
+        row->rsize = row->size;
+    }
+    else
+    {
+        int idx = 0;
+        size_t cap = len + tabs * (TAB_STOP - 1) + 1;
+        row->render = memAlloc(MEM_RENDER, cap);
+        for (j = 0; j < len; j++)
+        {
+            if (text[j] == '\t')
+            {
+                row->render[idx++] = ' ';
+                while (idx % TAB_STOP != 0)
+                    row->render[idx++] = ' ';
+            }
+            else if (iscntrl((unsigned char)text[j]))
+                row->render[idx++] = '?';
+            else
+                row->render[idx++] = text[j];
+        }
+        row->rsize = idx;
+        editorMemCharge(MEM_RENDER, (long long)(row->rsize + 1) - (long long)cap); // Tabs may take fewer columns, and the cache is freed as rsize + 1 bytes
+        k->rendered++;
+    }
+}
+
+/** Return the render cache of a row, building it if no window has drawn the row yet. */
+erow *editorRenderRow(struct editorBuffer *b, int at)
+{
+    int off;
+    struct rowBlock *k = editorBlock(b, editorFindRow(b, at, &off));
+    erow *row = &k->row[off];
+    k->drawn = ++E.mem_tick;
+    if (row->render == NULL)
+        editorUpdateRender(b, at);
+    return row;
+}
+
+/**
+ * Free every render cache of a buffer. Only the blocks that count rows with one are walked, so this does not go over
+ * the whole file.
+ */
+void editorDropRenderCaches(struct editorBuffer *b)
+{
+    int i;
+    for (i = 0; i < b->num_blocks; i++)
+        blockDropRender(b->blocks[i]);
+}
+
+/**
+ * Free the row arrays of a buffer no window shows, keeping only the mapping and the row index. The blocks come back
+ * one at a time, from the mapping, when their rows are needed again.
+ */
+void editorUnloadRows(struct editorBuffer *b)
+{
+    int i;
+    if (b->map == NULL)
+        return;
+    for (i = 0; i < b->num_blocks; i++)
+        editorUnloadBlock(b, b->blocks[i]);
+}
+
+/**
+ * editorAppendRow() adds a row at the end of the buffer. The row keeps pointing at `s`, nothing is copied.
+ * `linelen` is the length of the line as it was on disk, terminator included, which is what the row index tracks.
+ * Rows go into the last block until it is full, so appending millions of rows does not realloc() once per row.
+ */
+void editorAppendRow(struct editorBuffer *b, char *s, size_t len, size_t linelen)
+{
+    struct rowBlock *k = b->num_blocks > 0 ? editorBlock(b, b->num_blocks - 1) : NULL;
+    if (k == NULL || k->num_rows >= STORE_BLOCK_ROWS)
+    {
+        k = blockNew(STORE_BLOCK_ROWS);
+        editorReserveBlocks(b, b->num_blocks + 1);
+        b->blocks[b->num_blocks++] = k;
+        rowIndexAppend(&b->index_rows, 0);
+        rowIndexAppend(&b->index_bytes, 0);
+    }
+
+    erow *row = &k->row[k->num_rows];
+    row->size = len;
+    row->chars = s;
+    row->render = NULL;
+    row->rsize = 0;
+    k->lens[k->num_rows++] = linelen;
+    k->bytes += linelen;
+    rowIndexAdd(&b->index_rows, b->num_blocks - 1, 1);
+    rowIndexAdd(&b->index_bytes, b->num_blocks - 1, linelen);
+    b->num_rows++;
+    editorUpdateGutter(b);
+}
+
+/** Append a row that gets its own copy of `s`, in the row store. */
+void editorAppendOwnedRow(struct editorBuffer *b, const char *s, size_t len, size_t linelen)
+{
+    editorAppendRow(b, NULL, 0, linelen);
+    struct rowBlock *k = b->blocks[b->num_blocks - 1];
+    editorSetRowText(b, k, &k->row[k->num_rows - 1], s, len);
+}
+
+/** buffers */
+
+/** Allocate an empty buffer. calloc() zeroes every field, which is the state of a buffer with no file. */
+struct editorBuffer *editorBufferNew()
+{
+    struct editorBuffer *b = calloc(1, sizeof(struct editorBuffer));
+    if (b == NULL)
+        die("calloc");
+    return b;
+}
+
+/** Whether any window shows buffer `b`. */
+int editorBufferShown(struct editorBuffer *b)
+{
+    int i;
+    for (i = 0; i < E.num_windows; i++)
+        if (E.windows[i]->buf == b)
+            return 1;
+    return 0;
+}
+
+/** Index of buffer `b` in the buffer list. */
+int editorBufferIndex(struct editorBuffer *b)
+{
+    int i;
+    for (i = 0; i < E.num_buffers; i++)
+        if (E.buffers[i] == b)
+            return i;
+    return 0;
+}
+
+/**
+ * Show buffer `at` in the focused window. The window leaves its cursor in the buffer it was showing, and picks up the
+ * one the new buffer remembered, so switching is just a pointer swap. A buffer that is no longer shown anywhere
+ * drops its render caches and converted blocks and keeps only its mapping and its row index.
+ */
+void editorSwitchBuffer(int at)
+{
+    struct editorWindow *w = E.win;
+    struct editorBuffer *old = w->buf;
+    if (old)
+    {
+        old->cx = w->cx;
+        old->cy = w->cy;
+        old->rowoff = w->rowoff;
+    }
+
+    w->buf = E.buffers[at];
+    w->cx = w->buf->cx;
+    w->cy = w->buf->cy;
+    w->rowoff = w->buf->rowoff;
+    w->num_cursors = 0;
+    w->block = 0;
+    w->redraw = 1;
+    E.current = at;
+    E.buf = w->buf;
+    editorUpdateGutter(E.buf);
+
+    if (old && old != w->buf && !editorBufferShown(old))
+    {
+        editorDropRenderCaches(old);
+        editorDropDecoded(old);
+        editorUnloadRows(old);
+    }
+}
+
+/** Add a buffer to the buffer list and switch to it. */
+void editorAddBuffer(struct editorBuffer *b)
+{
+    struct editorBuffer **buffers = realloc(E.buffers, sizeof(struct editorBuffer *) * (E.num_buffers + 1));
+    if (buffers == NULL)
+        die("realloc");
+    E.buffers = buffers;
+    E.buffers[E.num_buffers++] = b;
+    editorSwitchBuffer(E.num_buffers - 1);
+}
+
+/** windows */
+
+/** Mark every window showing buffer `b` for a full redraw. */
+void editorRedrawBuffer(struct editorBuffer *b)
+{
+    int i;
+    for (i = 0; i < E.num_windows; i++)
+        if (E.windows[i]->buf == b)
+            E.windows[i]->redraw = 1;
+}
+
+/** Mark every window for a full redraw. */
+void editorRedrawAll()
+{
+    int i;
+    for (i = 0; i < E.num_windows; i++)
+        E.windows[i]->redraw = 1;
+}
+
+/** Rows of a window used for text, the last one is its status line. */
+int editorWindowTextRows(struct editorWindow *w)
+{
+    return w->rows - 1;
+}
+
+/** Whether the window has a separator column on its right. */
+int editorWindowHasSeparator(struct editorWindow *w)
+{
+    return w->left + w->cols < E.screen_cols;
+}
+
+/** Columns of a window left for the text once the gutter and the separator are drawn. */
+int editorWindowTextCols(struct editorWindow *w)
+{
+    return w->cols - editorWindowHasSeparator(w) - w->buf->gutter_width;
+}
+
+/** Columns left for the text in the focused window. */
+int editorTextCols()
+{
+    return editorWindowTextCols(E.win);
+}
+
+/** Rows a window can move through: the text lines, or the 16-byte lines of a hex view. */
+int editorViewRows(struct editorBuffer *b)
+{
+    if (b->hex)
+        return (b->map_len + HEX_LINE_BYTES - 1) / HEX_LINE_BYTES;
+    return b->num_rows;
+}
+
+/** Last column the cursor can reach in window `w`, in a hex view the last byte of the line it is on. */
+int editorMaxCol(struct editorWindow *w)
+{
+    struct editorBuffer *b = w->buf;
+    if (b->hex)
+    {
+        long long left = (long long)b->map_len - (long long)w->cy * HEX_LINE_BYTES;
+        return left >= HEX_LINE_BYTES ? HEX_LINE_BYTES - 1 : (left > 0 ? left - 1 : 0);
+    }
+    return editorWindowTextCols(w) - 1;
+}
+
+/** Move the cursor to window `at`. */
+void editorFocusWindow(int at)
+{
+    E.focus = at;
+    E.win = E.windows[at];
+    E.buf = E.win->buf;
+    E.current = editorBufferIndex(E.buf);
+}
+
+/** Add a window covering the given rectangle of the screen, showing the same buffer and position as `from`. */
+struct editorWindow *editorAddWindow(struct editorWindow *from, int top, int left, int rows, int cols)
+{
+    struct editorWindow *w = calloc(1, sizeof(struct editorWindow));
+    struct editorWindow **windows = realloc(E.windows, sizeof(struct editorWindow *) * (E.num_windows + 1));
+    if (w == NULL || windows == NULL)
+        die("realloc");
+    E.windows = windows;
+    E.windows[E.num_windows++] = w;
+    if (from)
+    {
+        w->buf = from->buf;
+        w->cx = from->cx;
+        w->cy = from->cy;
+        w->rowoff = from->rowoff;
+    }
+    w->top = top;
+    w->left = left;
+    w->rows = rows;
+    w->cols = cols;
+    w->redraw = 1;
+    return w;
+}
+
+/**
+ * Split the focused window in two, one above the other when `vertical` is 0 and side by side otherwise.
+ * The new window takes the bottom or right half of the rectangle and shows the same buffer at the same position.
+ */
+void editorSplitWindow(int vertical)
+{
+    struct editorWindow *w = E.win;
+    if (vertical)
+    {
+        if (w->cols < 2 * (w->buf->gutter_width + 2))
+        {
+            editorSetStatusMessage("Window too narrow to split");
+            return;
+        }
+        int half = w->cols / 2;
+        editorAddWindow(w, w->top, w->left + half, w->rows, w->cols - half);
+        w->cols = half;
+    }
+    else
+    {
+        if (w->rows < 4)
+        {
+            editorSetStatusMessage("Window too short to split");
+            return;
+        }
+        int half = w->rows / 2;
+        editorAddWindow(w, w->top + half, w->left, w->rows - half, w->cols);
+        w->rows = half;
+    }
+    if (w->cx >= editorWindowTextCols(w))
+        w->cx = editorWindowTextCols(w) - 1;
+    w->redraw = 1;
+}
+
+/** Remove window `at` from the window list, dropping the render caches of its buffer if nobody else shows it. */
+void editorRemoveWindow(int at)
+{
+    struct editorWindow *w = E.windows[at];
+    memmove(&E.windows[at], &E.windows[at + 1], sizeof(struct editorWindow *) * (E.num_windows - at - 1));
+    E.num_windows--;
+    w->buf->cx = w->cx;
+    w->buf->cy = w->cy;
+    w->buf->rowoff = w->rowoff;
+    if (!editorBufferShown(w->buf))
+    {
+        editorDropRenderCaches(w->buf);
+        editorUnloadRows(w->buf);
+    }
+    free(w->cursors);
+    free(w);
+}
+
+/**
+ * Whether window `n` touches side `side` of window `w` (0 above, 1 below, 2 left, 3 right) and lies within that side.
+ * `span` is set to the length of the side that `n` covers.
+ */
+int editorWindowAdjacent(struct editorWindow *w, struct editorWindow *n, int side, int *span)
+{
+    if (side < 2)
+    {
+        int edge = side == 0 ? n->top + n->rows == w->top : w->top + w->rows == n->top;
+        *span = n->cols;
+        return edge && n->left >= w->left && n->left + n->cols <= w->left + w->cols;
+    }
+    int edge = side == 2 ? n->left + n->cols == w->left : w->left + w->cols == n->left;
+    *span = n->rows;
+    return edge && n->top >= w->top && n->top + n->rows <= w->top + w->rows;
+}
+
+/**
+ * Close the focused window. Its rectangle is given to the windows along one of its sides, when they exactly cover
+ * that side they can all grow into it. The window that was split off last always has such a side.
+ * If no side works we refuse to close, rather than leaving a hole in the screen.
+ */
+void editorCloseWindow()
+{
+    struct editorWindow *w = E.win;
+    int side, i, span;
+    if (E.num_windows == 1)
+    {
+        editorSetStatusMessage("Can't close the last window");
+        return;
+    }
+    for (side = 0; side < 4; side++)
+    {
+        int covered = 0;
+        for (i = 0; i < E.num_windows; i++)
+            if (E.windows[i] != w && editorWindowAdjacent(w, E.windows[i], side, &span))
+                covered += span;
+        if (covered != (side < 2 ? w->cols : w->rows))
+            continue;
+
+        int next = -1;
+        for (i = 0; i < E.num_windows; i++)
+        {
+            struct editorWindow *n = E.windows[i];
+            if (n == w || !editorWindowAdjacent(w, n, side, &span))
+                continue;
+            if (side < 2)
+            {
+                if (side == 1)
+                    n->top = w->top;
+                n->rows += w->rows;
+            }
+            else
+            {
+                if (side == 3)
+                    n->left = w->left;
+                n->cols += w->cols;
+            }
+            n->redraw = 1;
+            if (next == -1)
+                next = i < E.focus ? i : i - 1;
+        }
+        editorRemoveWindow(E.focus);
+        editorFocusWindow(next);
+        return;
+    }
+    editorSetStatusMessage("Can't close this window");
+}
+
+/** Close every window but the focused one, which then covers the whole screen again. */
+void editorOnlyWindow()
+{
+    struct editorWindow *w = E.win;
+    while (E.num_windows > 1)
+        editorRemoveWindow(E.windows[0] == w ? 1 : 0);
+    w->top = 0;
+    w->left = 0;
+    w->rows = E.screen_rows;
+    w->cols = E.screen_cols;
+    w->redraw = 1;
+    editorFocusWindow(0);
+}
+
+/**
+ * Window commands are typed as Ctrl-W followed by a key, like in vi:
+ * s splits horizontally, v splits vertically, w moves to the next window, c closes the window and o keeps only this one.
+ */
+void editorWindowCommand()
+{
+    editorSetStatusMessage("Ctrl-W: s = split | v = vsplit | w = next | c = close | o = only");
+    editorRefreshScreen();
+    int c;
+    while ((c = editorNextKey()) == STATS_TICK)
+        editorRefreshScreen();
+    editorSetStatusMessage("");
+    switch (c)
+    {
+    case 's':
+        editorSplitWindow(0);
+        break;
+    case 'v':
+        editorSplitWindow(1);
+        break;
+    case 'w':
+    case CTRL_KEY('w'):
+        editorFocusWindow((E.focus + 1) % E.num_windows);
+        break;
+    case 'c':
+        editorCloseWindow();
+        break;
+    case 'o':
+        editorOnlyWindow();
+        break;
+    }
+}
+
+/** editing */
+
+#define UNDO_STEPS 1000 // Edits a buffer remembers for Ctrl-Z, the oldest are forgotten first
+#define UNDO_BUDGET_FRACTION 4 // Part of the memory budget the undo steps of a buffer may keep, the oldest are forgotten first
+
+/**
+ * Screen column of byte `at` of the text of a row. Tabs go to the next multiple of TAB_STOP and every other byte takes
+ * one column, which is how editorUpdateRender() draws them.
+ */
+int editorTextColumn(const char *text, int at)
+{
+    int i, col = 0;
+    for (i = 0; i < at; i++)
+        col += text[i] == '\t' ? TAB_STOP - col % TAB_STOP : 1;
+    return col;
+}
+
+/** Byte of the text of a row drawn at screen column `cx`, or the end of the text when the column is past it. */
+int editorTextIndex(const char *text, int len, int cx)
+{
+    int i, col = 0;
+    for (i = 0; i < len; i++)
+    {
+        col += text[i] == '\t' ? TAB_STOP - col % TAB_STOP : 1;
+        if (col > cx)
+            return i;
+    }
+    return len;
+}
+
+/**
+ * Whether the current buffer can be edited, and if not tell the user why. The rows of a UTF-16 or Latin-1 file hold
+ * the bytes on disk and are converted for display, so they would have to be converted back, which we do not do.
+ */
+int editorCanEdit()
+{
+    if (E.buf->hex)
+    {
+        editorSetStatusMessage("Switch back to the text view to edit, Ctrl-X");
+        return 0;
+    }
+    if (E.buf->encoding != ENCODING_UTF8)
+    {
+        editorSetStatusMessage("Only UTF-8 files can be edited");
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * New rows for editorSpliceRows(): their text one after the other and the length of each. It also serves as a plain
+ * growing byte buffer, with rows left at 0. Both arrays double as they grow, an edit can make millions of rows.
+ */
+struct rowText
+{
+    char *text;
+    size_t len, cap;
+    int *lens;
+    int rows, rows_cap;
+};
+
+void rowTextAppend(struct rowText *t, const char *s, size_t len)
+{
+    if (t->len + len > t->cap)
+    {
+        size_t cap = t->cap ? t->cap * 2 : 4096;
+        while (cap < t->len + len)
+            cap *= 2;
+        if ((t->text = realloc(t->text, cap)) == NULL)
+            die("realloc");
+        t->cap = cap;
+    }
+    memcpy(t->text + t->len, s, len);
+    t->len += len;
+}
+
+/** Add a row of `len` bytes. */
+void rowTextAdd(struct rowText *t, const char *s, int len)
+{
+    if (t->rows == t->rows_cap)
+    {
+        t->rows_cap = t->rows_cap ? t->rows_cap * 2 : 1024;
+        if ((t->lens = realloc(t->lens, sizeof(int) * t->rows_cap)) == NULL)
+            die("realloc");
+    }
+    rowTextAppend(t, s, len);
+    t->lens[t->rows++] = len;
+}
+
+void rowTextFree(struct rowText *t)
+{
+    free(t->text);
+    free(t->lens);
+}
+
+/**
+ * Load and thaw the blocks of rows [first, last], so that their chars can be read directly, also by other threads.
+ */
+void editorThawRows(struct editorBuffer *b, int first, int last)
+{
+    int off, i;
+    for (i = editorFindRow(b, first, &off); i < b->num_blocks && first <= last; first += b->blocks[i++]->num_rows - off, off = 0)
+        if (editorBlock(b, i)->frozen)
+            editorThawBlock(b->blocks[i]);
+}
+
+/**
+ * Renumber `count` cursors, sorted by row, for splices `s`: a cursor past a splice moves by the rows it added or
+ * removed, and a cursor on a replaced row goes to the new row in its place, or to the last of them.
+ * Both lists are walked once side by side.
+ */
+void editorSpliceCursors(struct rowSplice *s, int n, struct editorCursor *c, int count)
+{
+    int i = 0, j, delta = 0;
+    for (j = 0; j < count; j++)
+    {
+        for (; i < n && s[i].at + s[i].removed <= c[j].cy; i++)
+            delta += s[i].added - s[i].removed;
+        if (i < n && c[j].cy >= s[i].at)
+        {
+            int k = c[j].cy - s[i].at;
+            c[j].cy = s[i].at + delta + (k < s[i].added ? k : s[i].added - 1);
+        }
+        else
+            c[j].cy += delta;
+        if (c[j].cy < 0)
+            c[j].cy = 0;
+    }
+}
+
+/** Keep the windows showing `b`, and the position it remembers, on the same rows after splices that moved rows. */
+void editorSpliceWindows(struct editorBuffer *b, struct rowSplice *s, int n)
+{
+    int i, last = b->num_rows > 0 ? b->num_rows - 1 : 0;
+    struct editorCursor c[2] = {{b->cx, b->rowoff}, {0, b->cy}};
+    editorSpliceCursors(s, n, c, 1);
+    editorSpliceCursors(s, n, c + 1, 1);
+    b->rowoff = c[0].cy;
+    b->cy = c[1].cy > last ? last : c[1].cy;
+    for (i = 0; i < E.num_windows; i++)
+    {
+        struct editorWindow *w = E.windows[i];
+        if (w->buf != b)
+            continue;
+        c[0].cy = w->rowoff;
+        c[1].cy = w->cy;
+        editorSpliceCursors(s, n, c, 1);
+        editorSpliceCursors(s, n, c + 1, 1);
+        w->rowoff = c[0].cy;
+        w->cy = c[1].cy > last ? last : c[1].cy;
+        editorSpliceCursors(s, n, w->cursors, w->num_cursors);
+        while (w->num_cursors > 0 && w->cursors[w->num_cursors - 1].cy > last)
+            w->num_cursors--;
+    }
+}
+
+/**
+ * Where editorSpliceRows() is in the buffer: row `off` of block `blk`, whose first row is row `start`, and what the
+ * splices did to the blocks so far.
+ */
+struct splicePos
+{
+    int blk, start, off;
+    int moved;       // Blocks were added or dropped, so the row index must be built again
+    int oversize;    // Some block grew past twice STORE_BLOCK_ROWS rows and must be split
+    int first, last; // Blocks whose rows changed, while none moved
+};
+
+/** Note that the rows of block `blk` changed. */
+void spliceTouch(struct splicePos *p, int blk)
+{
+    if (p->first > blk)
+        p->first = blk;
+    if (p->last < blk)
+        p->last = blk;
+}
+
+/**
+ * Cut `count` rows out of `b` at position `p`, into `old` or else freed. Whole blocks go as they are, rows are taken out
+ * of the others in place. Afterwards `p` is where the rows were, at the end of the block before them if they were the last.
+ */
+void spliceCut(struct editorBuffer *b, struct splicePos *p, int count, struct blockList *old)
+{
+    while (count > 0)
+    {
+        struct rowBlock *k = b->blocks[p->blk];
+        int m = k->num_rows - p->off < count ? k->num_rows - p->off : count;
+        if (m == k->num_rows)
+        {
+            if (old != NULL)
+            {
+                blockDropRender(k);
+                blockListPush(old, k);
+            }
+            else
+                blockFree(b, k);
+            memmove(&b->blocks[p->blk], &b->blocks[p->blk + 1], sizeof(struct rowBlock *) * (b->num_blocks - p->blk - 1));
+            b->num_blocks--;
+            p->moved = 1;
+        }
+        else
+        {
+            // Rows are found in a frozen block by their place in it, so it is thawed before any moves
+            editorTouchBlock(editorBlock(b, p->blk));
+            if (old != NULL)
+                blockListTake(b, old, k, p->off, m);
+            else
+                blockFreeRows(b, k, p->off, m);
+            spliceTouch(p, p->blk);
+            if (p->off == k->num_rows && count > m)
+            {
+                p->start += k->num_rows;
+                p->blk++;
+                p->off = 0;
+            }
+        }
+        b->num_rows -= m;
+        count -= m;
+    }
+    if (p->blk == b->num_blocks && b->num_blocks > 0)
+    {
+        p->blk--;
+        p->off = b->blocks[p->blk]->num_rows;
+        p->start -= p->off;
+    }
+}
+
+/**
+ * Paste the next `count` rows of `rows` into `b` at position `p`. A few rows go into the block there, more are put
+ * between its two halves as whole blocks: those of `rows` as they are, and the rows of partly used ones in new blocks.
+ * Afterwards `p` is still valid for the next splice, which is behind the pasted rows.
+ */
+void splicePaste(struct editorBuffer *b, struct splicePos *p, int count, struct blockList *rows)
+{
+    if (count == 0)
+        return;
+    b->num_rows += count;
+    if (count <= STORE_BLOCK_ROWS && b->num_blocks > 0)
+    {
+        struct rowBlock *k = editorBlock(b, p->blk);
+        int at = p->off;
+        editorTouchBlock(k);
+        while (count > 0)
+        {
+            struct rowBlock *src = rows->blocks[rows->next];
+            int m = src->num_rows < count ? src->num_rows : count;
+            blockMoveRows(b, k, at, src, 0, m);
+            blockRemoveRows(src, 0, m);
+            if (src->num_rows == 0)
+                blockFree(b, rows->blocks[rows->next++]);
+            at += m;
+            count -= m;
+        }
+        spliceTouch(p, p->blk);
+        if (k->num_rows > 2 * STORE_BLOCK_ROWS)
+            p->oversize = 1;
+        return;
+    }
+
+    int at = 0, n = 0;
+    if (b->num_blocks > 0)
+    {
+        struct rowBlock *k = b->blocks[p->blk];
+        at = p->off == 0 ? p->blk : p->blk + 1;
+        if (p->off > 0 && p->off < k->num_rows)
+        {
+            struct rowBlock *tail = blockNew(k->num_rows - p->off);
+            blockMoveRows(b, tail, 0, k, p->off, k->num_rows - p->off);
+            blockRemoveRows(k, p->off, k->num_rows - p->off);
+            editorInsertBlocks(b, at, &tail, 1);
+        }
+    }
+    struct rowBlock **add = malloc(sizeof(struct rowBlock *) * (rows->num - rows->next + 1));
+    if (add == NULL)
+        die("malloc");
+    while (count > 0)
+    {
+        struct rowBlock *src = rows->blocks[rows->next];
+        if (src->num_rows <= count)
+        {
+            add[n++] = src;
+            rows->next++;
+            count -= src->num_rows;
+            continue;
+        }
+        struct rowBlock *k = add[n++] = blockNew(count);
+        blockMoveRows(b, k, 0, src, 0, count);
+        blockRemoveRows(src, 0, count);
+        count = 0;
+    }
+    editorInsertBlocks(b, at, add, n);
+    free(add);
+    p->moved = 1;
+}
+
+/**
+ * Put the blocks of `b` back in shape after splices that moved blocks: emptied blocks are dropped, blocks over twice
+ * STORE_BLOCK_ROWS rows are split and neighbours too small to be worth a block of their own are merged, unless they
+ * are frozen or unloaded. One pass over the block pointers, the rows of blocks that stay as they are do not move.
+ */
+void editorNormalizeBlocks(struct editorBuffer *b)
+{
+    int i, n = 0;
+    for (i = 0; i < b->num_blocks; i++)
+    {
+        struct rowBlock *k = b->blocks[i], *prev = n > 0 ? b->blocks[n - 1] : NULL;
+        if (k->num_rows == 0)
+        {
+            blockFree(b, k);
+            continue;
+        }
+        if (prev != NULL && prev->row && k->row && !prev->frozen && !k->frozen && prev->num_rows + k->num_rows <= STORE_BLOCK_ROWS &&
+            (prev->num_rows < STORE_BLOCK_ROWS / 4 || k->num_rows < STORE_BLOCK_ROWS / 4))
+        {
+            blockMoveRows(b, prev, prev->num_rows, k, 0, k->num_rows);
+            blockRemoveRows(k, 0, k->num_rows);
+            blockFree(b, k);
+            continue;
+        }
+        if (k->num_rows > 2 * STORE_BLOCK_ROWS)
+        {
+            // The split blocks go where the blocks behind them are, those move up to make room
+            int parts = (k->num_rows + STORE_BLOCK_ROWS - 1) / STORE_BLOCK_ROWS - 1, j;
+            struct rowBlock **tail = malloc(sizeof(struct rowBlock *) * parts);
+            if (tail == NULL)
+                die("malloc");
+            for (j = parts - 1; j >= 0; j--)
+            {
+                int from = (j + 1) * STORE_BLOCK_ROWS;
+                tail[j] = blockNew(STORE_BLOCK_ROWS);
+                blockMoveRows(b, tail[j], 0, k, from, k->num_rows - from);
+                blockRemoveRows(k, from, k->num_rows - from);
+            }
+            b->blocks[n++] = k;
+            editorInsertBlocks(b, i + 1, tail, parts);
+            free(tail);
+            continue;
+        }
+        b->blocks[n++] = k;
+    }
+    b->num_blocks = n;
+}
+
+/**
+ * Replace runs of rows of `b`, all in one pass. Splice i replaces s[i].removed rows at row s[i].at by the next
+ * s[i].added rows of `rows`, which are taken out of it. The splices are sorted and do not overlap, and their rows are
+ * numbered as before any of them. The rows they replace go to the end of `old` when it is not NULL, and are freed otherwise.
+ *
+ * Only the blocks of the spliced rows are touched: the row index finds the block of the first splice, and from there
+ * the splices and the blocks are walked side by side. Rows are cut out of their blocks and pasted into them in place,
+ * see spliceCut() and splicePaste(), so an edit only thaws the blocks it edits and the other rows, their text and their
+ * render caches stay where they are. When no block was added or dropped the row index is updated in O(log n) per block
+ * touched, otherwise it is built again over the blocks, which are STORE_BLOCK_ROWS times fewer than the rows.
+ */
+void editorSpliceBlocks(struct editorBuffer *b, struct rowSplice *s, int n, struct blockList *rows, struct blockList *old)
+{
+    TRACE_SCOPE("editorSpliceBlocks");
+    struct splicePos p = {0};
+    int i, delta = 0, moved = 0;
+    if (n == 0)
+        return;
+    p.blk = editorFindRow(b, s[0].at, &p.off);
+    p.start = s[0].at - p.off;
+    p.first = b->num_blocks;
+    p.last = -1;
+    for (i = 0; i < n; i++)
+    {
+        int at = s[i].at + delta;
+        while (p.blk < b->num_blocks - 1 && at >= p.start + b->blocks[p.blk]->num_rows)
+        {
+            p.start += b->blocks[p.blk]->num_rows;
+            p.blk++;
+        }
+        p.off = at - p.start;
+        spliceCut(b, &p, s[i].removed, old);
+        splicePaste(b, &p, s[i].added, rows);
+        delta += s[i].added - s[i].removed;
+        if (s[i].added != s[i].removed)
+            moved = 1;
+    }
+    if (p.moved || p.oversize)
+    {
+        editorNormalizeBlocks(b);
+        editorIndexRebuild(b);
+    }
+    else
+        for (i = p.first; i <= p.last; i++)
+            editorIndexSync(b, i);
+    if (moved)
+    {
+        editorUpdateGutter(b);
+        editorSpliceWindows(b, s, n);
+    }
+    TRACE_ARG("splices", n);
+    editorRedrawBuffer(b);
+}
+
+/**
+ * editorSpliceBlocks() with the new rows given as their text one after the other, without line terminators, and the
+ * length of each in `lens`. The text is copied into the row store.
+ */
+void editorSpliceRows(struct editorBuffer *b, struct rowSplice *s, int n, const char *text, const int *lens, struct blockList *old)
+{
+    struct blockList rows = {0};
+    int i, j, term = b->crlf ? 2 : 1, added = 0;
+    for (i = 0; i < n; i++)
+        added += s[i].added;
+    for (j = 0; j < added; j++)
+    {
+        blockListAdd(b, &rows, text, lens[j], lens[j] + term);
+        text += lens[j];
+    }
+    editorSpliceBlocks(b, s, n, &rows, old);
+    blockListFree(b, &rows);
+}
+
+/**
+ * Put rows [top, top + n) of `b` in a new order: row top + i gets the row that was at top + perm[i]. The rows move, not
+ * their text. Rows of the mapping and interned rows keep pointing where they did, and the text a row has in the arena of
+ * its block is copied only when the row goes to another block. Every block first makes room for what it gets, so no
+ * arena is replaced while rows are still to be copied out of it. The render caches of the rows are dropped.
+ */
+void editorPermuteRows(struct editorBuffer *b, int top, int n, const int *perm)
+{
+    TRACE_SCOPE("editorPermuteRows");
+    int i, off, first, blk;
+    if (n == 0)
+        return;
+    editorThawRows(b, top, top + n - 1);
+    first = blk = editorFindRow(b, top, &off);
+    erow **at = malloc(sizeof(erow *) * n), *rows = malloc(sizeof(erow) * n);
+    int *from = malloc(sizeof(int) * n), *lens = malloc(sizeof(int) * n);
+    if (at == NULL || rows == NULL || from == NULL || lens == NULL)
+        die("malloc");
+    for (i = 0; i < n; i++, off++)
+    {
+        struct rowBlock *k = b->blocks[blk];
+        if (off == k->num_rows)
+        {
+            k = b->blocks[++blk];
+            off = 0;
+        }
+        editorFreeRender(k, &k->row[off]);
+        at[i] = &k->row[off];
+        from[i] = blk;
+        lens[i] = k->lens[off];
+    }
+    int last = blk;
+    size_t *need = calloc(last - first + 1, sizeof(size_t));
+    if (need == NULL)
+        die("malloc");
+    for (i = 0; i < n; i++)
+        if (from[perm[i]] != from[i] && editorRowInArena(b, at[perm[i]]))
+            need[from[i] - first] += at[perm[i]]->size;
+    for (blk = first; blk <= last; blk++)
+        if (need[blk - first] > 0)
+            blockReserveText(b, b->blocks[blk], need[blk - first]);
+
+    for (i = 0; i < n; i++)
+    {
+        rows[i] = *at[i];
+        rows[i].render = NULL; // Freed above, but blockReserveText() points it at the new chars of a row that had none
+        rows[i].rsize = 0;
+    }
+    for (i = 0; i < n; i++)
+    {
+        struct rowBlock *k = b->blocks[from[i]];
+        erow row = rows[perm[i]];
+        if (from[perm[i]] != from[i] && editorRowInArena(b, &row))
+            row.chars = editorStoreText(b, k, row.chars, row.size);
+        *at[i] = row;
+        k->lens[at[i] - k->row] = lens[perm[i]];
+    }
+    for (blk = first; blk <= last; blk++)
+    {
+        struct rowBlock *k = b->blocks[blk];
+        k->bytes = 0;
+        for (i = 0; i < k->num_rows; i++)
+            k->bytes += k->lens[i];
+        k->dirty = 1; // The rows left in the arena are not in the order of the compressed copy any more
+        k->used = ++E.mem_tick;
+        editorIndexSync(b, blk);
+    }
+    editorRedrawBuffer(b);
+    free(need);
+    free(lens);
+    free(from);
+    free(rows);
+    free(at);
+}
+
+/** undo */
+
+void undoFree(struct editorBuffer *b, struct undoStep *u)
+{
+    blockListFree(b, &u->rows);
+    memFree(MEM_UNDO, u->perm, sizeof(int) * u->perm_len);
+    memFree(MEM_UNDO, u->splices, u->bytes);
+}
+
+/**
+ * Start an undo step for splices `s` about to be made to `b`, with the cursors of window `w`, and return where the
+ * splices are to put the rows they replace. What the previous step keeps is known by now: it is added up, and the
+ * oldest steps are forgotten while the steps keep more than their part of the memory budget. The step being started
+ * always stays, however big its edit.
+ */
+struct blockList *editorSaveUndo(struct editorBuffer *b, struct rowSplice *s, int n, struct editorWindow *w)
+{
+    struct undoStep u = {0};
+    int i, delta = 0;
+    if (b->undo == NULL)
+        b->undo = memAlloc(MEM_UNDO, sizeof(struct undoStep) * UNDO_STEPS);
+    if (b->undo_open)
+    {
+        struct undoStep *last = &b->undo[(b->undo_first + b->num_undo - 1) % UNDO_STEPS];
+        last->kept = last->bytes + blockListBytes(&last->rows) + sizeof(int) * last->perm_len;
+        b->undo_kept += last->kept;
+        b->undo_open = 0;
+    }
+    while (b->num_undo > 0 && (b->num_undo == UNDO_STEPS || b->undo_kept > (long long)(E.mem_budget / UNDO_BUDGET_FRACTION)))
+    {
+        b->undo_kept -= b->undo[b->undo_first].kept;
+        undoFree(b, &b->undo[b->undo_first]);
+        b->undo_first = (b->undo_first + 1) % UNDO_STEPS;
+        b->num_undo--;
+    }
+
+    u.num_splices = n;
+    u.num_cursors = w->num_cursors + 1;
+    u.bytes = sizeof(struct rowSplice) * n + sizeof(struct editorCursor) * u.num_cursors;
+    u.splices = memAlloc(MEM_UNDO, u.bytes);
+    u.cursors = (struct editorCursor *)(u.splices + n);
+    for (i = 0; i < n; i++)
+    {
+        u.splices[i].at = s[i].at + delta;
+        u.splices[i].removed = s[i].added;
+        u.splices[i].added = s[i].removed;
+        delta += s[i].added - s[i].removed;
+    }
+    u.cursors[0].cx = w->cx;
+    u.cursors[0].cy = w->cy;
+    if (w->num_cursors > 0)
+        memcpy(u.cursors + 1, w->cursors, sizeof(struct editorCursor) * w->num_cursors);
+
+    struct undoStep *step = &b->undo[(b->undo_first + b->num_undo++) % UNDO_STEPS];
+    *step = u;
+    b->undo_open = 1;
+    return &step->rows;
+}
+
+/** multiple cursors */
+
+int editorCursorCompare(const void *a, const void *b)
+{
+    const struct editorCursor *x = a, *y = b;
+    if (x->cy != y->cy)
+        return x->cy < y->cy ? -1 : 1;
+    return x->cx < y->cx ? -1 : x->cx > y->cx;
+}
+
+/** Make room for `n` extra cursors in window `w`. */
+void editorReserveCursors(struct editorWindow *w, int n)
+{
+    if (n <= w->cursors_cap)
+        return;
+    int cap = w->cursors_cap ? w->cursors_cap * 2 : 64;
+    while (cap < n)
+        cap *= 2;
+    if ((w->cursors = realloc(w->cursors, sizeof(struct editorCursor) * cap)) == NULL)
+        die("realloc");
+    w->cursors_cap = cap;
+}
+
+/** Sort the extra cursors of `w` and drop the ones that landed on another cursor. */
+void editorSortCursors(struct editorWindow *w)
+{
+    int i, n = 0;
+    qsort(w->cursors, w->num_cursors, sizeof(struct editorCursor), editorCursorCompare);
+    for (i = 0; i < w->num_cursors; i++)
+    {
+        struct editorCursor *c = &w->cursors[i];
+        if ((c->cx == w->cx && c->cy == w->cy) || (n > 0 && editorCursorCompare(c, &w->cursors[n - 1]) == 0))
+            continue;
+        w->cursors[n++] = *c;
+    }
+    w->num_cursors = n;
+    w->redraw = 1;
+}
+
+/** Set the cursors of `w`, its own cursor first, as an undo step saved them. */
+void editorSetCursors(struct editorWindow *w, const struct editorCursor *c, int n)
+{
+    w->cx = c[0].cx;
+    w->cy = c[0].cy;
+    editorReserveCursors(w, n - 1);
+    memcpy(w->cursors, c + 1, sizeof(struct editorCursor) * (n - 1));
+    w->num_cursors = n - 1;
+    editorSortCursors(w);
+}
+
+void editorClearCursors(struct editorWindow *w)
+{
+    if (w->num_cursors > 0)
+        w->redraw = 1;
+    w->num_cursors = 0;
+}
+
+/** Leave an extra cursor where the cursor is and move the cursor a row down, Ctrl-E repeated makes a column of cursors. */
+void editorAddCursorBelow()
+{
+    struct editorWindow *w = E.win;
+    if (w->buf->hex || w->cy >= w->buf->num_rows - 1)
+        return;
+    editorReserveCursors(w, w->num_cursors + 1);
+    w->cursors[w->num_cursors].cx = w->cx;
+    w->cursors[w->num_cursors++].cy = w->cy;
+    w->cy++;
+    editorSortCursors(w);
+}
+
+/**
+ * Put a cursor in the current column of every row from the cursor to a line asked for, a line number or $ for the
+ * last line, above or below. This is how one edit is made to every line of a file.
+ */
+void editorAddCursorColumn()
+{
+    struct editorWindow *w = E.win;
+    if (w->buf->hex || w->buf->num_rows == 0)
+        return;
+    char *answer = editorPrompt("Add cursors down to line (number, $ for the last): %s");
+    if (answer == NULL)
+        return;
+    int to = strcmp(answer, "$") == 0 ? w->buf->num_rows : atoi(answer), from, row;
+    free(answer);
+    if (to < 1)
+    {
+        editorSetStatusMessage("Not a line number");
+        return;
+    }
+    if (--to >= w->buf->num_rows)
+        to = w->buf->num_rows - 1;
+    from = to < w->cy ? to : w->cy;
+    if (to < w->cy)
+        to = w->cy;
+    editorReserveCursors(w, w->num_cursors + to - from + 1);
+    for (row = from; row <= to; row++)
+    {
+        w->cursors[w->num_cursors].cx = w->cx;
+        w->cursors[w->num_cursors++].cy = row;
+    }
+    editorSortCursors(w);
+    editorSetStatusMessage("%d cursors", w->num_cursors + 1);
+}
+
+/** Move the extra cursors of the focused window like editorMoveCursor() moves its own. */
+void editorMoveCursors(int key)
+{
+    struct editorWindow *w = E.win;
+    int i, last = editorViewRows(w->buf) - 1;
+    if (w->num_cursors == 0)
+        return;
+    for (i = 0; i < w->num_cursors; i++)
+    {
+        struct editorCursor *c = &w->cursors[i];
+        if (key == ARROW_LEFT && c->cx > 0)
+            c->cx--;
+        else if (key == ARROW_RIGHT && c->cx < editorMaxCol(w))
+            c->cx++;
+        else if (key == ARROW_UP && c->cy > 0)
+            c->cy--;
+        else if (key == ARROW_DOWN && c->cy < last)
+            c->cy++;
+        else if (key == HOME_KEY)
+            c->cx = 0;
+    }
+    editorSortCursors(w);
+}
+
+/** A cursor taking part in an edit, see editorEdit(). */
+struct editCursor
+{
+    int row, at, len; // Row, byte of the row, and length of the row; the new row and byte once the edit is made
+    int cx;           // Screen column of the new position
+    int main;         // This is the window's own cursor
+    size_t pos;       // Offset in the text of its run of rows, before the edit and then after it
+};
+
+int editCursorCompare(const void *a, const void *b)
+{
+    const struct editCursor *x = a, *y = b;
+    if (x->row != y->row)
+        return x->row < y->row ? -1 : 1;
+    return x->at < y->at ? -1 : x->at > y->at;
+}
+
+/** The rows an edit of kind `kind` at cursor `c` reads and replaces, which reach into the next or previous row to join them. */
+void editCursorRows(struct editorBuffer *b, int kind, struct editCursor *c, int *lo, int *hi)
+{
+    *lo = c->row - (kind == EDIT_BACKSPACE && c->at == 0 && c->row > 0);
+    *hi = c->row + (kind == EDIT_DELETE && c->at == c->len && c->row < b->num_rows - 1);
+}
+
+/**
+ * Apply an edit at every cursor of the focused window at once. The cursors are sorted, and those whose rows overlap form
+ * a run of rows that is edited as one piece of text: the rows joined with newlines, the edit applied at each cursor from
+ * the first to the last, and the result cut at its newlines into the new rows. Each cursor works on what the ones
+ * before it left, so two cursors side by side that both delete a character delete two. The runs become the splices
+ * of a single editorSpliceRows() call and a single undo step.
+ */
+void editorEdit(int kind, const char *s, int len)
+{
+    TRACE_SCOPE("editorEdit");
+    struct editorWindow *w = E.win;
+    struct editorBuffer *b = w->buf;
+    if (!editorCanEdit())
+        return;
+    int n = w->num_cursors + 1, num_splices = 0, delta = 0, i, j, k, r;
+    struct editCursor *c = malloc(sizeof(struct editCursor) * n);
+    struct rowSplice *splices = malloc(sizeof(struct rowSplice) * n);
+    struct rowText in = {0}, out = {0}, rows = {0};
+    if (c == NULL || splices == NULL)
+        die("malloc");
+    TRACE_ARG("cursors", n);
+
+    for (i = 0; i < n; i++)
+    {
+        struct editorCursor *from = i == 0 ? &(struct editorCursor){w->cx, w->cy} : &w->cursors[i - 1];
+        c[i].main = i == 0;
+        c[i].row = c[i].at = c[i].len = 0;
+        c[i].pos = 0; // An empty buffer has no rows to place the cursors in
+        if (b->num_rows > 0)
+        {
+            c[i].row = from->cy < b->num_rows ? from->cy : b->num_rows - 1;
+            char *text = editorRowText(b, c[i].row, &c[i].len);
+            c[i].at = editorTextIndex(text, c[i].len, from->cx);
+        }
+    }
+    qsort(c, n, sizeof(struct editCursor), editCursorCompare);
+    for (i = j = 0; i < n; i++)
+    {
+        if (j > 0 && editCursorCompare(&c[i], &c[j - 1]) == 0)
+            c[j - 1].main |= c[i].main;
+        else
+            c[j++] = c[i];
+    }
+    n = j;
+
+    for (i = 0; i < n; i = j)
+    {
+        int lo, hi, l, h;
+        editCursorRows(b, kind, &c[i], &lo, &hi);
+        for (j = i + 1; j < n; j++)
+        {
+            editCursorRows(b, kind, &c[j], &l, &h);
+            if (l > hi)
+                break;
+            if (h > hi)
+                hi = h;
+        }
+
+        in.len = out.len = 0;
+        for (r = lo, k = i; r <= hi && r < b->num_rows; r++)
+        {
+            int rl;
+            if (r > lo)
+                rowTextAppend(&in, "\n", 1);
+            for (; k < j && c[k].row == r; k++)
+                c[k].pos = in.len + c[k].at;
+            char *text = editorRowText(b, r, &rl);
+            rowTextAppend(&in, text, rl);
+        }
+
+        size_t pos = 0;
+        for (k = i; k < j; k++)
+        {
+            if (c[k].pos < pos)
+                c[k].pos = pos; // A cursor before it deleted past it
+            rowTextAppend(&out, in.text + pos, c[k].pos - pos);
+            pos = c[k].pos;
+            if (kind == EDIT_INSERT)
+                rowTextAppend(&out, s, len);
+            else if (kind == EDIT_BACKSPACE && out.len > 0)
+                do
+                    out.len--;
+                while (out.len > 0 && (out.text[out.len] & 0xc0) == 0x80);
+            else if (kind == EDIT_DELETE && pos < in.len)
+                do
+                    pos++;
+                while (pos < in.len && (in.text[pos] & 0xc0) == 0x80);
+            c[k].pos = out.len;
+        }
+        rowTextAppend(&out, in.text + pos, in.len - pos);
+
+        // Cut the result into rows, and find the new row and column of every cursor on the way
+        int first = rows.rows;
+        char *p = out.text, *end = out.text + out.len, *nl;
+        k = i;
+        do
+        {
+            if ((nl = E.simd->find_byte(p, end - p, '\n')) == NULL)
+                nl = end;
+            for (; k < j && c[k].pos <= (size_t)(nl - out.text); k++)
+            {
+                c[k].row = lo + delta + rows.rows - first;
+                c[k].at = c[k].pos - (p - out.text);
+                c[k].cx = editorTextColumn(p, c[k].at);
+            }
+            rowTextAdd(&rows, p, nl - p);
+            p = nl + 1;
+        } while (nl < end);
+
+        splices[num_splices].at = lo;
+        splices[num_splices].removed = b->num_rows > 0 ? hi - lo + 1 : 0;
+        splices[num_splices].added = rows.rows - first;
+        delta += splices[num_splices].added - splices[num_splices].removed;
+        num_splices++;
+    }
+
+    editorSpliceRows(b, splices, num_splices, rows.text, rows.lens, editorSaveUndo(b, splices, num_splices, w));
+    editorReserveCursors(w, n);
+    w->num_cursors = 0;
+    for (i = 0; i < n; i++)
+    {
+        if (c[i].main)
+        {
+            w->cx = c[i].cx;
+            w->cy = c[i].row;
+        }
+        else
+        {
+            w->cursors[w->num_cursors].cx = c[i].cx;
+            w->cursors[w->num_cursors++].cy = c[i].row;
+        }
+    }
+    editorSortCursors(w);
+    rowTextFree(&in);
+    rowTextFree(&out);
+    rowTextFree(&rows);
+    free(c);
+    free(splices);
+}
+
+/** Take back the last edit of the current buffer, and put the cursors back where they were before it. */
+void editorUndo()
+{
+    struct editorBuffer *b = E.buf;
+    if (!editorCanEdit())
+        return;
+    if (b->num_undo == 0)
+    {
+        editorSetStatusMessage("Nothing to undo");
+        return;
+    }
+    struct undoStep *u = &b->undo[(b->undo_first + --b->num_undo) % UNDO_STEPS];
+    if (b->undo_open)
+        b->undo_open = 0;
+    else
+        b->undo_kept -= u->kept;
+    editorSpliceBlocks(b, u->splices, u->num_splices, &u->rows, NULL);
+    if (u->perm != NULL)
+        editorPermuteRows(b, u->perm_at, u->perm_len, u->perm);
+    editorSetCursors(E.win, u->cursors, u->num_cursors);
+    undoFree(b, u);
+}
+
+/** block selection */
+
+#define BLOCK_CHUNK_ROWS 65536 // Rows of a block edit per task, a multiple of STORE_BLOCK_ROWS. Smaller block edits are done on the main thread
+
+/**
+ * A block selection is the rectangle between an anchor and the cursor, taken as columns [lo, hi) of every row
+ * from the one to the other: the column of the cursor itself is not in it, so a block of width zero is an insertion
+ * point on every row. Rows shorter than the block's first column are left alone.
+ *
+ * A block edit replaces the columns of the block with the same text on every row, so a row's new length only depends
+ * on the row. Like editorIndexRows() it is done in two passes over chunks of rows on the task pool: the first cuts every
+ * row and adds up the new lengths of each row block to come, which tells how big their arenas must be, and the second
+ * writes the new rows straight into those blocks. A chunk starts where a block does, so each block is filled by one task.
+ */
+struct blockChunk
+{
+    struct editorBuffer *b;
+    int first, last;     // Rows [first, last)
+    int lo, hi;          // Columns replaced
+    const char *s;       // By this text
+    int len;
+    int *cut;            // Pass 1: byte where the block starts and ends in each row, -1 for a row it misses
+    int *lens;           // Pass 1: new length of each row
+    size_t *bytes;       // Pass 1: new text of each row block of the chunk
+    struct rowBlock **blocks; // Pass 2: where the rows go, STORE_BLOCK_ROWS to a block
+};
+
+/**
+ * Find the bytes of a row that columns [lo, hi) cover. Without a tab in the row every byte is one column. The block
+ * takes whole UTF-8 characters: a column in the middle of one moves back to where it starts on the left side and on to
+ * where the next one starts on the right.
+ */
+void blockCut(const char *text, int len, int lo, int hi, int *cut)
+{
+    if (E.simd->find_byte(text, len, '\t') == NULL)
+    {
+        cut[0] = len < lo ? -1 : lo;
+        cut[1] = len < hi ? len : hi;
+    }
+    else
+    {
+        cut[0] = editorTextIndex(text, len, lo);
+        cut[1] = editorTextIndex(text, len, hi);
+        if (cut[0] == len && editorTextColumn(text, len) < lo)
+            cut[0] = -1;
+    }
+    if (cut[0] < 0)
+        return;
+    while (cut[0] > 0 && cut[0] < len && (text[cut[0]] & 0xc0) == 0x80)
+        cut[0]--;
+    while (cut[1] < len && (text[cut[1]] & 0xc0) == 0x80)
+        cut[1]++;
+}
+
+void blockMeasureTask(void *arg, struct cancelToken *token)
+{
+    TRACE_SCOPE("blockMeasureTask");
+    struct blockChunk *c = arg;
+    int i;
+    struct rowIter it;
+    (void)token;
+    for (rowIterStart(&it, c->b, c->first), i = 0; i < c->last - c->first; i++)
+    {
+        erow *row = rowIterNext(&it);
+        int *cut = &c->cut[2 * i];
+        blockCut(row->chars, row->size, c->lo, c->hi, cut);
+        c->lens[i] = cut[0] < 0 ? row->size : row->size - (cut[1] - cut[0]) + c->len;
+        c->bytes[i / STORE_BLOCK_ROWS] += c->lens[i];
+    }
+}
+
+void blockFillTask(void *arg, struct cancelToken *token)
+{
+    TRACE_SCOPE("blockFillTask");
+    struct blockChunk *c = arg;
+    struct rowBlock *k = NULL;
+    char *p = NULL;
+    int i, term = c->b->crlf ? 2 : 1;
+    struct rowIter it;
+    (void)token;
+    for (rowIterStart(&it, c->b, c->first), i = 0; i < c->last - c->first; i++)
+    {
+        erow *row = rowIterNext(&it), *to;
+        int *cut = &c->cut[2 * i];
+        if (i % STORE_BLOCK_ROWS == 0)
+        {
+            k = c->blocks[i / STORE_BLOCK_ROWS];
+            p = k->text;
+        }
+        to = &k->row[i % STORE_BLOCK_ROWS];
+        to->chars = p;
+        to->size = c->lens[i];
+        to->render = NULL;
+        to->rsize = 0;
+        k->lens[i % STORE_BLOCK_ROWS] = c->lens[i] + term;
+        k->bytes += c->lens[i] + term;
+        if (cut[0] < 0)
+            memcpy(p, row->chars, row->size);
+        else
+        {
+            memcpy(p, row->chars, cut[0]);
+            memcpy(p + cut[0], c->s, c->len);
+            memcpy(p + cut[0] + c->len, row->chars + cut[1], row->size - cut[1]);
+        }
+        p += c->lens[i];
+    }
+}
+
+/** Rows and columns of the block selection of window `w`. */
+void editorBlockBounds(struct editorWindow *w, int *top, int *bottom, int *lo, int *hi)
+{
+    *top = w->cy < w->block_cy ? w->cy : w->block_cy;
+    *bottom = w->cy < w->block_cy ? w->block_cy : w->cy;
+    *lo = w->cx < w->block_cx ? w->cx : w->block_cx;
+    *hi = w->cx < w->block_cx ? w->block_cx : w->cx;
+}
+
+/** Replace columns [lo, hi) of the rows of the block selection by `s`, as one undo step, and leave an insertion point after it. */
+void editorBlockEdit(int lo, int hi, const char *s, int len)
+{
+    TRACE_SCOPE("editorBlockEdit");
+    struct editorWindow *w = E.win;
+    struct editorBuffer *b = w->buf;
+    int top, bottom, x, y, i;
+    if (!editorCanEdit() || b->num_rows == 0)
+        return;
+    editorBlockBounds(w, &top, &bottom, &x, &y);
+    if (bottom >= b->num_rows)
+        bottom = b->num_rows - 1;
+    int n = bottom - top + 1, nchunks = (n + BLOCK_CHUNK_ROWS - 1) / BLOCK_CHUNK_ROWS;
+    int nblocks = (n + STORE_BLOCK_ROWS - 1) / STORE_BLOCK_ROWS;
+    TRACE_ARG("rows", n);
+
+    editorThawRows(b, top, bottom); // The tasks read the rows straight from their chars
+
+    struct blockChunk *chunks = calloc(nchunks, sizeof(struct blockChunk));
+    int *cut = malloc(sizeof(int) * 2 * n), *lens = malloc(sizeof(int) * n);
+    size_t *bytes = calloc(nblocks, sizeof(size_t));
+    struct blockList rows = {0};
+    if (chunks == NULL || cut == NULL || lens == NULL || bytes == NULL)
+        die("malloc");
+    struct taskGroup group;
+    taskGroupInit(&group);
+    for (i = 0; i < nchunks; i++)
+    {
+        struct blockChunk *c = &chunks[i];
+        c->b = b;
+        c->first = top + i * BLOCK_CHUNK_ROWS;
+        c->last = i == nchunks - 1 ? bottom + 1 : c->first + BLOCK_CHUNK_ROWS;
+        c->lo = lo;
+        c->hi = hi;
+        c->s = s;
+        c->len = len;
+        c->cut = &cut[2 * (c->first - top)];
+        c->lens = &lens[c->first - top];
+        c->bytes = &bytes[(c->first - top) / STORE_BLOCK_ROWS];
+        if (nchunks == 1)
+            blockMeasureTask(c, NULL);
+        else
+            poolSubmit(&group, NULL, blockMeasureTask, c);
+    }
+    taskGroupWait(&group);
+
+    // The blocks and their arenas are made here, the tasks only write into them
+    for (i = 0; i < nblocks; i++)
+    {
+        struct rowBlock *k = blockNew(STORE_BLOCK_ROWS);
+        k->num_rows = i == nblocks - 1 ? n - i * STORE_BLOCK_ROWS : STORE_BLOCK_ROWS;
+        k->text = memAlloc(MEM_ROWS, bytes[i]);
+        k->len = k->cap = bytes[i];
+        k->dirty = 1;
+        k->used = ++E.mem_tick;
+        blockListPush(&rows, k);
+    }
+    for (i = 0; i < nchunks; i++)
+    {
+        chunks[i].blocks = &rows.blocks[(chunks[i].first - top) / STORE_BLOCK_ROWS];
+        if (nchunks == 1)
+            blockFillTask(&chunks[i], NULL);
+        else
+            poolSubmit(&group, NULL, blockFillTask, &chunks[i]);
+    }
+    taskGroupWait(&group);
+    taskGroupDestroy(&group);
+    if (E.intern)
+        blockListIntern(&rows);
+
+    struct rowSplice splice = {top, n, n};
+    editorSpliceBlocks(b, &splice, 1, &rows, editorSaveUndo(b, &splice, 1, w));
+    blockListFree(b, &rows);
+    for (i = 0, x = lo; i < len; i++)
+        x += s[i] == '\t' ? TAB_STOP - x % TAB_STOP : 1;
+    w->cx = w->block_cx = x;
+    w->redraw = 1;
+    free(bytes);
+    free(lens);
+    free(cut);
+    free(chunks);
+}
+
+/** Start a block selection at the cursor, or end the one there is. */
+void editorToggleBlock()
+{
+    struct editorWindow *w = E.win;
+    if (w->block)
+    {
+        w->block = 0;
+        w->redraw = 1;
+        return;
+    }
+    if (!editorCanEdit())
+        return;
+    w->block = 1;
+    w->block_cx = w->cx;
+    w->block_cy = w->cy;
+    w->num_cursors = 0;
+    w->redraw = 1;
+    editorSetStatusMessage("Block: move to select, type to replace, Backspace/Del to delete, Ctrl-R replace, Esc to end");
+}
+
+/** Handle a key while a block is selected. Returns 0 for the keys that are not block edits, which move the cursor as usual. */
+int editorBlockKey(int c)
+{
+    struct editorWindow *w = E.win;
+    int top, bottom, lo, hi;
+    editorBlockBounds(w, &top, &bottom, &lo, &hi);
+    switch (c)
+    {
+    case '\x1b':
+        editorToggleBlock();
+        return 1;
+    case 127:
+    case CTRL_KEY('h'):
+        if (lo == hi && lo > 0)
+            lo--;
+        editorBlockEdit(lo, hi, "", 0);
+        return 1;
+    case DEL_KEY:
+        editorBlockEdit(lo, lo == hi ? hi + 1 : hi, "", 0);
+        return 1;
+    case CTRL_KEY('r'):
+    {
+        char *with = editorPrompt("Replace block with: %s");
+        if (with != NULL)
+            editorBlockEdit(lo, hi, with, strlen(with));
+        free(with);
+        return 1;
+    }
+    case '\r':
+        editorSetStatusMessage("A block edit cannot split lines");
+        return 1;
+    }
+    if (c == '\t' || (c >= 32 && c < 256 && c != 127))
+    {
+        char ch = c;
+        editorBlockEdit(lo, hi, &ch, 1);
+        return 1;
+    }
+    w->redraw = 1; // The cursor is a corner of the block
+    return 0;
+}
+
+/** filters */
+
+#define FILTER_PIPE_SIZE (1024 * 1024) // Asked for with F_SETPIPE_SZ, the default 64 KB pipe means a wakeup per 64 KB
+#define FILTER_STAGE (256 * 1024)      // Rows that cannot be spliced from the mapping are gathered into writes this big
+#define FILTER_READ (1024 * 1024)      // Bytes read from the command at a time
+#define FILTER_KILL_WAIT 2000000000LL  // Nanoseconds a cancelled command gets to exit after SIGTERM before SIGKILL
+
+/**
+ * The rows going to a command, and where the writer is in them. Rows are written in batches, either a run of rows that
+ * lie one after the other in the mapping with their newlines, which vmsplice() hands to the pipe as the pages of the
+ * mapping without copying them, or rows gathered in `stage`, each followed by a newline.
+ */
+struct filterInput
+{
+    struct editorBuffer *b;
+    int next, last;       // Next row of the batch after this one, and the last row to write
+    struct rowIter it;    // At row `next`
+    const char *pending;  // What the pipe did not take yet of the current batch
+    size_t pending_len;
+    int spliced;          // The current batch is in the mapping
+    char *stage;
+    size_t stage_cap;
+};
+
+/** What a command printed so far: its rows, already in row blocks, and the bytes read of the row it is still writing. */
+struct filterOutput
+{
+    struct blockList rows;
+    int num_rows;
+    char *buf;            // The unfinished row, with room for the next read after it
+    size_t len, cap;
+};
+
+/** Whether a row is in the mapping and followed there by its newline, so it can go to the pipe as it is. */
+int filterRowMapped(struct editorBuffer *b, erow *row)
+{
+    return !b->crlf && !editorRowOwned(b, row) && row->chars + row->size < b->map + b->map_len && row->chars[row->size] == '\n';
+}
+
+/** Make the next batch of rows the pending one. Returns 0 when every row has been written. */
+int filterNextBatch(struct filterInput *in)
+{
+    struct editorBuffer *b = in->b;
+    if (in->next > in->last)
+        return 0;
+    erow *row = rowIterPeek(&in->it);
+    if (filterRowMapped(b, row))
+    {
+        const char *start = row->chars, *end = start;
+        do
+        {
+            end += rowIterNext(&in->it)->size + 1;
+            if (++in->next > in->last)
+                break;
+            row = rowIterPeek(&in->it);
+        } while (row->chars == end && filterRowMapped(b, row));
+        in->pending = start;
+        in->pending_len = end - start;
+        in->spliced = 1;
+        return 1;
+    }
+    size_t len = 0;
+    while (in->next <= in->last)
+    {
+        row = rowIterPeek(&in->it);
+        if (len > 0 && filterRowMapped(b, row))
+            break;
+        if (len > 0 && len + row->size + 1 > FILTER_STAGE)
+            break;
+        if (len + row->size + 1 > in->stage_cap)
+        {
+            in->stage_cap = row->size + 1 > FILTER_STAGE ? (size_t)row->size + 1 : FILTER_STAGE;
+            if ((in->stage = realloc(in->stage, in->stage_cap)) == NULL)
+                die("realloc");
+        }
+        memcpy(in->stage + len, row->chars, row->size);
+        len += row->size;
+        in->stage[len++] = '\n';
+        rowIterNext(&in->it);
+        in->next++;
+    }
+    in->pending = in->stage;
+    in->pending_len = len;
+    in->spliced = 0;
+    return 1;
+}
+
+/**
+ * Write to the command until the pipe is full. Returns 0 once the input is finished, or the command stopped reading it,
+ * and the pipe can be closed. vmsplice() falls back to write() where the kernel refuses it or is not Linux.
+ */
+int filterWrite(struct filterInput *in, int fd)
+{
+    while (in->pending_len > 0 || filterNextBatch(in))
+    {
+        ssize_t n = -1;
+#ifdef __linux__
+        if (in->spliced)
+        {
+            struct iovec iov = {(void *)in->pending, in->pending_len};
+            n = vmsplice(fd, &iov, 1, SPLICE_F_NONBLOCK);
+            if (n == -1 && (errno == EINVAL || errno == ENOSYS))
+                in->spliced = 0;
+        }
+#else
+        in->spliced = 0; // Only Linux has vmsplice(), the batch is written like any other
+#endif
+        if (!in->spliced)
+            n = write(fd, in->pending, in->pending_len);
+        if (n == -1)
+            return errno == EAGAIN || errno == EINTR;
+        in->pending += n;
+        in->pending_len -= n;
+    }
+    return 0;
+}
+
+/** Add a row of `len` bytes of `s` to the output of a command, in the arena of the last of its blocks. */
+void filterAddRow(struct editorBuffer *b, struct filterOutput *out, const char *s, size_t len)
+{
+    blockListAdd(b, &out->rows, s, len, len + (b->crlf ? 2 : 1));
+    out->num_rows++;
+}
+
+/**
+ * Read what the command wrote and cut it into rows as it comes, each copied from the read buffer into the row blocks
+ * they will be spliced in as. The buffer only keeps the row that is not finished yet, so the output is in memory once.
+ * Returns 0 at the end of the output.
+ */
+int filterRead(struct editorBuffer *b, struct filterOutput *out, int fd)
+{
+    if (out->cap - out->len < FILTER_READ)
+    {
+        out->cap = out->len + FILTER_READ > 2 * out->cap ? out->len + FILTER_READ : 2 * out->cap;
+        if ((out->buf = realloc(out->buf, out->cap)) == NULL)
+            die("realloc");
+    }
+    ssize_t n = read(fd, out->buf + out->len, FILTER_READ);
+    if (n == -1)
+        return errno == EAGAIN || errno == EINTR;
+    if (n == 0)
+        return 0;
+    char *row = out->buf, *r = out->buf + out->len, *end = r + n, *nl;
+    while ((nl = E.simd->find_byte(r, end - r, '\n')) != NULL)
+    {
+        filterAddRow(b, out, row, nl - row);
+        row = r = nl + 1;
+    }
+    out->len = end - row;
+    memmove(out->buf, row, out->len);
+    return 1;
+}
+
+/** Start `cmd` with the shell, with pipes to its standard input and from its standard output. Returns its pid. */
+pid_t filterStart(const char *cmd, int *to, int *from)
+{
+    int in[2], out[2];
+#ifdef __linux__
+    if (pipe2(in, O_CLOEXEC) == -1 || pipe2(out, O_CLOEXEC) == -1)
+        die("pipe2");
+    // Fewer, bigger writes and reads. The kernel may cap the size, a smaller pipe only costs more wakeups
+    fcntl(in[1], F_SETPIPE_SZ, FILTER_PIPE_SIZE);
+    fcntl(out[0], F_SETPIPE_SZ, FILTER_PIPE_SIZE);
+#else
+    if (pipe(in) == -1 || pipe(out) == -1)
+        die("pipe");
+    fcntl(in[0], F_SETFD, FD_CLOEXEC);
+    fcntl(in[1], F_SETFD, FD_CLOEXEC);
+    fcntl(out[0], F_SETFD, FD_CLOEXEC);
+    fcntl(out[1], F_SETFD, FD_CLOEXEC);
+#endif
+    pid_t pid = fork();
+    if (pid == -1)
+        die("fork");
+    if (pid == 0)
+    {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        if (null != -1)
+            dup2(null, STDERR_FILENO); // It would write over the screen
+        signal(SIGPIPE, SIG_DFL);
+        setpgid(0, 0); // Its own process group, so that cancelling reaches the commands it starts too
+        execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+        _exit(127);
+    }
+    setpgid(pid, pid); // Also here, whichever of the two runs first
+    close(in[0]);
+    close(out[1]);
+    fcntl(in[1], F_SETFL, O_NONBLOCK);
+    fcntl(out[0], F_SETFL, O_NONBLOCK);
+    *to = in[1];
+    *from = out[0];
+    return pid;
+}
+
+/**
+ * Wait for the command to exit. It can run on after closing its output, Escape or Ctrl-C still cancel it then,
+ * and a command that does not exit within FILTER_KILL_WAIT of being cancelled is killed, so the editor never hangs on it.
+ * Returns 0 once `*status` holds how the command exited, or the errno of a failed waitpid(), when it is not known.
+ */
+int filterWait(pid_t pid, int *status, int *cancelled)
+{
+    long long deadline = monotonicNs() + FILTER_KILL_WAIT;
+    pid_t r;
+    while ((r = waitpid(pid, status, WNOHANG)) == 0 || (r == -1 && errno == EINTR))
+    {
+        if (!*cancelled && !E.replay && editorCancelRequested())
+        {
+            *cancelled = 1;
+            kill(-pid, SIGTERM);
+            deadline = monotonicNs() + FILTER_KILL_WAIT;
+        }
+        if (*cancelled && monotonicNs() > deadline)
+        {
+            kill(-pid, SIGKILL);
+            while ((r = waitpid(pid, status, 0)) == -1 && errno == EINTR)
+                ;
+            break;
+        }
+        struct timespec nap = {0, 1000000};
+        nanosleep(&nap, NULL);
+    }
+    return r == -1 ? errno : 0;
+}
+
+/**
+ * Replace rows [top, bottom] of the current buffer by what shell command `cmd` prints when they are its input.
+ * The rows are written to the command while its output is read, both through non-blocking pipes and one poll() loop,
+ * so neither side can block on a full pipe while the other waits for it. Nothing is kept of the input but the batch
+ * being written, and the output goes into row blocks as it arrives, which are spliced in whole. The rows replaced are
+ * cut into the undo step as they are. If the command fails nothing changes.
+ * SIGPIPE is ignored meanwhile, a command that stops reading early, like head, makes a write fail instead.
+ */
+void editorFilterRows(int top, int bottom, const char *cmd)
+{
+    TRACE_SCOPE("editorFilterRows");
+    struct editorWindow *w = E.win;
+    struct editorBuffer *b = w->buf;
+    struct filterInput in = {b, top, bottom, {NULL, 0, 0}, NULL, 0, 0, NULL, 0};
+    rowIterStart(&in.it, b, top);
+    struct filterOutput out = {0};
+    struct sigaction ignore = {0}, old;
+    int to, from, status = 0, cancelled = 0;
+    long long checked = monotonicNs();
+
+    editorThawRows(b, top, bottom);
+    ignore.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ignore, &old);
+    pid_t pid = filterStart(cmd, &to, &from);
+    while (from != -1)
+    {
+        struct pollfd pfd[2] = {{from, POLLIN, 0}, {to, POLLOUT, 0}};
+        if (poll(pfd, to != -1 ? 2 : 1, 100) == -1 && errno != EINTR)
+            die("poll");
+        if (to != -1 && pfd[1].revents && !filterWrite(&in, to))
+        {
+            close(to);
+            to = -1;
+            free(in.stage);
+            in.stage = NULL;
+        }
+        if (pfd[0].revents && !filterRead(b, &out, from))
+        {
+            close(from);
+            from = -1;
+        }
+        // Look for Escape or Ctrl-C now and then, a command can run for a long time or never end
+        if (!E.replay && monotonicNs() - checked > 100000000LL)
+        {
+            checked = monotonicNs();
+            if (editorCancelRequested())
+            {
+                cancelled = 1;
+                kill(-pid, SIGTERM);
+                close(from);
+                from = -1;
+            }
+        }
+    }
+    if (to != -1)
+        close(to);
+    int wait_error = filterWait(pid, &status, &cancelled);
+    sigaction(SIGPIPE, &old, NULL);
+    if (out.len > 0)
+        filterAddRow(b, &out, out.buf, out.len); // The output did not end with a newline
+    free(out.buf);
+
+    if (cancelled)
+        editorSetStatusMessage("Cancelled, nothing changed");
+    else if (wait_error)
+        editorSetStatusMessage("Can't wait for %s: %s, nothing changed", cmd, strerror(wait_error));
+    else if (!WIFEXITED(status))
+        editorSetStatusMessage("%s was killed by signal %d, nothing changed", cmd, WTERMSIG(status));
+    else if (WEXITSTATUS(status) != 0)
+        editorSetStatusMessage("%s exited with status %d, nothing changed", cmd, WEXITSTATUS(status));
+    else
+    {
+        struct rowSplice splice = {top, bottom - top + 1, out.num_rows};
+        editorSpliceBlocks(b, &splice, 1, &out.rows, editorSaveUndo(b, &splice, 1, w));
+        w->block = 0;
+        w->redraw = 1;
+        editorSetStatusMessage("%d lines in, %d lines out", bottom - top + 1, out.num_rows);
+    }
+    TRACE_ARG("rows", out.num_rows);
+    blockListFree(b, &out.rows);
+    free(in.stage);
+}
+
+/** line commands */
+
+#define LINES_CHUNK_ROWS 65536 // Rows per task of the line commands, a range this small is done on the main thread
+#define LINES_INSERTION 16     // Runs this short are sorted by insertion, below the merge sort
+
+enum linesOp
+{
+    LINES_SORT = 0,
+    LINES_UNIQ, // Keep the first of every set of equal lines, in their order
+    LINES_KEEP, // Keep the lines containing the pattern
+    LINES_DROP  // Drop them
+};
+
+/** What a line command does, parsed from what was typed at the prompt. */
+struct linesCommand
+{
+    int op;                    // One of enum linesOp
+    int numeric, reverse;      // sort -n, sort -r
+    int field;                 // sort -k: compare from this field on, fields are separated by blanks, 1 is the first
+    char *pattern;             // keep and drop
+    size_t patlen;
+};
+
+/**
+ * Lines are sorted as references: where the sort key starts in the row's own text, its length, the row, and for a
+ * numeric sort the number, parsed once. A reference is 24 bytes whatever the length of the line, and the text itself
+ * is only read by comparisons. The rows are then put in the new order by editorPermuteRows(), which does not copy it.
+ */
+struct lineRef
+{
+    const char *key;
+    int len;
+    int row;
+    double num;
+};
+
+/** A run of rows, or of references, that one task works on. */
+struct linesChunk
+{
+    struct editorBuffer *b;
+    const struct linesCommand *cmd;
+    int first, last;           // Rows [first, last), or references for the merge
+    struct lineRef *refs;      // The references of the whole range
+    struct lineRef *tmp;       // As many again, the merge sort goes back and forth between the two
+    unsigned char *keep;       // Per row of the range, whether it stays
+    // A piece of a merge of a[0, na) and b[0, nb) into out
+    const struct lineRef *a, *bm;
+    int na, nb;
+    struct lineRef *out;
+};
+
+/** The number a line starts with, after blanks: an optional sign, digits, and decimals. Text that is not one is 0. */
+double lineNumber(const char *s, int len)
+{
+    int i = 0, neg = 0;
+    double v = 0, scale = 1;
+    while (i < len && (s[i] == ' ' || s[i] == '\t'))
+        i++;
+    if (i < len && (s[i] == '-' || s[i] == '+'))
+        neg = s[i++] == '-';
+    for (; i < len && isdigit((unsigned char)s[i]); i++)
+        v = v * 10 + (s[i] - '0');
+    if (i < len && s[i] == '.')
+        for (i++; i < len && isdigit((unsigned char)s[i]); i++)
+            v += (s[i] - '0') * (scale /= 10);
+    return neg ? -v : v;
+}
+
+int lineRefCompare(const struct linesCommand *cmd, const struct lineRef *x, const struct lineRef *y)
+{
+    int r;
+    if (cmd->numeric)
+        r = x->num < y->num ? -1 : x->num > y->num;
+    else
+    {
+        r = memcmp(x->key, y->key, x->len < y->len ? x->len : y->len);
+        if (r == 0)
+            r = x->len < y->len ? -1 : x->len > y->len;
+    }
+    return cmd->reverse ? -r : r;
+}
+
+/** Merge sorted a[0, na) and b[0, nb) into out. Equal lines are taken from a first, so the sort is stable. */
+void lineRefMerge(const struct linesCommand *cmd, const struct lineRef *a, int na, const struct lineRef *b, int nb,
+                  struct lineRef *out)
+{
+    int i = 0, j = 0;
+    while (i < na && j < nb)
+        *out++ = lineRefCompare(cmd, &b[j], &a[i]) < 0 ? b[j++] : a[i++];
+    memcpy(out, a + i, sizeof(struct lineRef) * (na - i));
+    memcpy(out + (na - i), b + j, sizeof(struct lineRef) * (nb - j));
+}
+
+/** Stable merge sort of refs[0, n), using tmp[0, n) as scratch. */
+void lineRefSort(const struct linesCommand *cmd, struct lineRef *refs, struct lineRef *tmp, int n)
+{
+    int i, j;
+    if (n <= LINES_INSERTION)
+    {
+        for (i = 1; i < n; i++)
+        {
+            struct lineRef r = refs[i];
+            for (j = i; j > 0 && lineRefCompare(cmd, &r, &refs[j - 1]) < 0; j--)
+                refs[j] = refs[j - 1];
+            refs[j] = r;
+        }
+        return;
+    }
+    int half = n / 2;
+    lineRefSort(cmd, refs, tmp, half);
+    lineRefSort(cmd, refs + half, tmp + half, n - half);
+    if (lineRefCompare(cmd, &refs[half], &refs[half - 1]) >= 0)
+        return; // Already in order, which sorted input always is
+    memcpy(tmp, refs, sizeof(struct lineRef) * n);
+    lineRefMerge(cmd, tmp, half, tmp + half, n - half, refs);
+}
+
+/** First of b[0, nb) that does not sort before `x`. */
+int lineRefLowerBound(const struct linesCommand *cmd, const struct lineRef *b, int nb, const struct lineRef *x)
+{
+    int lo = 0, hi = nb;
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (lineRefCompare(cmd, &b[mid], x) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/** Pass over the rows of a chunk: the reference of each row for a sort or uniq, or whether it matches for keep and drop. */
+void linesScanTask(void *arg, struct cancelToken *token)
+{
+    TRACE_SCOPE("linesScanTask");
+    struct linesChunk *c = arg;
+    const struct linesCommand *cmd = c->cmd;
+    int i, f;
+    struct rowIter it;
+    (void)token;
+    for (rowIterStart(&it, c->b, c->first), i = c->first; i < c->last; i++)
+    {
+        erow *row = rowIterNext(&it);
+        if (cmd->op == LINES_KEEP || cmd->op == LINES_DROP)
+        {
+            int found = E.simd->find(row->chars, row->size, cmd->pattern, cmd->patlen) != NULL;
+            c->keep[i - c->first] = found == (cmd->op == LINES_KEEP);
+            continue;
+        }
+        struct lineRef *r = &c->refs[i - c->first];
+        const char *p = row->chars, *end = row->chars + row->size;
+        for (f = 1; f < cmd->field; f++)
+        {
+            while (p < end && (*p == ' ' || *p == '\t'))
+                p++;
+            while (p < end && *p != ' ' && *p != '\t')
+                p++;
+        }
+        r->key = p;
+        r->len = end - p;
+        r->row = i;
+        r->num = cmd->numeric ? lineNumber(p, end - p) : 0;
+    }
+}
+
+void linesSortTask(void *arg, struct cancelToken *token)
+{
+    TRACE_SCOPE("linesSortTask");
+    struct linesChunk *c = arg;
+    (void)token;
+    lineRefSort(c->cmd, c->refs + c->first, c->tmp + c->first, c->last - c->first);
+}
+
+void linesMergeTask(void *arg, struct cancelToken *token)
+{
+    TRACE_SCOPE("linesMergeTask");
+    struct linesChunk *c = arg;
+    (void)token;
+    lineRefMerge(c->cmd, c->a, c->na, c->bm, c->nb, c->out);
+}
+
+/** Run `fn` over chunks[0, n) on the task pool and wait for all of them, or on the main thread when there is one. */
+void linesRun(struct linesChunk *chunks, int n, void (*fn)(void *, struct cancelToken *))
+{
+    struct taskGroup group;
+    int i;
+    if (n == 1)
+    {
+        fn(&chunks[0], NULL);
+        return;
+    }
+    taskGroupInit(&group);
+    for (i = 0; i < n; i++)
+        poolSubmit(&group, NULL, fn, &chunks[i]);
+    taskGroupWait(&group);
+    taskGroupDestroy(&group);
+}
+
+/**
+ * Sort refs[0, n) on the task pool. Every chunk is sorted by its own task, then the sorted runs are merged pairwise
+ * until one is left. Each merge is cut into pieces of about a chunk, found by binary search: the piece of a that starts
+ * at a[i] goes with the part of b from the first line that does not sort before a[i]. So every round, the last one
+ * too, is as many tasks of about the same size as there are chunks.
+ */
+void linesSort(const struct linesCommand *cmd, struct lineRef *refs, struct lineRef *tmp, int n,
+               struct linesChunk *chunks, int nchunks)
+{
+    TRACE_SCOPE("linesSort");
+    int i, width, k;
+    for (i = 0; i < nchunks; i++)
+    {
+        chunks[i].first = i * LINES_CHUNK_ROWS;
+        chunks[i].last = i == nchunks - 1 ? n : chunks[i].first + LINES_CHUNK_ROWS;
+    }
+    linesRun(chunks, nchunks, linesSortTask);
+
+    for (width = LINES_CHUNK_ROWS; width < n; width *= 2)
+    {
+        int tasks = 0;
+        for (i = 0; i < n; i += 2 * width)
+        {
+            int na = n - i < width ? n - i : width, nb = n - i - na < width ? n - i - na : width;
+            const struct lineRef *a = refs + i, *b = a + na; // A last run with no pair has b at refs + n, not past it
+            int pieces = (na + nb + LINES_CHUNK_ROWS - 1) / LINES_CHUNK_ROWS, ai = 0, bi = 0;
+            for (k = 1; k <= pieces; k++)
+            {
+                int an = k == pieces ? na : (int)((long long)na * k / pieces);
+                int bn = k == pieces ? nb : lineRefLowerBound(cmd, b, nb, &a[an]);
+                struct linesChunk *c = &chunks[tasks++];
+                c->a = a + ai;
+                c->na = an - ai;
+                c->bm = b + bi;
+                c->nb = bn - bi;
+                c->out = tmp + i + ai + bi;
+                ai = an;
+                bi = bn;
+            }
+        }
+        linesRun(chunks, tasks, linesMergeTask);
+        struct lineRef *swap = refs;
+        refs = tmp;
+        tmp = swap;
+    }
+    if (refs != chunks[0].refs)
+        memcpy(chunks[0].refs, refs, sizeof(struct lineRef) * n); // An odd number of rounds left it in the scratch array
+}
+
+/** Parse a line command: sort [-n] [-r] [-k N], uniq, keep PATTERN or drop PATTERN. Returns 0 if it is not one. */
+int linesParse(char *s, struct linesCommand *cmd)
+{
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->field = 1;
+    if (strncmp(s, "keep ", 5) == 0 || strncmp(s, "drop ", 5) == 0)
+    {
+        cmd->op = s[0] == 'k' ? LINES_KEEP : LINES_DROP;
+        cmd->pattern = s + 5;
+        cmd->patlen = strlen(cmd->pattern);
+        return 1;
+    }
+    char *word = strtok(s, " ");
+    if (word == NULL)
+        return 0;
+    if (strcmp(word, "uniq") == 0)
+    {
+        cmd->op = LINES_UNIQ;
+        return strtok(NULL, " ") == NULL;
+    }
+    if (strcmp(word, "sort") != 0)
+        return 0;
+    cmd->op = LINES_SORT;
+    while ((word = strtok(NULL, " ")) != NULL)
+    {
+        if (strcmp(word, "-n") == 0)
+            cmd->numeric = 1;
+        else if (strcmp(word, "-r") == 0)
+            cmd->reverse = 1;
+        else if (strncmp(word, "-k", 2) == 0)
+        {
+            char *n = word[2] ? word + 2 : strtok(NULL, " ");
+            if (n == NULL || (cmd->field = atoi(n)) < 1)
+                return 0;
+        }
+        else
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * Sort, uniq, keep or drop the lines of the block selection, or of the whole buffer, or pipe them through a command
+ * with editorFilterRows(). The rows of the range are scanned in chunks on the task pool and the references are sorted
+ * there. Then the rows are put in their new order, those that stay first, and the others are cut off the end. The undo
+ * step keeps the rows that were cut and the order to put the rows back in, no text.
+ */
+void editorLinesCommand()
+{
+    struct editorWindow *w = E.win;
+    struct editorBuffer *b = w->buf;
+    struct linesCommand cmd;
+    if (!editorCanEdit() || b->num_rows == 0)
+        return;
+    char *answer = editorPrompt("Lines (sort [-n] [-r] [-k N], uniq, keep TEXT, drop TEXT, | COMMAND): %s");
+    if (answer == NULL)
+        return;
+    int top = 0, bottom = b->num_rows - 1, lo, hi, i, m = 0;
+    if (w->block)
+    {
+        editorBlockBounds(w, &top, &bottom, &lo, &hi);
+        if (bottom >= b->num_rows)
+            bottom = b->num_rows - 1;
+    }
+    if (answer[0] == '|')
+    {
+        editorFilterRows(top, bottom, answer + 1 + strspn(answer + 1, " "));
+        free(answer);
+        return;
+    }
+    if (!linesParse(answer, &cmd))
+    {
+        editorSetStatusMessage("Not a line command");
+        free(answer);
+        return;
+    }
+
+    TRACE_SCOPE("editorLinesCommand");
+    int n = bottom - top + 1, nchunks = (n + LINES_CHUNK_ROWS - 1) / LINES_CHUNK_ROWS;
+    TRACE_ARG("rows", n);
+    editorThawRows(b, top, bottom);
+
+    // Merge rounds can need a piece more per pair than chunks, hence the spare ones
+    struct linesChunk *chunks = calloc(2 * nchunks + 1, sizeof(struct linesChunk));
+    struct lineRef *refs = NULL, *tmp = NULL;
+    unsigned char *keep = malloc(n);
+    int *order = malloc(sizeof(int) * n);
+    if (chunks == NULL || keep == NULL || order == NULL)
+        die("malloc");
+    if (cmd.op == LINES_SORT || cmd.op == LINES_UNIQ)
+    {
+        refs = malloc(sizeof(struct lineRef) * n);
+        tmp = malloc(sizeof(struct lineRef) * n);
+        if (refs == NULL || tmp == NULL)
+            die("malloc");
+    }
+    for (i = 0; i < 2 * nchunks + 1; i++)
+    {
+        chunks[i].b = b;
+        chunks[i].cmd = &cmd;
+        chunks[i].refs = refs;
+        chunks[i].tmp = tmp;
+    }
+    for (i = 0; i < nchunks; i++)
+    {
+        chunks[i].first = top + i * LINES_CHUNK_ROWS;
+        chunks[i].last = i == nchunks - 1 ? bottom + 1 : chunks[i].first + LINES_CHUNK_ROWS;
+        chunks[i].refs = refs ? refs + i * LINES_CHUNK_ROWS : NULL;
+        chunks[i].keep = keep + i * LINES_CHUNK_ROWS;
+    }
+    linesRun(chunks, nchunks, linesScanTask);
+    for (i = 0; i < nchunks; i++)
+        chunks[i].refs = refs;
+
+    if (refs != NULL)
+        linesSort(&cmd, refs, tmp, n, chunks, nchunks);
+    // order[i] is the row of the range that goes to row top + i
+    if (cmd.op == LINES_SORT)
+        for (i = 0; i < n; i++)
+            order[m++] = refs[i].row - top;
+    else
+    {
+        int stay = 0, gone = 0;
+        if (cmd.op == LINES_UNIQ)
+        {
+            // Equal lines are next to each other now, the first of them in the file first
+            for (i = 0; i < n; i++)
+                keep[refs[i].row - top] = i == 0 || lineRefCompare(&cmd, &refs[i - 1], &refs[i]) != 0;
+        }
+        for (i = 0; i < n; i++)
+            m += keep[i];
+        for (i = 0; i < n; i++)
+        {
+            if (keep[i])
+                order[stay++] = i;
+            else
+                order[m + gone++] = i;
+        }
+    }
+
+    struct rowSplice splice = {top + m, n - m, 0};
+    struct blockList none = {0}, *old = editorSaveUndo(b, &splice, m < n, w);
+    struct undoStep *u = &b->undo[(b->undo_first + b->num_undo - 1) % UNDO_STEPS];
+    editorPermuteRows(b, top, n, order);
+    editorSpliceBlocks(b, &splice, m < n, &none, old);
+    // Undoing puts the cut rows back, then every row where it came from
+    u->perm = memAlloc(MEM_UNDO, sizeof(int) * n);
+    u->perm_at = top;
+    u->perm_len = n;
+    for (i = 0; i < n; i++)
+        u->perm[order[i]] = i;
+    w->block = 0;
+    w->redraw = 1;
+    editorSetStatusMessage("%d lines, %d removed", m, n - m);
+    free(order);
+    free(keep);
+    free(refs);
+    free(tmp);
+    free(chunks);
+    free(answer);
+}
+
+/** file i/o */
+
+#define INDEX_CHUNK (4 * 1024 * 1024) // Files are split into chunks of this size to be indexed in parallel, even so UTF-16 units never straddle two
+
+/**
+ * One chunk of a file being indexed. The first pass counts the newlines of every chunk, which tells each chunk
+ * the number of the first row ending in it and where that row starts, and the second pass fills those rows.
+ */
+struct indexChunk
+{
+    struct editorBuffer *b;
+    size_t start, end;
+    int newlines;            // Pass 1: newlines in the chunk
+    long long last_newline;  // Pass 1: offset of the last of them, -1 if there is none
+    int first_row;           // Pass 2: row ending at the first newline of the chunk
+    size_t row_start;        // Pass 2: where that row starts, possibly in an earlier chunk
+};
+
+void indexCountTask(void *arg, struct cancelToken *token)
+{
+    TRACE_SCOPE("indexCountTask");
+    struct indexChunk *c = arg;
+    struct editorBuffer *b = c->b;
+    char *p = b->map + c->start, *end = b->map + c->end, *nl;
+    int unit = encodingUnit(b->encoding);
+    (void)token;
+    c->newlines = 0;
+    c->last_newline = -1;
+    while ((nl = findNewline(b->map, b->map_len, p, end, b->encoding)) != NULL)
+    {
+        c->newlines++;
+        c->last_newline = nl - b->map + unit - 1;
+        p = nl + unit;
+    }
+}
+
+/** Fill the row of `b` that spans map[start, end) and has `linelen` bytes on disk, terminator included. */
+void editorSetRow(struct editorBuffer *b, int at, size_t start, size_t end, size_t linelen)
+{
+    struct rowBlock *k = b->blocks[at / STORE_BLOCK_ROWS];
+    rowMap(b, &k->row[at % STORE_BLOCK_ROWS], start, end);
+    k->lens[at % STORE_BLOCK_ROWS] = linelen;
+}
+
+void indexFillTask(void *arg, struct cancelToken *token)
+{
+    TRACE_SCOPE("indexFillTask");
+    struct indexChunk *c = arg;
+    struct editorBuffer *b = c->b;
+    char *map = b->map, *p = map + c->start, *end = map + c->end, *nl;
+    size_t start = c->row_start;
+    int at = c->first_row, unit = encodingUnit(b->encoding);
+    (void)token;
+    while ((nl = findNewline(map, b->map_len, p, end, b->encoding)) != NULL)
+    {
+        editorSetRow(b, at++, start, nl - map, nl - map + unit - start);
+        start = nl - map + unit;
+        p = nl + unit;
+    }
+}
+
+/**
+ * Split a freshly mapped file into rows. Big files are cut into chunks that the task pool scans in parallel, in two passes
+ * so that every row is written exactly once, straight into its final place in blocks of STORE_BLOCK_ROWS rows.
+ * The bytes of a block are where its first row starts up to where the next block's does, and rowIndexBuild() turns
+ * them into a Fenwick tree in one linear pass over the blocks.
+ */
+void editorIndexRows(struct editorBuffer *b)
+{
+    TRACE_SCOPE("editorIndexRows");
+    int nchunks = (b->map_len + INDEX_CHUNK - 1) / INDEX_CHUNK, i;
+    struct indexChunk *chunks = calloc(nchunks ? nchunks : 1, sizeof(struct indexChunk));
+    struct taskGroup group;
+    taskGroupInit(&group);
+
+    // We read the file front to back, tell the kernel so it can read ahead aggressively
+    if (b->map)
+        madvise(b->map, b->map_len, MADV_SEQUENTIAL);
+    for (i = 0; i < nchunks; i++)
+    {
+        chunks[i].b = b;
+        chunks[i].start = (size_t)i * INDEX_CHUNK;
+        chunks[i].end = i == nchunks - 1 ? b->map_len : chunks[i].start + INDEX_CHUNK;
+        if (nchunks == 1)
+            indexCountTask(&chunks[i], NULL);
+        else
+            poolSubmit(&group, NULL, indexCountTask, &chunks[i]);
+    }
+    taskGroupWait(&group);
+
+    int rows = 0;
+    long long last_newline = -1;
+    for (i = 0; i < nchunks; i++)
+    {
+        chunks[i].first_row = rows;
+        chunks[i].row_start = last_newline + 1;
+        rows += chunks[i].newlines;
+        if (chunks[i].last_newline != -1)
+            last_newline = chunks[i].last_newline;
+    }
+    int partial = (size_t)(last_newline + 1) < b->map_len; // The last line has no newline
+    int total = rows + partial;
+
+    editorReserveBlocks(b, (total + STORE_BLOCK_ROWS - 1) / STORE_BLOCK_ROWS);
+    for (i = 0; i * STORE_BLOCK_ROWS < total; i++)
+    {
+        int n = total - i * STORE_BLOCK_ROWS < STORE_BLOCK_ROWS ? total - i * STORE_BLOCK_ROWS : STORE_BLOCK_ROWS;
+        b->blocks[i] = blockNew(n);
+        b->blocks[i]->num_rows = n;
+    }
+    b->num_blocks = i;
+
+    for (i = 0; i < nchunks; i++)
+    {
+        if (nchunks == 1)
+            indexFillTask(&chunks[i], NULL);
+        else
+            poolSubmit(&group, NULL, indexFillTask, &chunks[i]);
+    }
+    taskGroupWait(&group);
+    if (partial)
+    {
+        // It is counted with the terminator it would get, like any row added by an edit
+        b->no_eol = encodingUnit(b->encoding) * (b->crlf ? 2 : 1);
+        editorSetRow(b, rows, last_newline + 1, b->map_len, b->map_len - (last_newline + 1) + b->no_eol);
+    }
+    if (b->map)
+        madvise(b->map, b->map_len, MADV_NORMAL);
+
+    for (i = 0; i < b->num_blocks; i++)
+    {
+        long long start = b->blocks[i]->row[0].chars - b->map;
+        long long end = i + 1 < b->num_blocks ? b->blocks[i + 1]->row[0].chars - b->map : (long long)b->map_len + b->no_eol;
+        b->blocks[i]->bytes = end - start;
+    }
+    editorIndexRebuild(b);
+    b->num_rows = total;
+    TRACE_ARG("rows", total);
+    b->indexed = 1;
+    editorUpdateGutter(b);
+    taskGroupDestroy(&group);
+    free(chunks);
+}
+
+/**
+ * Deciding how to show a file must not cost a pass over it, so editorDetect() only looks at a few 64 KB blocks:
+ * the first one and DETECT_SAMPLES - 1 more spread evenly over the file, which is enough to recognize a binary file or
+ * an encoding and costs a few microseconds whatever the size of the file. The blocks are at fixed places rather than
+ * random ones, so a file is always detected the same way.
+ */
+#define DETECT_BLOCK (64 * 1024)
+#define DETECT_SAMPLES 4
+
+/** What the scan of the sampled blocks found. */
+struct detectStats
+{
+    long nul;     // NUL bytes, text files never have any
+    long high;    // Bytes with the high bit set, which must then be valid UTF-8 or are taken as Latin-1
+    long lf;      // Newlines
+    long crlf;    // Newlines preceded by a carriage return
+    int invalid;  // Some high-bit bytes are not valid UTF-8
+};
+
+/**
+ * Check that the `n` bytes at `p` are valid UTF-8: no stray continuation bytes, no overlong forms, no surrogates and
+ * nothing above U+10FFFF. A sample can start or end in the middle of a character, so up to 3 leading continuation
+ * bytes are skipped when the block is not the start of the file, and a sequence cut by the end is accepted.
+ * Runs of ASCII bytes are skipped at once by the ascii_span kernel.
+ */
+int detectUtf8Valid(const unsigned char *p, size_t n, int at_start)
+{
+    size_t i = 0;
+    if (!at_start)
+        while (i < n && i < 3 && (p[i] & 0xc0) == 0x80)
+            i++;
+    while (i < n)
+    {
+        i += E.simd->ascii_span(p + i, n - i);
+        if (i == n)
+            break;
+        unsigned char c = p[i];
+        unsigned int cp, min;
+        size_t len, k;
+        if (c < 0x80)
+        {
+            i++;
+            continue;
+        }
+        else if ((c & 0xe0) == 0xc0)
+            len = 2, cp = c & 0x1f, min = 0x80;
+        else if ((c & 0xf0) == 0xe0)
+            len = 3, cp = c & 0x0f, min = 0x800;
+        else if ((c & 0xf8) == 0xf0)
+            len = 4, cp = c & 0x07, min = 0x10000;
+        else
+            return 0;
+        if (i + len > n)
+            return 1;
+        for (k = 1; k < len; k++)
+        {
+            if ((p[i + k] & 0xc0) != 0x80)
+                return 0;
+            cp = cp << 6 | (p[i + k] & 0x3f);
+        }
+        if (cp < min || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff))
+            return 0;
+        i += len;
+    }
+    return 1;
+}
+
+/**
+ * Count NULs, high-bit bytes, newlines and CRLFs in the `n` bytes at `p`, and validate them as UTF-8 if needed. With SSE2 each 16-byte step is a few compares
+ * turned into bit masks with movemask and counted with popcount. A CRLF is a carriage return whose bit lines up with a
+ * newline bit shifted down by one, the pair that straddles two steps is checked by hand.
+ */
+void detectScanBlock(const unsigned char *p, size_t n, int at_start, struct detectStats *s)
+{
+    size_t i = 0;
+    long high = 0;
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128(), cr = _mm_set1_epi8('\r'), lf = _mm_set1_epi8('\n');
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        unsigned int crs = _mm_movemask_epi8(_mm_cmpeq_epi8(v, cr));
+        unsigned int lfs = _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+        s->nul += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)));
+        high += __builtin_popcount(_mm_movemask_epi8(v));
+        s->lf += __builtin_popcount(lfs);
+        s->crlf += __builtin_popcount(crs & (lfs >> 1));
+        if ((crs & 0x8000) && i + 16 < n && p[i + 16] == '\n')
+            s->crlf++;
+    }
+#endif
+    for (; i < n; i++)
+    {
+        s->nul += p[i] == 0;
+        high += p[i] >= 0x80;
+        s->lf += p[i] == '\n';
+        s->crlf += p[i] == '\r' && i + 1 < n && p[i + 1] == '\n';
+    }
+    s->high += high;
+    if (high && !s->invalid && !detectUtf8Valid(p, n, at_start))
+        s->invalid = 1;
+}
+
+/**
+ * Pick how to show a freshly mapped file. A byte order mark settles the encoding. Otherwise a NUL byte means a binary file,
+ * shown in hex, and high-bit bytes that are not valid UTF-8 mean Latin-1. Lines end with CRLF when most newlines of
+ * the samples do. UTF-16 and Latin-1 text is shown through editorRowText(), which converts it as it is drawn.
+ */
+void editorDetect(struct editorBuffer *b)
+{
+    TRACE_SCOPE("editorDetect");
+    const unsigned char *map = (const unsigned char *)b->map;
+    struct detectStats s;
+    int i;
+    memset(&s, 0, sizeof(s));
+    b->encoding = ENCODING_UTF8;
+    b->crlf = 0;
+    if (map == NULL)
+        return;
+
+    if (b->map_len >= 2 && map[0] == 0xff && map[1] == 0xfe)
+        b->encoding = ENCODING_UTF16LE;
+    else if (b->map_len >= 2 && map[0] == 0xfe && map[1] == 0xff)
+        b->encoding = ENCODING_UTF16BE;
+    if (b->encoding != ENCODING_UTF8)
+    {
+        // Lines end with CRLF if the first one does
+        size_t n = b->map_len < DETECT_BLOCK ? b->map_len : DETECT_BLOCK;
+        char *nl = findNewline(b->map, b->map_len, b->map, b->map + n, b->encoding);
+        b->crlf = nl != NULL && nl - b->map >= 4 &&
+                  nl[-2] == (b->encoding == ENCODING_UTF16LE ? '\r' : '\0') &&
+                  nl[-1] == (b->encoding == ENCODING_UTF16LE ? '\0' : '\r');
+        return;
+    }
+
+    for (i = 0; i < DETECT_SAMPLES; i++)
+    {
+        size_t start = 0, n;
+        if (i > 0)
+        {
+            if (b->map_len <= (size_t)DETECT_BLOCK * i)
+                break;
+            start = (b->map_len - DETECT_BLOCK) / (DETECT_SAMPLES - 1) * i;
+        }
+        n = b->map_len - start < DETECT_BLOCK ? b->map_len - start : DETECT_BLOCK;
+        detectScanBlock(map + start, n, start == 0, &s);
+    }
+    if (s.nul)
+        b->hex = 1;
+    else if (s.invalid)
+        b->encoding = ENCODING_LATIN1;
+    b->crlf = s.crlf * 2 > s.lf;
+}
+
+/**
+ * editorOpen() maps the file into memory and splits it into rows in a new buffer.
+ * mmap() lets the kernel page the file in on demand and share the pages with the page cache, instead of
+ * copying every line into its own malloc()'d string. We scan for newlines with memchr(), which libc vectorizes,
+ * on the task pool for big files, and each row just points at its first byte. The file descriptor can be closed as soon as the mapping exists.
+ * editorDetect() samples the file first, binary files go straight to the hex view and skip the row index.
+ * Returns 0 on success and -1 with errno set if the file cannot be opened or mapped.
+ */
+int editorOpen(char *filename)
+{
+    TRACE_SCOPE("editorOpen");
+    long long start = monotonicNs();
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    if (S_ISDIR(st.st_mode))
+    {
+        close(fd);
+        errno = EISDIR;
+        return -1;
+    }
+
+    struct editorBuffer *b = editorBufferNew();
+    b->filename = strdup(filename);
+    if (st.st_size > 0)
+    {
+        b->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (b->map == MAP_FAILED)
+        {
+            int saved = errno;
+            close(fd);
+            free(b->filename);
+            free(b);
+            errno = saved;
+            return -1;
+        }
+        b->map_len = st.st_size;
+    }
+    close(fd);
+
+    // The hex view shows at least 8 digits of offset, more for files over 4 GB
+    b->hex_digits = 8;
+    while (b->hex_digits < 16 && (unsigned long long)b->map_len >> (4 * b->hex_digits) != 0)
+        b->hex_digits++;
+
+    // Binary files open in the hex view and only get their rows if they are switched to text
+    editorDetect(b);
+    if (!b->hex)
+        editorIndexRows(b);
+    editorAddBuffer(b);
+    if (b->hex)
+        editorSetStatusMessage("%.30s looks binary, showing it in hex (Ctrl-X for text)", filename);
+    E.load_ns += monotonicNs() - start;
+    E.load_bytes += b->map_len;
+    return 0;
+}
+
+/**
+ * Ask for a file name and open it in a new buffer.
+ */
+void editorOpenPrompt()
+{
+    char *filename = editorPrompt("Open: %s");
+    if (filename == NULL)
+        return;
+    if (editorOpen(filename) == -1)
+        editorSetStatusMessage("Can't open %s: %s", filename, strerror(errno));
+    free(filename);
+}
+
+/**
+ * We want to replace all our write() calls with code that appends the string to a buffer,
+ * and then write() this buffer out at the end. Unfortunately, C doesn’t have dynamic strings, so we’ll create our own dynamic string
+ * type that supports one operation: appending.
+ * An append buffer consists of a pointer to our buffer in memory,
+ * and a length. We define an ABUF_INIT constant which represents an empty buffer. This acts as a constructor for our abuf type.
+ */
+struct abuf
+{
+    char *b;
+    int len;
+};
+#define ABUF_INIT {NULL, 0}
+
+/**
+ * realloc() and free() come from <stdlib.h>. memcpy() comes from <string.h>
+ * To append a string s to an abuf, the first thing we do is make sure we allocate enough memory to hold the new string.
+ * We ask realloc() to give us a block of memory that is the size of the current string plus the size of the string we are appending.
+ * realloc() will either extend the size of the block of memory we already have allocated, or it will take care of free()ing the
+ * current block of memory and allocating a new block of memory somewhere else that is big enough for our new string.
+ * Then we use memcpy() to copy the string s after the end of the current data in the buffer,
+ * and we update the pointer and length of the abuf to the new values.
+ */
+void abAppend(struct abuf *ab, const char *s, int len)
+{
+    char *new = realloc(ab->b, ab->len + len);
+    if (new == NULL)
+        return;
+    memcpy(&new[ab->len], s, len);
+    ab->b = new;
+    ab->len += len;
+}
+
+/**
+ * abFree() is a destructor that deallocates the dynamic memory used by an abuf.
+ */
+void abFree(struct abuf *ab)
+{
+    free(ab->b);
+}
+
+/** navigation */
+
+/**
+ * Jump straight to a row of the file. The cursor and the row offset are assigned directly
+ * and the target row is placed in the middle of the screen, so the cost does not depend on how far we jump,
+ * and the next refresh only renders the rows of the target screen.
+ */
+void editorJumpTo(int at, int col)
+{
+    int total = editorViewRows(E.buf);
+    if (at >= total)
+        at = total - 1;
+    if (at < 0)
+        at = 0;
+    int rows = editorWindowTextRows(E.win);
+    E.win->cy = at;
+    if (col > editorMaxCol(E.win))
+        col = editorMaxCol(E.win);
+    if (col < 0)
+        col = 0;
+    E.win->cx = col;
+    E.win->rowoff = at - rows / 2;
+    if (E.win->rowoff > total - rows)
+        E.win->rowoff = total - rows;
+    if (E.win->rowoff < 0)
+        E.win->rowoff = 0;
+}
+
+/**
+ * Move a whole screen up or down for PAGE_UP and PAGE_DOWN by setting the row offset and the cursor directly,
+ * instead of calling editorMoveCursor() once per row.
+ */
+void editorPageMove(int key)
+{
+    int rows = editorWindowTextRows(E.win), total = editorViewRows(E.buf);
+    if (key == PAGE_UP)
+    {
+        E.win->rowoff -= rows;
+        if (E.win->rowoff < 0)
+            E.win->rowoff = 0;
+        E.win->cy = E.win->rowoff;
+    }
+    else
+    {
+        E.win->rowoff += rows;
+        if (E.win->rowoff > total - rows)
+            E.win->rowoff = total - rows;
+        if (E.win->rowoff < 0)
+            E.win->rowoff = 0;
+        E.win->cy = E.win->rowoff + rows - 1;
+        if (E.win->cy > total - 1)
+            E.win->cy = total > 0 ? total - 1 : 0;
+    }
+}
+
+/**
+ * Screen column of byte `byte` of row `at`, counted from the start of the row as it is on disk. The text of a row in
+ * another encoding is its UTF-8 conversion, so the bytes before `byte` are converted to find where it lands in there.
+ */
+int editorByteColumn(struct editorBuffer *b, int at, long long byte)
+{
+    int len;
+    if (at >= b->num_rows)
+        return 0;
+    if (b->encoding != ENCODING_UTF8)
+    {
+        erow *row = editorRow(b, at);
+        int skip = at == 0 && encodingUnit(b->encoding) == 2 && row->size >= 2 ? 2 : 0; // The byte order mark
+        if (byte > row->size)
+            byte = row->size;
+        if (byte < skip)
+            byte = skip;
+        char *prefix = malloc(2 * (byte - skip) + 1);
+        if (prefix == NULL)
+            die("malloc");
+        byte = editorTranscode(b, prefix, row->chars + skip, byte - skip);
+        free(prefix);
+    }
+    char *text = editorRowText(b, at, &len);
+    return editorTextColumn(text, byte < len ? (int)byte : len);
+}
+
+/**
+ * Ask for a destination and jump to it. The answer can be
+ *  - a line number: 1200
+ *  - a byte offset, prefixed with @: @4096 or @0x1000
+ *  - a percentage of the file: 75%
+ * Byte offsets and percentages are turned into rows through the row index, so every form is O(log n).
+ * In a hex view lines are the 16-byte lines of the dump, and a byte offset is simply divided by 16.
+ */
+void editorGoto()
+{
+    char *query = editorPrompt("Go to (line, @byte, N%): %s");
+    if (query == NULL)
+        return;
+
+    char *end;
+    int len = strlen(query);
+    if (query[0] == '@')
+    {
+        long long offset = strtoll(&query[1], &end, 0);
+        if (end == &query[1] || *end != '\0' || offset < 0)
+            editorSetStatusMessage("Invalid byte offset: %s", &query[1]);
+        else if (E.buf->hex)
+            editorJumpTo(offset / HEX_LINE_BYTES, offset % HEX_LINE_BYTES);
+        else
+        {
+            int at = editorRowAtOffset(E.buf, offset);
+            editorJumpTo(at, editorByteColumn(E.buf, at, offset - editorRowOffset(E.buf, at)));
+        }
+    }
+    else if (len > 0 && query[len - 1] == '%')
+    {
+        double percent = strtod(query, &end);
+        if (end == query || end != &query[len - 1] || !(percent >= 0 && percent <= 100))
+            editorSetStatusMessage("Invalid percentage: %s", query);
+        else if (E.buf->hex)
+        {
+            long long offset = (long long)(E.buf->map_len * percent / 100);
+            editorJumpTo(offset / HEX_LINE_BYTES, offset % HEX_LINE_BYTES);
+        }
+        else
+            editorJumpTo(editorRowAtOffset(E.buf, (long long)(editorTotalBytes(E.buf) * percent / 100)), 0);
+    }
+    else
+    {
+        long line = strtol(query, &end, 10);
+        if (end == query || *end != '\0' || line < 1)
+            editorSetStatusMessage("Invalid line number: %s", query);
+        else
+            editorJumpTo(line > editorViewRows(E.buf) ? editorViewRows(E.buf) - 1 : (int)line - 1, 0);
+    }
+    free(query);
+}
+
+/** hex view */
+
+#define HEX_LINE_MAX (16 + 2 + HEX_LINE_BYTES * 4 + 5) // Longest line of the hex view, with a 16-digit offset
+
+/**
+ * Format the hex view line of the `n` bytes at `p`, found at `offset` in the file, like hexdump -C does:
+ * the offset, the bytes in hex in two groups of 8, and the printable ones between bars. Returns the length of the line.
+ * A short last line is copied to a zeroed buffer first, so the kernels can always read 16 bytes.
+ */
+int hexFormatLine(char *out, const unsigned char *p, int n, unsigned long long offset, int digits)
+{
+    unsigned char bytes[HEX_LINE_BYTES];
+    char hex[HEX_LINE_BYTES * 2], ascii[HEX_LINE_BYTES];
+    int i, len = 0;
+
+    // The offset goes through the same kernel: its 8 bytes, most significant first, give 16 hex digits
+    memset(bytes, 0, sizeof(bytes));
+    for (i = 0; i < 8; i++)
+        bytes[7 - i] = offset >> (8 * i);
+    E.simd->hex16(hex, ascii, bytes);
+    memcpy(out, hex + 16 - digits, digits);
+    len = digits;
+    out[len++] = ' ';
+    out[len++] = ' ';
+
+    if (n < HEX_LINE_BYTES)
+    {
+        memset(bytes, 0, sizeof(bytes));
+        memcpy(bytes, p, n);
+        p = bytes;
+    }
+    E.simd->hex16(hex, ascii, p);
+    for (i = 0; i < HEX_LINE_BYTES; i++)
+    {
+        out[len] = i < n ? hex[2 * i] : ' ';
+        out[len + 1] = i < n ? hex[2 * i + 1] : ' ';
+        out[len + 2] = ' ';
+        len += 3;
+        if (i == HEX_LINE_BYTES / 2 - 1)
+            out[len++] = ' ';
+    }
+    out[len++] = ' ';
+    out[len++] = '|';
+    memcpy(out + len, ascii, n);
+    len += n;
+    out[len++] = '|';
+    return len;
+}
+
+/** Screen column of byte `byte` of a hex view line, relative to the left of the window. */
+int editorHexColumn(struct editorBuffer *b, int byte)
+{
+    return b->hex_digits + 2 + byte * 3 + (byte >= HEX_LINE_BYTES / 2);
+}
+
+/**
+ * Turn a cursor and scroll position from text rows to hex lines, or back. The cursor keeps the byte it is on
+ * and stays on the same line of the screen. Text to hex uses the row index to find where the row starts,
+ * hex to text looks the byte up in it, both O(log n).
+ */
+void editorHexPosition(struct editorBuffer *b, int *cx, int *cy, int *rowoff, int tohex)
+{
+    int screen_row = *cy - *rowoff;
+    if (tohex)
+    {
+        long long offset = 0;
+        if (*cy < b->num_rows)
+        {
+            int size = editorRow(b, *cy)->size;
+            offset = editorRowOffset(b, *cy) + (*cx < size ? *cx : size);
+        }
+        *cy = offset / HEX_LINE_BYTES;
+        *cx = offset % HEX_LINE_BYTES;
+    }
+    else
+    {
+        long long offset = (long long)*cy * HEX_LINE_BYTES + *cx;
+        *cy = editorRowAtOffset(b, offset);
+        *cx = offset - editorRowOffset(b, *cy);
+        if (*cy < b->num_rows && *cx > editorRow(b, *cy)->size)
+            *cx = editorRow(b, *cy)->size;
+    }
+    *rowoff = *cy - screen_row;
+    if (*rowoff < 0)
+        *rowoff = 0;
+}
+
+/**
+ * Switch the current buffer between text and the hex view. The hex view reads straight from the mapping and only formats
+ * the lines on screen, so it needs no memory of its own and scrolls a binary file of any size as fast as text.
+ */
+void editorToggleHex()
+{
+    struct editorBuffer *b = E.buf;
+    if (b->map == NULL)
+    {
+        editorSetStatusMessage("No file data to show in hex");
+        return;
+    }
+
+    int tohex = !b->hex, i;
+    if (!b->indexed)
+        editorIndexRows(b);
+    editorHexPosition(b, &b->cx, &b->cy, &b->rowoff, tohex);
+    for (i = 0; i < E.num_windows; i++)
+        if (E.windows[i]->buf == b)
+            editorHexPosition(b, &E.windows[i]->cx, &E.windows[i]->cy, &E.windows[i]->rowoff, tohex);
+    b->hex = tohex;
+    for (i = 0; i < E.num_windows; i++)
+    {
+        if (E.windows[i]->buf != b)
+            continue;
+        if (E.windows[i]->cx > editorMaxCol(E.windows[i]))
+            E.windows[i]->cx = editorMaxCol(E.windows[i]);
+        E.windows[i]->num_cursors = 0;
+        E.windows[i]->block = 0;
+    }
+    editorUpdateGutter(b);
+    editorRedrawBuffer(b);
+}
+
+/** grep */
+
+#define GREP_MMAP_MIN (64 * 1024) // Files at least this big are mapped, smaller ones are read() into a reused buffer
+#define GREP_BINARY_PROBE 8192    // A NUL byte in this many leading bytes marks a file as binary, like git and grep do
+#define GREP_LINE_MAX 512         // Matching lines are cut to this many bytes in the results buffer
+#define GREP_DECODE_CHUNK (1024 * 1024) // UTF-16 files are converted and searched this many bytes at a time
+
+/**
+ * A grepJob is one search over a directory tree. A walker task lists the files and submits one task per file to the
+ * task pool, the file tasks append the matching lines to `results`, and the main thread turns them into rows of the
+ * results buffer as they arrive. The whole job shares one task group and one cancel token.
+ */
+struct grepJob
+{
+    char *pattern;
+    size_t patlen;
+    char *root;
+    struct taskGroup group;
+    struct cancelToken token;
+
+    pthread_mutex_t lock; // Protects everything below
+    char *results;        // Pending "path:line:text\n" lines not yet added to the results buffer
+    size_t results_len, results_cap;
+    long files, matches, binary;
+};
+
+/** A file to search, the argument of a grepFileTask. */
+struct grepFile
+{
+    struct grepJob *job;
+    char *path;
+};
+
+/** Read buffer of the worker, reused for every small file it searches, and conversion buffer for UTF-16 files. */
+__thread char *grepReadBuf = NULL;
+__thread size_t grepReadCap = 0;
+__thread char *grepDecodeBuf = NULL;
+__thread size_t grepDecodeCap = 0;
+
+/** Append the line `line` of `path`, which contains a match, to the pending results. Called with job->lock held. */
+void grepAddResult(struct grepJob *job, const char *path, long lineno, const char *line, size_t len)
+{
+    char prefix[64];
+    size_t j;
+    if (len > GREP_LINE_MAX)
+        len = GREP_LINE_MAX;
+    while (len > 0 && line[len - 1] == '\r')
+        len--;
+    int plen = snprintf(prefix, sizeof(prefix), ":%ld:", lineno);
+    size_t need = strlen(path) + plen + len + 1;
+    if (job->results_len + need > job->results_cap)
+    {
+        size_t cap = (job->results_len + need) * 2;
+        job->results = memRealloc(MEM_SEARCH, job->results, job->results_cap, cap);
+        job->results_cap = cap;
+    }
+    char *p = &job->results[job->results_len];
+    memcpy(p, path, strlen(path));
+    p += strlen(path);
+    memcpy(p, prefix, plen);
+    p += plen;
+    memcpy(p, line, len);
+    // A stray NUL in the text would end the row early when it is drawn
+    for (j = 0; j < len; j++)
+        if (p[j] == '\0')
+            p[j] = ' ';
+    p[len] = '\n';
+    job->results_len += need;
+    job->matches++;
+}
+
+/**
+ * Search `len` bytes of text for the pattern, the first line being line `lineno`. The find kernel finds the pattern and we
+ * count newlines with find_byte only between consecutive matches, so text without a match never has its lines counted.
+ * Each line is reported once. With `count_all` the lines after the last match are counted too
+ * and the number of the line the text ends on is returned, so the text can be searched piece by piece.
+ */
+long grepSearch(struct grepJob *job, const char *path, char *data, size_t len, long lineno, int count_all,
+                struct cancelToken *token)
+{
+    char *end = data + len, *p = data, *line = data, *match, *nl;
+    while (!cancelTokenIsSet(token) && (match = E.simd->find(p, end - p, job->pattern, job->patlen)) != NULL)
+    {
+        while ((nl = E.simd->find_byte(line, match - line, '\n')) != NULL)
+        {
+            lineno++;
+            line = nl + 1;
+        }
+        char *eol = E.simd->find_byte(match, end - match, '\n');
+        if (eol == NULL)
+            eol = end;
+        pthread_mutex_lock(&job->lock);
+        grepAddResult(job, path, lineno, line, eol - line);
+        pthread_mutex_unlock(&job->lock);
+        if (eol == end)
+            return lineno;
+        p = line = eol + 1;
+        lineno++;
+    }
+    if (count_all)
+        while ((nl = E.simd->find_byte(line, end - line, '\n')) != NULL)
+        {
+            lineno++;
+            line = nl + 1;
+        }
+    return lineno;
+}
+
+/**
+ * Search a UTF-16 file. It is converted to UTF-8 GREP_DECODE_CHUNK bytes at a time, each piece extended to the end of
+ * the line it stops in, so the matches and their lines are whole and the conversion buffer does not grow with the file.
+ */
+void grepSearchUtf16(struct grepJob *job, const char *path, char *data, size_t len, int encoding,
+                     struct cancelToken *token)
+{
+    size_t pos = 2;
+    long lineno = 1;
+    while (pos < len && !cancelTokenIsSet(token))
+    {
+        size_t end = len;
+        if (len - pos > GREP_DECODE_CHUNK)
+        {
+            char *nl = findNewline(data, len, data + pos + GREP_DECODE_CHUNK, data + len, encoding);
+            if (nl != NULL)
+                end = nl - data + 2;
+        }
+        if (2 * (end - pos) + 1 > grepDecodeCap)
+        {
+            memFree(MEM_SEARCH, grepDecodeBuf, grepDecodeCap);
+            grepDecodeCap = 2 * (end - pos) + 1;
+            grepDecodeBuf = memAlloc(MEM_SEARCH, grepDecodeCap);
+        }
+        size_t n = transcodeUtf16(grepDecodeBuf, (unsigned char *)data + pos, end - pos, encoding == ENCODING_UTF16BE);
+        lineno = grepSearch(job, path, grepDecodeBuf, n, lineno, 1, token);
+        pos = end;
+    }
+}
+
+/**
+ * Search one file. Big files are mapped, small ones are read into the worker's read buffer, so searching
+ * thousands of small files costs no allocation per file. A file starting with a UTF-16 byte order mark is converted
+ * as it is searched, other files with a NUL byte near the start are skipped as binary.
+ */
+void grepFileTask(void *arg, struct cancelToken *token)
+{
+    TRACE_SCOPE("grepFileTask");
+    struct grepFile *f = arg;
+    struct grepJob *job = f->job;
+    int fd = -1;
+    struct stat st;
+    if (cancelTokenIsSet(token) || (fd = open(f->path, O_RDONLY)) == -1 ||
+        fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0)
+        goto done;
+
+    size_t len = st.st_size;
+    char *data = NULL;
+    int mapped = 0;
+    TRACE_ARG("bytes", len);
+    if (len >= GREP_MMAP_MIN)
+    {
+        data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+            goto done;
+        madvise(data, len, MADV_SEQUENTIAL);
+        mapped = 1;
+    }
+    else
+    {
+        if (grepReadCap < len)
+        {
+            grepReadBuf = memRealloc(MEM_SEARCH, grepReadBuf, grepReadCap, GREP_MMAP_MIN);
+            grepReadCap = GREP_MMAP_MIN;
+        }
+        ssize_t n, got = 0;
+        while ((size_t)got < len && (n = read(fd, grepReadBuf + got, len - got)) > 0)
+            got += n;
+        len = got;
+        data = grepReadBuf;
+    }
+
+    int encoding = ENCODING_UTF8;
+    if (len >= 2 && (unsigned char)data[0] == 0xff && (unsigned char)data[1] == 0xfe)
+        encoding = ENCODING_UTF16LE;
+    else if (len >= 2 && (unsigned char)data[0] == 0xfe && (unsigned char)data[1] == 0xff)
+        encoding = ENCODING_UTF16BE;
+    size_t probe = len < GREP_BINARY_PROBE ? len : GREP_BINARY_PROBE;
+    int binary = encoding == ENCODING_UTF8 && memchr(data, '\0', probe) != NULL;
+    pthread_mutex_lock(&job->lock);
+    job->files++;
+    job->binary += binary;
+    pthread_mutex_unlock(&job->lock);
+
+    if (encoding != ENCODING_UTF8)
+        grepSearchUtf16(job, f->path, data, len, encoding, token);
+    else if (!binary)
+        grepSearch(job, f->path, data, len, 1, 0, token);
+
+    if (mapped)
+        munmap(data, st.st_size);
+done:
+    if (fd != -1)
+        close(fd);
+    free(f->path);
+    free(f);
+}
+
+/** Recursively list `dir` and submit a task for each of its files. Hidden files and directories are skipped. */
+void grepWalk(struct grepJob *job, const char *dir)
+{
+    DIR *d = opendir(dir);
+    if (d == NULL)
+        return;
+    struct dirent *de;
+    while (!cancelTokenIsSet(&job->token) && (de = readdir(d)) != NULL)
+    {
+        if (de->d_name[0] == '.')
+            continue;
+        size_t len = strlen(dir) + strlen(de->d_name) + 2;
+        char *path = malloc(len);
+        if (strcmp(dir, ".") == 0)
+            snprintf(path, len, "%s", de->d_name);
+        else
+            snprintf(path, len, "%s/%s", dir, de->d_name);
+
+        int type = de->d_type;
+        if (type == DT_UNKNOWN)
+        {
+            struct stat st;
+            type = lstat(path, &st) == -1 ? DT_UNKNOWN : S_ISDIR(st.st_mode) ? DT_DIR
+                                                     : S_ISREG(st.st_mode)   ? DT_REG
+                                                                             : DT_UNKNOWN;
+        }
+        if (type == DT_DIR)
+        {
+            grepWalk(job, path);
+            free(path);
+        }
+        else if (type == DT_REG)
+        {
+            struct grepFile *f = malloc(sizeof(struct grepFile));
+            f->job = job;
+            f->path = path;
+            poolSubmit(&job->group, &job->token, grepFileTask, f);
+        }
+        else
+            free(path);
+    }
+    closedir(d);
+}
+
+/**
+ * The walker is a task of the job itself, so the group cannot run out of pending tasks before every file is submitted.
+ * Files submitted from here land on this worker's deque and the other workers steal them.
+ * The root can also be a single file, which is then the only one searched.
+ */
+void grepWalkTask(void *arg, struct cancelToken *token)
+{
+    struct grepJob *job = arg;
+    struct stat st;
+    if (cancelTokenIsSet(token))
+        return;
+    if (stat(job->root, &st) == 0 && S_ISREG(st.st_mode))
+    {
+        struct grepFile *f = malloc(sizeof(struct grepFile));
+        f->job = job;
+        f->path = strdup(job->root);
+        grepFileTask(f, token);
+    }
+    else
+        grepWalk(job, job->root);
+}
+
+/** Move the pending results into the results buffer. Each line is copied into the row store and the chunk is freed. */
+void grepDrainResults(struct grepJob *job, struct editorBuffer *b)
+{
+    TRACE_SCOPE("grepDrainResults");
+    pthread_mutex_lock(&job->lock);
+    char *chunk = job->results;
+    size_t len = job->results_len, cap = job->results_cap;
+    job->results = NULL;
+    job->results_len = job->results_cap = 0;
+    pthread_mutex_unlock(&job->lock);
+    TRACE_ARG("bytes", len);
+
+    char *p = chunk, *end = chunk + len;
+    while (p < end)
+    {
+        char *nl = memchr(p, '\n', end - p);
+        editorAppendOwnedRow(b, p, nl - p, nl - p + 1);
+        p = nl + 1;
+    }
+    memFree(MEM_SEARCH, chunk, cap);
+    if (len)
+        editorRedrawBuffer(b);
+}
+
+/**
+ * Search every file under a directory for a fixed string. The matches are streamed into a new buffer while the search runs,
+ * one "path:line:text" row per matching line, and pressing Enter on a row opens the file at that line.
+ * Escape cancels the job's token, every queued file task then returns at once and we keep what was found so far.
+ * `pattern` and `root` are malloc()'d and freed when the search is done.
+ */
+void editorGrepRun(char *pattern, char *root)
+{
+    TRACE_SCOPE("editorGrep");
+    struct grepJob *job = calloc(1, sizeof(struct grepJob));
+    job->pattern = pattern;
+    job->patlen = strlen(pattern);
+    job->root = root;
+    taskGroupInit(&job->group);
+    pthread_mutex_init(&job->lock, NULL);
+
+    struct editorBuffer *b = editorBufferNew();
+    b->filename = malloc(strlen(pattern) + 8);
+    sprintf(b->filename, "*grep %s*", pattern);
+    b->grep = 1;
+    editorAddBuffer(b);
+
+    long long start = monotonicNs();
+    poolSubmit(&job->group, &job->token, grepWalkTask, job);
+
+    // Stream the results into the buffer, refreshing the screen a few times per second
+    while (1)
+    {
+        int pending = taskGroupWaitFor(&job->group, 50);
+        grepDrainResults(job, b);
+        if (pending == 0)
+            break;
+        if (editorCancelRequested())
+            cancelTokenSet(&job->token);
+        pthread_mutex_lock(&job->lock);
+        editorSetStatusMessage("Searching... %ld matches in %ld files (Esc to stop)", job->matches, job->files);
+        pthread_mutex_unlock(&job->lock);
+        editorRefreshScreen();
+    }
+
+    editorSetStatusMessage("%s%ld matches in %ld files (%ld binary skipped) in %.2fs",
+                           cancelTokenIsSet(&job->token) ? "Stopped: " : "", job->matches, job->files, job->binary,
+                           (monotonicNs() - start) / 1e9);
+    taskGroupDestroy(&job->group);
+    pthread_mutex_destroy(&job->lock);
+    free(job->pattern);
+    free(job->root);
+    free(job);
+}
+
+/** Ask for a pattern and a directory and search. */
+void editorGrep()
+{
+    char *pattern = editorPrompt("Grep for: %s");
+    if (pattern == NULL)
+        return;
+    char *root = editorPrompt("In directory: %s");
+    if (root == NULL)
+    {
+        free(pattern);
+        return;
+    }
+    editorGrepRun(pattern, root);
+}
+
+/**
+ * Open the file of the grep result under the cursor at the matching line. Result rows look like path:line:text,
+ * we look for the first ":<digits>:" so that the text itself can contain colons. The file is loaded with editorOpen(),
+ * or, if it is already open, we just switch to its buffer.
+ */
+void editorGrepJump()
+{
+    int i, j, len;
+    char *text = editorRowText(E.buf, E.win->cy, &len);
+    for (i = 0; i < len; i++)
+    {
+        if (text[i] != ':')
+            continue;
+        for (j = i + 1; j < len && isdigit((unsigned char)text[j]); j++)
+            ;
+        if (j > i + 1 && j < len && text[j] == ':')
+            break;
+    }
+    if (i == len)
+        return;
+
+    char *path = strndup(text, i);
+    long line = strtol(&text[i + 1], NULL, 10);
+    int at;
+    for (at = 0; at < E.num_buffers; at++)
+        if (E.buffers[at]->filename && !E.buffers[at]->grep && strcmp(E.buffers[at]->filename, path) == 0)
+            break;
+    if (at < E.num_buffers)
+        editorSwitchBuffer(at);
+    else if (editorOpen(path) == -1)
+    {
+        editorSetStatusMessage("Can't open %s: %s", path, strerror(errno));
+        free(path);
+        return;
+    }
+    free(path);
+    editorJumpTo(line - 1, 0);
+}
+
+void editorMoveCursor(int key)
+{
+    switch (key)
+    {
+    case ARROW_LEFT:
+        if (E.win->cx != 0)
+        {
+            E.win->cx--;
+        }
+        break;
+    case ARROW_RIGHT:
+        if (E.win->cx < editorMaxCol(E.win))
+        {
+            E.win->cx++;
+        }
+        break;
+    case ARROW_UP:
+        if (E.win->cy != 0)
+        {
+            E.win->cy--;
+        }
+        break;
+    case ARROW_DOWN:
+        if (E.win->cy < editorViewRows(E.buf) - 1)
+        {
+            E.win->cy++;
+        }
+        break;
+    }
+}
+/** keyboard macros */
+
+#define MACRO_CANCEL_RUNS 1024 // A long macro run looks for Escape or Ctrl-C between runs this often
+
+/** Start recording the keys the edit stage gets, or stop and keep them as the macro. */
+void editorToggleRecording()
+{
+    if (E.recording)
+    {
+        E.recording = 0;
+        E.macro_len--; // The Ctrl-K that stopped it
+        editorSetStatusMessage("Recorded a macro of %d keys, Ctrl-Y to run it", E.macro_len);
+    }
+    else
+    {
+        E.recording = 1;
+        E.macro_len = 0;
+        editorSetStatusMessage("Recording a macro, Ctrl-K to stop");
+    }
+    editorRedrawAll(); // The status lines show the recording
+}
+
+/** Add a key to the macro being recorded. */
+void editorRecordKey(int c)
+{
+    if (E.macro_len == E.macro_cap)
+    {
+        E.macro_cap = E.macro_cap ? E.macro_cap * 2 : 256;
+        if ((E.macro = realloc(E.macro, sizeof(int) * E.macro_cap)) == NULL)
+            die("realloc");
+    }
+    E.macro[E.macro_len++] = c;
+}
+
+/**
+ * Run the macro a number of times, or until the end of the file: until a run leaves the cursor on a row no further down
+ * than it found it, which is how a macro that edits a line and moves down stops after the last line.
+ * The keys go through editorProcessKeypress() like typed keys but no frame is built while they do, prompts included,
+ * so a run costs what its edits cost. The screen is redrawn once at the end.
+ */
+void editorRunMacro()
+{
+    TRACE_SCOPE("editorRunMacro");
+    if (E.recording)
+    {
+        E.macro_len--; // The Ctrl-Y itself
+        editorSetStatusMessage("Stop recording with Ctrl-K first");
+        return;
+    }
+    if (E.macro_len == 0)
+    {
+        editorSetStatusMessage("No macro, record one with Ctrl-K");
+        return;
+    }
+    char *answer = editorPrompt("Run macro how many times (number, $ until the end of the file): %s");
+    if (answer == NULL)
+        return;
+    int to_end = strcmp(answer, "$") == 0;
+    long times = to_end ? LONG_MAX : atol(answer), runs;
+    free(answer);
+    if (times < 1)
+    {
+        editorSetStatusMessage("Not a number of times");
+        return;
+    }
+
+    E.playing = 1;
+    for (runs = 0; runs < times; runs++)
+    {
+        int cy = E.win->cy;
+        E.macro_pos = 0;
+        while (E.macro_pos < E.macro_len)
+            editorProcessKeypress();
+        editorEnforceBudget(); // Usually done by the frames that are not built
+        if (to_end && E.win->cy <= cy)
+        {
+            runs++;
+            break;
+        }
+        if (!E.replay && runs % MACRO_CANCEL_RUNS == MACRO_CANCEL_RUNS - 1 && editorCancelRequested())
+        {
+            runs++;
+            break;
+        }
+    }
+    E.playing = 0;
+    TRACE_ARG("runs", runs);
+    editorRedrawAll();
+    editorSetStatusMessage("Ran the macro %ld times", runs);
+}
+
+/** Clear the screen and exit once the render stage has written everything. A replay prints its report on the way out. */
+void editorQuit()
+{
+    editorWriteString("\x1b[2J\x1b[H");
+    editorFlushOutput();
+    if (E.replay)
+        editorReplayReport();
+    if (E.tracing)
+        traceWrite();
+    exit(0);
+}
+
+void editorProcessKeypress()
+{
+    int c = editorNextKey();
+    TRACE_SCOPE("editorProcessKeypress");
+    TRACE_ARG("key", c);
+    if (E.win->block && editorBlockKey(c))
+        return;
+    switch (c)
+    {
+    case CTRL_KEY('q'):
+    case INPUT_EOF:
+        editorQuit();
+        break;
+
+    case PAGE_UP:
+    case PAGE_DOWN:
+        editorPageMove(c);
+        break;
+
+    case CTRL_KEY('g'):
+        editorGoto();
+        break;
+
+    case CTRL_KEY('o'):
+        editorOpenPrompt();
+        break;
+    case CTRL_KEY('n'):
+        editorSwitchBuffer((E.current + 1) % E.num_buffers);
+        break;
+    case CTRL_KEY('p'):
+        editorSwitchBuffer((E.current + E.num_buffers - 1) % E.num_buffers);
+        break;
+
+    case HOME_KEY:
+        E.win->cx = 0;
+        editorMoveCursors(c);
+        break;
+    case END_KEY:
+        E.win->cx = editorMaxCol(E.win);
+        break;
+
+    case CTRL_KEY('l'):
+        // Cycle the gutter between no line numbers, absolute and relative line numbers
+        E.line_numbers = (E.line_numbers + 1) % 3;
+    {
+        int i;
+        for (i = 0; i < E.num_buffers; i++)
+            editorUpdateGutter(E.buffers[i]);
+        for (i = 0; i < E.num_windows; i++)
+            if (E.windows[i]->cx > editorMaxCol(E.windows[i]))
+                E.windows[i]->cx = editorMaxCol(E.windows[i]);
+        editorRedrawAll();
+    }
+    break;
+
+    case CTRL_KEY('w'):
+        editorWindowCommand();
+        break;
+
+    case CTRL_KEY('f'):
+        editorGrep();
+        break;
+    case CTRL_KEY('t'):
+        editorShowPoolStats();
+        break;
+    case CTRL_KEY('x'):
+        editorToggleHex();
+        break;
+    case F12_KEY:
+        E.stats_overlay = !E.stats_overlay;
+        if (!E.stats_overlay)
+            editorRedrawAll(); // Bring back what the overlay covered
+        break;
+    case '\r':
+        if (E.buf->grep && E.buf->num_rows > 0)
+            editorGrepJump();
+        else
+            editorEdit(EDIT_INSERT, "\n", 1);
+        break;
+
+    case CTRL_KEY('z'):
+        editorUndo();
+        break;
+    case CTRL_KEY('e'):
+        editorAddCursorBelow();
+        break;
+    case CTRL_KEY('a'):
+        editorAddCursorColumn();
+        break;
+    case CTRL_KEY('b'):
+        editorToggleBlock();
+        break;
+    case CTRL_KEY('u'):
+        // Not Ctrl-S, which people and terminals take for save or for XOFF
+        editorLinesCommand();
+        break;
+    case CTRL_KEY('k'):
+        if (!E.playing)
+            editorToggleRecording();
+        break;
+    case CTRL_KEY('y'):
+        if (!E.playing)
+            editorRunMacro();
+        break;
+    case '\x1b':
+        editorClearCursors(E.win);
+        break;
+
+    case 127:
+    case CTRL_KEY('h'):
+        editorEdit(EDIT_BACKSPACE, NULL, 0);
+        break;
+    case DEL_KEY:
+        editorEdit(EDIT_DELETE, NULL, 0);
+        break;
 
     case ARROW_UP:
     case ARROW_DOWN:
     case ARROW_LEFT:
     case ARROW_RIGHT:
         editorMoveCursor(c);
+        editorMoveCursors(c);
+        break;
+
+    default:
+        if (c == '\t' || (c >= 32 && c < 256))
+        {
+            char ch = c;
+            editorEdit(EDIT_INSERT, &ch, 1);
+        }
         break;
     }
 }
 
-/** Function to draw a screen of tilde */
-void editorDrawRows(struct abuf *ab)
+/**
+ * Pad the rest of a window line. A window that reaches the right edge of the screen can simply use the K command
+ * (Erase In Line), but that would also erase its neighbours, so other windows pad with spaces and draw their separator.
+ */
+void editorDrawLineEnd(struct abuf *ab, struct editorWindow *w, int used)
 {
-    int y;
-    for (y = 0; y < E.screen_rows; y++)
+    if (!editorWindowHasSeparator(w))
+    {
+        abAppend(ab, "\x1b[K", 3);
+        return;
+    }
+    while (used++ < w->cols - 1)
+        abAppend(ab, " ", 1);
+    abAppend(ab, "|", 1);
+}
+
+/** Move the terminal cursor to row `y`, column `x` of window `w`. */
+void editorMoveTo(struct abuf *ab, struct editorWindow *w, int y, int x)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", w->top + y + 1, w->left + x + 1);
+    abAppend(ab, buf, strlen(buf));
+}
+
+/**
+ * Draw the visible lines of a hex view. Each one is formatted from the mapping when it is drawn, so the cost of a frame
+ * only depends on the size of the window, and only the pages on screen are ever read from the file.
+ */
+void editorDrawHexRows(struct abuf *ab, struct editorWindow *w)
+{
+    struct editorBuffer *b = w->buf;
+    int y, rows = editorWindowTextRows(w), cols = editorWindowTextCols(w);
+    char line[HEX_LINE_MAX];
+    for (y = 0; y < rows; y++)
+    {
+        int used = 0;
+        unsigned long long offset = (unsigned long long)(y + w->rowoff) * HEX_LINE_BYTES;
+        editorMoveTo(ab, w, y, 0);
+        if (offset >= b->map_len)
+        {
+            abAppend(ab, "~", 1);
+            used = 1;
+        }
+        else
+        {
+            int n = b->map_len - offset < HEX_LINE_BYTES ? (int)(b->map_len - offset) : HEX_LINE_BYTES;
+            int len = hexFormatLine(line, (unsigned char *)b->map + offset, n, offset, b->hex_digits);
+            if (len > cols)
+                len = cols;
+            abAppend(ab, line, len);
+            used = len;
+        }
+        editorDrawLineEnd(ab, w, used);
+    }
+}
+
+/**
+ * Draw the extra cursors of window `w` that are on row `filerow`, at screen row `y`, in inverted colors as the terminal
+ * has only one cursor of its own. `*next` is the first cursor not drawn yet, the cursors are sorted so every frame
+ * walks them once. A cursor past the end of its row sits on a blank.
+ */
+void editorDrawRowCursors(struct abuf *ab, struct editorWindow *w, int filerow, int *next, int y, int cols)
+{
+    erow *row = editorRow(w->buf, filerow);
+    for (; *next < w->num_cursors && w->cursors[*next].cy == filerow; (*next)++)
+    {
+        int cx = w->cursors[*next].cx;
+        if (cx >= cols)
+            continue;
+        editorMoveTo(ab, w, y, w->buf->gutter_width + cx);
+        abAppend(ab, "\x1b[7m", 4);
+        abAppend(ab, cx < row->rsize ? &row->render[cx] : " ", 1);
+        abAppend(ab, "\x1b[m", 3);
+    }
+}
+
+/** Draw the part of row `filerow` in the block selection of `w` in inverted colors. A block of width zero shows as a column of cursors. */
+void editorDrawRowBlock(struct abuf *ab, struct editorWindow *w, int filerow, int y, int cols)
+{
+    erow *row = editorRow(w->buf, filerow);
+    int top, bottom, lo, hi, x;
+    editorBlockBounds(w, &top, &bottom, &lo, &hi);
+    if (filerow < top || filerow > bottom)
+        return;
+    if (hi == lo)
+        hi++;
+    if (hi > cols)
+        hi = cols;
+    if (lo >= hi)
+        return;
+    editorMoveTo(ab, w, y, w->buf->gutter_width + lo);
+    abAppend(ab, "\x1b[7m", 4);
+    for (x = lo; x < hi; x++)
+        abAppend(ab, x < row->rsize ? &row->render[x] : " ", 1);
+    abAppend(ab, "\x1b[m", 3);
+}
+
+/** Function to draw the rows of a window, rows past the end of the buffer are drawn as a tilde */
+void editorDrawRows(struct abuf *ab, struct editorWindow *w)
+{
+    TRACE_SCOPE("editorDrawRows");
+    struct editorBuffer *b = w->buf;
+    int y, rows = editorWindowTextRows(w), cols = editorWindowTextCols(w), lo = 0, hi = w->num_cursors;
+    struct gutterCounter g;
+    if (b->hex)
     {
-        if (y >= E.num_rows)
+        editorDrawHexRows(ab, w);
+        return;
+    }
+    if (b->gutter_width)
+        gutterCounterStart(&g, b, w->rowoff, w->cy);
+    while (lo < hi) // First extra cursor on screen
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (w->cursors[mid].cy < w->rowoff)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (y = 0; y < rows; y++)
+    {
+        int used = 0;
+        int filerow = y + w->rowoff;
+        editorMoveTo(ab, w, y, 0);
+        if (filerow >= b->num_rows)
         {
 
-            if (y == E.screen_rows / 3)
+            if (b->num_rows == 0 && E.num_buffers == 1 && E.num_windows == 1 && y == rows / 3)
             {
                 char welcome[80];
                 int welcome_len = snprintf(welcome, sizeof(welcome),
@@ -476,26 +7476,271 @@ void editorDrawRows(struct abuf *ab)
             else
             {
                 abAppend(ab, "~", 1);
+                used = 1;
             }
         }
         else
         {
-            int len = E.row.size;
-            if (len > E.screen_cols)
-                len = E.screen_cols;
-            abAppend(ab, E.row.chars, len);
+            if (b->gutter_width)
+            {
+                abAppend(ab, g.label.digits, g.label.width);
+                abAppend(ab, " ", 1);
+                gutterCounterNext(&g);
+                used += b->gutter_width;
+            }
+            erow *row = editorRenderRow(b, filerow);
+            int len = row->rsize;
+            if (len > cols)
+                len = cols;
+            abAppend(ab, row->render, len);
+            used += len;
         }
-        abAppend(ab, "\x1b[K", 3);
-        if (y < E.screen_rows - 1)
+        editorDrawLineEnd(ab, w, used);
+        if (filerow < b->num_rows)
+            editorDrawRowCursors(ab, w, filerow, &lo, y, cols);
+        if (w->block && filerow < b->num_rows)
+            editorDrawRowBlock(ab, w, filerow, y, cols);
+    }
+}
+
+/**
+ * When the cursor moved up or down but the window did not scroll, the text on the terminal is still correct.
+ * Only relative line numbers change, and usually only in their last digit, so we walk the labels of the
+ * previous frame and of the new one side by side and only re-emit the columns from the first differing digit onwards.
+ */
+void editorDrawGutterDamage(struct abuf *ab, struct editorWindow *w)
+{
+    if (E.line_numbers != LINE_NUMBERS_RELATIVE || w->buf->gutter_width == 0 || w->cy == w->drawn_cy)
+        return;
+
+    struct gutterCounter old, new;
+    gutterCounterStart(&old, w->buf, w->rowoff, w->drawn_cy);
+    gutterCounterStart(&new, w->buf, w->rowoff, w->cy);
+    int y;
+    for (y = 0; y < editorWindowTextRows(w) && y + w->rowoff < w->buf->num_rows; y++)
+    {
+        int x = 0;
+        while (x < new.label.width && old.label.digits[x] == new.label.digits[x])
+            x++;
+        if (x < new.label.width)
+        {
+            editorMoveTo(ab, w, y, x);
+            abAppend(ab, &new.label.digits[x], new.label.width - x);
+        }
+        gutterCounterNext(&old);
+        gutterCounterNext(&new);
+    }
+}
+
+/**
+ * editorScroll() keeps the cursor inside the visible window. If the cursor moved above the window we scroll up to it,
+ * if it moved past the bottom we scroll just enough to make it the last visible row.
+ */
+void editorScroll(struct editorWindow *w)
+{
+    int rows = editorWindowTextRows(w);
+    if (w->cy < w->rowoff)
+        w->rowoff = w->cy;
+    if (w->cy >= w->rowoff + rows)
+        w->rowoff = w->cy - rows + 1;
+    // The last line of a hex view can be short, keep the cursor on one of its bytes
+    if (w->buf->hex && w->cx > editorMaxCol(w))
+        w->cx = editorMaxCol(w);
+}
+
+/**
+ * The status line is the last line of a window, drawn in inverted colors with the m command (Select Graphic Rendition).
+ * <esc>[7m switches to inverted colors and <esc>[m switches back to normal formatting.
+ * The position on the right side comes straight from the row index, so it costs O(log n) no matter how big the file is.
+ */
+void editorDrawStatusBar(struct abuf *ab, struct editorWindow *w)
+{
+    struct editorBuffer *b = w->buf;
+    editorMoveTo(ab, w, w->rows - 1, 0);
+    abAppend(ab, "\x1b[7m", 4);
+    static const char *encodings[] = {"", " latin-1", " utf-16le", " utf-16be"};
+    char status[80], rstatus[80];
+    int len, rlen;
+    if (b->hex)
+    {
+        long long offset = (long long)w->cy * HEX_LINE_BYTES + w->cx;
+        len = snprintf(status, sizeof(status), "%s[%d/%d] %.20s - %zu bytes [hex]",
+                       w == E.win ? "*" : "", editorBufferIndex(b) + 1, E.num_buffers,
+                       b->filename ? b->filename : "[No Name]", b->map_len);
+        rlen = snprintf(rstatus, sizeof(rstatus), "byte %lld (0x%llx)  %d%%",
+                        offset, offset, (int)(offset * 100 / b->map_len));
+    }
+    else
+    {
+        len = snprintf(status, sizeof(status), "%s[%d/%d] %.20s - %d lines%s%s",
+                       w == E.win ? "*" : "", editorBufferIndex(b) + 1, E.num_buffers,
+                       b->filename ? b->filename : "[No Name]", b->num_rows,
+                       encodings[b->encoding], b->crlf ? " crlf" : "");
+        if (w->num_cursors > 0 && len < (int)sizeof(status))
+            len += snprintf(status + len, sizeof(status) - len, " (%d cursors)", w->num_cursors + 1);
+        if (E.recording && w == E.win && len < (int)sizeof(status))
+            len += snprintf(status + len, sizeof(status) - len, " (recording)");
+        if (w->block && len < (int)sizeof(status))
+            len += snprintf(status + len, sizeof(status) - len, " (block %dx%d)", abs(w->cy - w->block_cy) + 1,
+                            abs(w->cx - w->block_cx));
+        if (len >= (int)sizeof(status))
+            len = sizeof(status) - 1;
+        rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d  byte %lld  %d%%",
+                        w->cy + 1, b->num_rows, editorRowOffset(b, w->cy),
+                        editorRowPercent(b, w->cy));
+    }
+    if (len > w->cols)
+        len = w->cols;
+    abAppend(ab, status, len);
+    while (len < w->cols)
+    {
+        if (w->cols - len == rlen)
+        {
+            abAppend(ab, rstatus, rlen);
+            break;
+        }
+        abAppend(ab, " ", 1);
+        len++;
+    }
+    abAppend(ab, "\x1b[m", 3);
+}
+
+/**
+ * Draw one window. A window whose text and scroll position did not change since the last frame skips its text area
+ * and only patches the gutter, so a second window on the same buffer costs nothing while the cursor moves in the first.
+ */
+void editorDrawWindow(struct abuf *ab, struct editorWindow *w)
+{
+    if (w->redraw || w->rowoff != w->drawn_rowoff)
+        editorDrawRows(ab, w);
+    else
+        editorDrawGutterDamage(ab, w);
+    w->redraw = 0;
+    w->drawn_rowoff = w->rowoff;
+    w->drawn_cy = w->cy;
+    editorDrawStatusBar(ab, w);
+}
+
+/** The message bar shows the message set by editorSetStatusMessage() for 5 seconds, prompts are shown here too. */
+void editorDrawMessageBar(struct abuf *ab)
+{
+    abAppend(ab, "\x1b[K", 3);
+    int msglen = strlen(E.statusmsg);
+    if (msglen > E.screen_cols)
+        msglen = E.screen_cols;
+    if (msglen && time(NULL) - E.statusmsg_time < 5)
+        abAppend(ab, E.statusmsg, msglen);
+}
+
+/** stats overlay */
+
+#define STATS_WIDTH 44 // Columns of the stats overlay, it sits in the top right corner of the screen
+
+/** Format a byte count the way people read it, "12.3 MB". */
+void formatBytes(char *buf, size_t size, long long bytes)
+{
+    if (bytes < 1024)
+        snprintf(buf, size, "%lld B", bytes);
+    else if (bytes < 1024 * 1024)
+        snprintf(buf, size, "%.1f KB", bytes / 1024.0);
+    else if (bytes < 1024 * 1024 * 1024)
+        snprintf(buf, size, "%.1f MB", bytes / (1024.0 * 1024));
+    else
+        snprintf(buf, size, "%.1f GB", bytes / (1024.0 * 1024 * 1024));
+}
+
+/** Draw one line of the overlay at screen row `*row`, padded to its width, and move `*row` down. */
+void statsLine(struct abuf *ab, int *row, const char *fmt, ...)
+{
+    char line[STATS_WIDTH + 1], pos[32];
+    int width = STATS_WIDTH < E.screen_cols ? STATS_WIDTH : E.screen_cols;
+    if (*row >= E.screen_rows)
+        return;
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (len > width)
+        len = width;
+    snprintf(pos, sizeof(pos), "\x1b[%d;%dH", *row + 1, E.screen_cols - width + 1);
+    abAppend(ab, pos, strlen(pos));
+    abAppend(ab, line, len);
+    while (len++ < width)
+        abAppend(ab, " ", 1);
+    (*row)++;
+}
+
+/**
+ * The stats overlay, toggled with F12, shows where the memory goes and how fast frames are built while the editor runs,
+ * without a profiler. The heap numbers are what memAlloc() and friends were told, per enum memKind; mapped files are
+ * page cache and listed apart. The frame numbers are for the frame before this one, which is the last one measured.
+ */
+void editorDrawStatsOverlay(struct abuf *ab)
+{
+    static const char *names[MEM_KINDS] = {
+        [MEM_RENDER] = "render caches", [MEM_DECODED] = "decoded text", [MEM_ROWS] = "row text",
+        [MEM_PACKED] = "compressed rows", [MEM_INTERN] = "interned text", [MEM_INDEX] = "row index",
+        [MEM_SEARCH] = "search", [MEM_UNDO] = "undo"};
+    char a[24], b[24];
+    long long mapped = 0, heap = 0;
+    int i, row = 0, mapped_buffers = 0;
+    for (i = 0; i < E.num_buffers; i++)
+    {
+        if (E.buffers[i]->map != NULL)
         {
-            abAppend(ab, "\r\n", 2);
+            mapped += E.buffers[i]->map_len;
+            mapped_buffers++;
         }
     }
+
+    abAppend(ab, "\x1b[7m", 4);
+    statsLine(ab, &row, " stats                          F12 to hide");
+    formatBytes(a, sizeof(a), mapped);
+    statsLine(ab, &row, " mapped           %s in %d files", a, mapped_buffers);
+    for (i = 0; i < MEM_KINDS; i++)
+    {
+        long long used = __atomic_load_n(&E.mem_used[i], __ATOMIC_RELAXED);
+        heap += used;
+        formatBytes(a, sizeof(a), used);
+        statsLine(ab, &row, " %-16s %s", names[i], a);
+    }
+    formatBytes(a, sizeof(a), heap);
+    statsLine(ab, &row, " heap total       %s", a);
+    formatBytes(a, sizeof(a), editorMemUsed());
+    formatBytes(b, sizeof(b), E.mem_budget);
+    statsLine(ab, &row, " budget           %s of %s", a, b);
+    statsLine(ab, &row, " evicted          %ld caches, %ld row blocks", E.mem_evicted, E.mem_frozen);
+    if (E.intern)
+        statsLine(ab, &row, " dedup            %.2fx over %d lines", internRatio(), E.intern_count);
+    statsLine(ab, &row, " frame            %lld us, %d bytes", E.frame_ns / 1000, E.frame_bytes);
+    if (E.frames_built > 0 && E.frames_sent > 0)
+        statsLine(ab, &row, " frame average    %lld us, %lld bytes",
+                  E.frame_total_ns / 1000 / E.frames_built, E.bytes_sent / E.frames_sent);
+    statsLine(ab, &row, " keys             %d/s, %ld in all", E.keys_per_sec, E.keys_read);
+    statsLine(ab, &row, " simd             %s", E.simd->name);
+    formatBytes(a, sizeof(a), E.buf->undo_kept);
+    statsLine(ab, &row, " undo depth       %d steps, %s", E.buf->num_undo, a);
+
+    char busy[STATS_WIDTH + 1];
+    int len = snprintf(busy, sizeof(busy), " %-16s", "workers busy%");
+    for (i = 0; i < E.pool.num_workers && len < (int)sizeof(busy) - 5; i++)
+        len += snprintf(&busy[len], sizeof(busy) - len, " %d", poolUtilization(i));
+    statsLine(ab, &row, "%s", busy);
+    abAppend(ab, "\x1b[m", 3);
 }
 
 /** Function to Refresh the screen */
 void editorRefreshScreen()
 {
+    if (E.playing)
+        return;
+    TRACE_SCOPE("editorRefreshScreen");
+    int i;
+    long long start = monotonicNs();
+    for (i = 0; i < E.num_windows; i++)
+        editorScroll(E.windows[i]);
+    editorEnforceBudget();
+
     struct abuf ab = ABUF_INIT;
     /**
      * write() and STDOUT_FILENO come from <unistd.h>.
@@ -507,18 +7752,25 @@ void editorRefreshScreen()
      * We are using VT100 escape sequence guide - https://vt100.net/docs/vt100-ug/chapter3.html
      */
     abAppend(&ab, "\x1b[?25l", 6);
-    abAppend(&ab, "\x1b[H", 3);
 
-    editorDrawRows(&ab);
+    for (i = 0; i < E.num_windows; i++)
+        editorDrawWindow(&ab, E.windows[i]);
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), "\x1b[%d;1H", E.screen_rows + 1);
+    abAppend(&ab, buf, strlen(buf));
+    editorDrawMessageBar(&ab);
+    if (E.stats_overlay)
+        editorDrawStatsOverlay(&ab);
 
     /**
      * We changed the old H command into an H command with arguments, specifying the exact position we want the cursor to move to.
-     * We add 1 to E.cy and E.cx to convert from 0-indexed values to the 1-indexed values that the terminal uses.
+     * We add 1 to E.win->cy and E.win->cx to convert from 0-indexed values to the 1-indexed values that the terminal uses.
      * Now, we’ll allow the user to move the cursor using the wasd keys. (If you’re unfamiliar with using these keys as arrow keys: w is your up arrow, s is your down arrow, a is left, d is right.)
      * **/
-    char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.cy + 1, E.cx + 1);
-    abAppend(&ab, buf, strlen(buf));
+    int cx = E.win->cx < editorMaxCol(E.win) ? E.win->cx : editorMaxCol(E.win); // Typing can take it past the edge
+    editorMoveTo(&ab, E.win, E.win->cy - E.win->rowoff,
+                 E.buf->hex ? editorHexColumn(E.buf, cx) : E.buf->gutter_width + cx);
 
     /**
      * We use escape sequences to tell the terminal to hide and show the cursor.
@@ -528,8 +7780,686 @@ void editorRefreshScreen()
      */
     abAppend(&ab, "\x1b[?25h", 6);
 
-    write(STDOUT_FILENO, ab.b, ab.len);
-    abFree(&ab);
+    E.frame_ns = monotonicNs() - start;
+    E.frame_total_ns += E.frame_ns;
+    E.frame_bytes = ab.len;
+    E.frames_built++;
+    // The render stage writes the frame and frees the buffer
+    editorWriteFrame(ab.b, ab.len);
+}
+
+/**
+ * editorSetStatusMessage() is a variadic function, like printf(). va_list, va_start() and va_end() come from <stdarg.h>,
+ * and vsnprintf() does the formatting for us. time(NULL) remembers when the message was set so it can disappear after a while.
+ */
+void editorSetStatusMessage(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
+    va_end(ap);
+    E.statusmsg_time = time(NULL);
+}
+
+/** benchmark */
+
+/**
+ * --bench runs a fixed set of scenarios headless on the files given and writes what each one cost as JSON: the wall time,
+ * and the CPU's own counts of cycles, instructions, cache misses and mispredicted branches, read with perf_event_open().
+ * Wall time alone hides a row store layout that misses the cache more often, the counters do not.
+ * The counters are opened before the task pool starts and are inherited by its workers, so work on the pool counts too.
+ * A counter the machine or the kernel does not offer, like the hardware ones in most virtual machines, is written as null.
+ */
+enum benchCounter
+{
+    BENCH_CYCLES = 0,
+    BENCH_INSTRUCTIONS,
+    BENCH_CACHE_MISSES,
+    BENCH_BRANCH_MISSES,
+    BENCH_TASK_CLOCK, // Nanoseconds of CPU time, summed over the threads
+    BENCH_PAGE_FAULTS,
+    BENCH_COUNTERS
+};
+
+#define BENCH_SCROLL_PAGES 20000 // The scroll scenario pages down through at most this many screens
+#define BENCH_JUMPS 2000         // Random jumps of the jump scenario
+#define BENCH_PATTERN_MAX 16     // The search scenario looks for this many bytes of the middle row of the first file
+#define BENCH_CURSORS 10000      // Rows of the first file that get a cursor in the cursors scenario
+#define BENCH_CURSOR_KEYS 10     // Keys typed at all the cursors at once, and then undone
+#define BENCH_SCENARIOS 8        // Room for the scenarios of one run
+#define BENCH_TOLERANCE 0.05     // A scenario this much slower than the baseline, beyond noise, regressed
+#define BENCH_TOLERANCE_INSTRUCTIONS 0.02
+
+struct benchSample
+{
+    long long ns;
+    unsigned long long counts[BENCH_COUNTERS][3]; // Value, time enabled and time running, see PERF_FORMAT_TOTAL_TIME_*
+};
+
+int benchFds[BENCH_COUNTERS];
+
+void benchOpenCounters()
+{
+    static const struct
+    {
+        unsigned int type;
+        unsigned long long config;
+    } events[BENCH_COUNTERS] = {
+#ifdef __linux__
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+#endif
+    };
+    int i;
+    for (i = 0; i < BENCH_COUNTERS; i++)
+    {
+        benchFds[i] = -1;
+#ifdef __linux__
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.inherit = 1;        // Count the threads started from now on too
+        attr.exclude_kernel = 1; // Only the editor's own code, which also works with perf_event_paranoid at 2
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        benchFds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+        (void)events;
+#endif
+    }
+}
+
+/** Write `s` as a JSON string, file names can contain quotes and backslashes. */
+void benchWriteString(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++)
+    {
+        if (*s == '"' || *s == '\\')
+            fprintf(f, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(f, "\\u%04x", *s);
+        else
+            fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+void benchSample(struct benchSample *s)
+{
+    int i;
+    memset(s, 0, sizeof(*s));
+    for (i = 0; i < BENCH_COUNTERS; i++)
+        if (benchFds[i] != -1 && read(benchFds[i], s->counts[i], sizeof(s->counts[i])) != sizeof(s->counts[i]))
+            s->counts[i][2] = 0;
+    s->ns = monotonicNs();
+}
+
+/** What one scenario cost in one run. */
+struct benchResult
+{
+    char name[16];
+    long ops;
+    long long wall_ns;
+    double value[BENCH_COUNTERS];
+    int ok[BENCH_COUNTERS];
+};
+
+/** The same scenario over every run: the median, which one slow run does not move, and how much the runs varied. */
+struct benchSummary
+{
+    char name[16];
+    int runs;
+    long ops;
+    double wall, wall_min, wall_stddev;
+    double value[BENCH_COUNTERS]; // Medians
+    int ok[BENCH_COUNTERS];       // The counter worked in every run
+};
+
+static const char *benchCounterNames[BENCH_COUNTERS] = {
+    [BENCH_CYCLES] = "cycles", [BENCH_INSTRUCTIONS] = "instructions", [BENCH_CACHE_MISSES] = "cache_misses",
+    [BENCH_BRANCH_MISSES] = "branch_misses", [BENCH_TASK_CLOCK] = "task_clock_ns", [BENCH_PAGE_FAULTS] = "page_faults"};
+
+/**
+ * The cost of a scenario is the difference between the samples taken before and after it. When more counters are open
+ * than the PMU has, the kernel takes turns between them and a counter only runs part of the time,
+ * so its count is scaled up by the share of the time it ran.
+ */
+void benchMeasure(struct benchResult *r, const char *name, long ops, struct benchSample *a, struct benchSample *b)
+{
+    int i;
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->ops = ops;
+    r->wall_ns = b->ns - a->ns;
+    for (i = 0; i < BENCH_COUNTERS; i++)
+    {
+        unsigned long long running = b->counts[i][2] - a->counts[i][2];
+        r->ok[i] = benchFds[i] != -1 && running > 0;
+        r->value[i] = r->ok[i] ? (double)(b->counts[i][0] - a->counts[i][0]) * (b->counts[i][1] - a->counts[i][1]) / running : 0;
+    }
+}
+
+/**
+ * One run of the scenarios, in order:
+ *  - open: map, detect and index every file
+ *  - scroll: draw the first file a screen at a time from top to bottom
+ *  - jump: jump to random rows of the first file and draw each, which misses every cache on the way
+ *  - search: grep the first file for a piece of its middle row
+ *  - cursors: put a cursor on each of the first BENCH_CURSORS rows of the first file, type a few keys and undo them
+ * Frames are built exactly as on a terminal and written to /dev/null, on the main thread, so the counts of a
+ * scenario are its own and not the render thread's. Returns the number of scenarios run.
+ */
+int benchRun(char **files, int num_files, struct benchResult *results)
+{
+    struct benchSample a, b;
+    int i, n = 0;
+    long ops;
+
+    E.replay = 1; // Headless, like a replay with no keys
+    if ((E.input_fd = open("/dev/null", O_RDONLY)) == -1 || (E.output_fd = open("/dev/null", O_WRONLY)) == -1)
+        die("/dev/null");
+    benchOpenCounters();
+    initEditor();
+
+    benchSample(&a);
+    for (i = 0; i < num_files; i++)
+        if (editorOpen(files[i]) == -1)
+            die(files[i]);
+    benchSample(&b);
+    editorSwitchBuffer(0);
+    benchMeasure(&results[n++], "open", num_files, &a, &b);
+
+    benchSample(&a);
+    editorRefreshScreen();
+    for (ops = 1; ops < BENCH_SCROLL_PAGES; ops++)
+    {
+        int rowoff = E.win->rowoff;
+        editorPageMove(PAGE_DOWN);
+        if (E.win->rowoff == rowoff)
+            break;
+        editorRefreshScreen();
+    }
+    benchSample(&b);
+    benchMeasure(&results[n++], "scroll", ops, &a, &b);
+
+    unsigned int seed = 1;
+    benchSample(&a);
+    for (ops = 0; ops < BENCH_JUMPS; ops++)
+    {
+        seed = seed * 1103515245 + 12345;
+        editorJumpTo(editorViewRows(E.buf) > 0 ? (int)((seed >> 1) % editorViewRows(E.buf)) : 0, 0);
+        editorRefreshScreen();
+    }
+    benchSample(&b);
+    benchMeasure(&results[n++], "jump", ops, &a, &b);
+
+    // Something that is certainly in the file, unless the middle row is empty or the file is shown in hex
+    int len = 0;
+    char *text = NULL;
+    if (!E.buf->hex && E.buf->num_rows > 0)
+        text = editorRowText(E.buf, E.buf->num_rows / 2, &len);
+    if (len > BENCH_PATTERN_MAX)
+        len = BENCH_PATTERN_MAX;
+    if (len > 0 && memchr(text, '\0', len) == NULL)
+    {
+        benchSample(&a);
+        editorGrepRun(strndup(text, len), strdup(files[0]));
+        benchSample(&b);
+        benchMeasure(&results[n++], "search", E.buf->num_rows, &a, &b);
+    }
+
+    editorSwitchBuffer(0);
+    if (!E.buf->hex && E.buf->encoding == ENCODING_UTF8 && E.buf->num_rows > 0)
+    {
+        int cursors = E.buf->num_rows < BENCH_CURSORS ? E.buf->num_rows : BENCH_CURSORS;
+        benchSample(&a);
+        editorJumpTo(0, 0);
+        editorReserveCursors(E.win, cursors);
+        for (i = 1; i < cursors; i++)
+            E.win->cursors[E.win->num_cursors++] = (struct editorCursor){0, i};
+        for (i = 0; i < BENCH_CURSOR_KEYS; i++)
+        {
+            editorEdit(EDIT_INSERT, "x", 1);
+            editorRefreshScreen();
+        }
+        for (i = 0; i < BENCH_CURSOR_KEYS; i++)
+        {
+            editorUndo();
+            editorRefreshScreen();
+        }
+        benchSample(&b);
+        benchMeasure(&results[n++], "cursors", (long)cursors * BENCH_CURSOR_KEYS * 2, &a, &b);
+    }
+
+    if (E.tracing)
+        traceWrite();
+    return n;
+}
+
+int compareDouble(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+double benchMedian(double *v, int n)
+{
+    qsort(v, n, sizeof(double), compareDouble);
+    return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+/** Summarize scenario `at` of every run. */
+void benchSummarize(struct benchSummary *s, struct benchResult results[][BENCH_SCENARIOS], int runs, int at)
+{
+    double v[runs], mean = 0, var = 0;
+    int r, i;
+    memset(s, 0, sizeof(*s));
+    memcpy(s->name, results[0][at].name, sizeof(s->name));
+    s->runs = runs;
+    s->ops = results[0][at].ops;
+    for (r = 0; r < runs; r++)
+    {
+        v[r] = results[r][at].wall_ns;
+        mean += v[r] / runs;
+    }
+    for (r = 0; r < runs; r++)
+        var += (v[r] - mean) * (v[r] - mean) / runs;
+    s->wall_stddev = sqrt(var);
+    s->wall = benchMedian(v, runs);
+    s->wall_min = v[0];
+    for (i = 0; i < BENCH_COUNTERS; i++)
+    {
+        s->ok[i] = 1;
+        for (r = 0; r < runs; r++)
+        {
+            s->ok[i] &= results[r][at].ok[i];
+            v[r] = results[r][at].value[i];
+        }
+        s->value[i] = s->ok[i] ? benchMedian(v, runs) : 0;
+    }
+}
+
+/** Write a scenario summary as one JSON object, on one line so that --bench-baseline can read it back line by line. */
+void benchWriteSummary(FILE *f, struct benchSummary *s, int first)
+{
+    int i;
+    fprintf(f, "%s    {\"name\": \"%s\", \"runs\": %d, \"ops\": %ld, \"wall_ns\": %.0f, \"wall_ns_min\": %.0f, \"wall_ns_stddev\": %.0f",
+            first ? "" : ",\n", s->name, s->runs, s->ops, s->wall, s->wall_min, s->wall_stddev);
+    for (i = 0; i < BENCH_COUNTERS; i++)
+    {
+        if (s->ok[i])
+            fprintf(f, ", \"%s\": %.0f", benchCounterNames[i], s->value[i]);
+        else
+            fprintf(f, ", \"%s\": null", benchCounterNames[i]);
+    }
+    if (s->ok[BENCH_CYCLES] && s->ok[BENCH_INSTRUCTIONS] && s->value[BENCH_CYCLES] > 0)
+        fprintf(f, ", \"ipc\": %.3f", s->value[BENCH_INSTRUCTIONS] / s->value[BENCH_CYCLES]);
+    else
+        fprintf(f, ", \"ipc\": null");
+    fprintf(f, "}");
+}
+
+/** Read field `key` of a summary line written by benchWriteSummary(), returns 0 if it is missing or null. */
+int benchReadField(const char *line, const char *key, double *value)
+{
+    char pattern[32];
+    snprintf(pattern, sizeof(pattern), "\"%s\": ", key);
+    const char *p = strstr(line, pattern);
+    if (p == NULL || strncmp(p + strlen(pattern), "null", 4) == 0)
+        return 0;
+    *value = strtod(p + strlen(pattern), NULL);
+    return 1;
+}
+
+/**
+ * Compare the summaries with a baseline written by an earlier --bench and print how each scenario moved.
+ * A scenario regressed when its median wall time is more than BENCH_TOLERANCE slower and the difference is bigger
+ * than twice the spread of the two measurements, or when it runs more than BENCH_TOLERANCE_INSTRUCTIONS more
+ * instructions, which barely vary from run to run. Returns the number of regressions.
+ */
+int benchCompare(const char *path, struct benchSummary *sums, int n)
+{
+    FILE *f = fopen(path, "r");
+    char line[1024];
+    int regressions = 0, i;
+    if (f == NULL)
+        die(path);
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        struct benchSummary *s = NULL;
+        double wall, stddev = 0, instructions;
+        for (i = 0; i < n && s == NULL; i++)
+        {
+            char name[32];
+            snprintf(name, sizeof(name), "\"name\": \"%s\"", sums[i].name);
+            if (strstr(line, name) != NULL)
+                s = &sums[i];
+        }
+        if (s == NULL || !benchReadField(line, "wall_ns", &wall) || wall <= 0)
+            continue;
+        benchReadField(line, "wall_ns_stddev", &stddev);
+        double change = (s->wall - wall) / wall;
+        int slower = change > BENCH_TOLERANCE && s->wall - wall > 2 * (s->wall_stddev + stddev);
+        int more = s->ok[BENCH_INSTRUCTIONS] && benchReadField(line, "instructions", &instructions) && instructions > 0 &&
+                   (s->value[BENCH_INSTRUCTIONS] - instructions) / instructions > BENCH_TOLERANCE_INSTRUCTIONS;
+        fprintf(stderr, "bench: %-8s %10.2f ms -> %10.2f ms %+7.1f%%%s%s\n", s->name, wall / 1e6, s->wall / 1e6,
+                change * 100, slower ? "  SLOWER" : "", more ? "  MORE INSTRUCTIONS" : "");
+        regressions += slower || more;
+    }
+    fclose(f);
+    return regressions;
+}
+
+/**
+ * --bench: every run is a child process of its own, which starts from a fresh editor and a fresh task pool and hands its
+ * results back through a pipe. With --bench-runs the scenarios are repeated and summarized, and with --bench-baseline
+ * they are compared against an earlier result; the exit status is 3 if something regressed.
+ */
+void editorBench(char **files, int num_files)
+{
+    struct benchResult (*results)[BENCH_SCENARIOS] = calloc(E.bench_runs, sizeof(*results));
+    struct benchSummary sums[BENCH_SCENARIOS];
+    int i, r, n = 0;
+    if (num_files == 0)
+    {
+        fprintf(stderr, "--bench needs at least one file\n");
+        exit(1);
+    }
+
+    for (r = 0; r < E.bench_runs; r++)
+    {
+        int fds[2], status;
+        if (pipe(fds) == -1)
+            die("pipe");
+        fflush(NULL); // The child exits normally, so that profiling builds write their profile, and flushes stdio again
+        pid_t pid = fork();
+        if (pid == -1)
+            die("fork");
+        if (pid == 0)
+        {
+            struct benchResult run[BENCH_SCENARIOS];
+            int count = benchRun(files, num_files, run);
+            if (write(fds[1], run, sizeof(struct benchResult) * count) != (ssize_t)(sizeof(struct benchResult) * count))
+                exit(1);
+            exit(0);
+        }
+        close(fds[1]);
+        ssize_t got, len = 0;
+        while ((got = read(fds[0], (char *)results[r] + len, sizeof(results[r]) - len)) > 0)
+            len += got;
+        close(fds[0]);
+        if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            fprintf(stderr, "bench: run %d failed\n", r + 1);
+            exit(1);
+        }
+        n = len / sizeof(struct benchResult);
+    }
+
+    FILE *f = strcmp(E.bench_path, "-") == 0 ? stdout : fopen(E.bench_path, "w");
+    if (f == NULL)
+        die(E.bench_path);
+    fprintf(f, "{\n  \"simd\": \"%s\",\n  \"files\": [", E.simd->name);
+    for (i = 0; i < num_files; i++)
+    {
+        fprintf(f, "%s", i ? ", " : "");
+        benchWriteString(f, files[i]);
+    }
+    fprintf(f, "],\n  \"scenarios\": [\n");
+    for (i = 0; i < n; i++)
+    {
+        benchSummarize(&sums[i], results, E.bench_runs, i);
+        benchWriteSummary(f, &sums[i], i == 0);
+    }
+    fprintf(f, "\n  ]\n}\n");
+    if (f != stdout)
+        fclose(f);
+    if (E.bench_baseline && benchCompare(E.bench_baseline, sums, n) > 0)
+        exit(3);
+    exit(0);
+}
+
+/**
+ * The benchmark corpus is generated instead of downloaded: a xorshift generator with a fixed seed per file writes
+ * the same bytes on every machine, so results from two machines or two commits are measured on the same input.
+ * Each file stresses something else: row count, line length, multi-byte text, transcoding, CRLF, the hex view.
+ */
+#define CORPUS_LOG_LINES 1000000
+#define CORPUS_JSON_LINES 8
+#define CORPUS_JSON_OBJECTS 50000 // Objects per line of the JSON file, about 4 MB
+#define CORPUS_WIDE_LINES 100000
+#define CORPUS_CRLF_LINES 500000
+#define CORPUS_BLOB_BYTES (32 * 1024 * 1024)
+#define CORPUS_SOURCE_FUNCTIONS 100000 // Ten lines each
+
+unsigned long long corpusRandom(unsigned long long *x)
+{
+    *x ^= *x >> 12;
+    *x ^= *x << 25;
+    *x ^= *x >> 27;
+    return *x * 2685821657736338717ULL;
+}
+
+static const char *corpusWords[] = {
+    "the", "editor", "maps", "file", "into", "memory", "and", "splits", "it", "rows", "of", "text", "every", "window",
+    "draws", "only", "what", "changed", "since", "last", "frame", "a", "buffer", "is", "shown", "in", "lines", "page",
+    "cache", "kernel", "reads", "ahead", "while", "we", "index", "terminal", "cursor", "screen", "search", "results"};
+
+#define CORPUS_WORDS (sizeof(corpusWords) / sizeof(corpusWords[0]))
+
+void corpusLog(FILE *f)
+{
+    static const char *levels[] = {"INFO", "INFO", "INFO", "INFO", "DEBUG", "DEBUG", "WARN", "ERROR"};
+    static const char *methods[] = {"GET", "GET", "GET", "POST", "PUT", "DELETE"};
+    static const char *resources[] = {"items", "users", "orders", "sessions", "search"};
+    unsigned long long x = 0x9e3779b97f4a7c15ULL, ms = 0;
+    int i;
+    for (i = 0; i < CORPUS_LOG_LINES; i++)
+    {
+        unsigned long long r = corpusRandom(&x);
+        ms += r % 50;
+        unsigned long long sec = ms / 1000;
+        fprintf(f, "2026-03-%02lluT%02llu:%02llu:%02llu.%03lluZ %-5s [worker-%02llu] req=%016llx %s /api/v1/%s/%llu %d %llums\n",
+                1 + sec / 86400 % 28, sec / 3600 % 24, sec / 60 % 60, sec % 60, ms % 1000, levels[r % 8], (r >> 8) % 32,
+                corpusRandom(&x), methods[(r >> 16) % 6], resources[(r >> 24) % 5], (r >> 32) % 100000,
+                (r >> 48) % 20 ? 200 : 500, (r >> 40) % 900 + 1);
+    }
+}
+
+void corpusJson(FILE *f)
+{
+    unsigned long long x = 0x2545f4914f6cdd1dULL;
+    int i, j;
+    for (i = 0; i < CORPUS_JSON_LINES; i++)
+    {
+        fputc('[', f);
+        for (j = 0; j < CORPUS_JSON_OBJECTS; j++)
+        {
+            unsigned long long r = corpusRandom(&x);
+            fprintf(f, "%s{\"id\":%d,\"name\":\"%s-%llu\",\"tags\":[\"%s\",\"%s\"],\"score\":%llu.%03llu,\"active\":%s}",
+                    j ? "," : "", i * CORPUS_JSON_OBJECTS + j, corpusWords[r % CORPUS_WORDS], (r >> 8) % 10000,
+                    corpusWords[(r >> 16) % CORPUS_WORDS], corpusWords[(r >> 24) % CORPUS_WORDS], (r >> 32) % 100,
+                    (r >> 40) % 1000, (r >> 50) % 2 ? "true" : "false");
+        }
+        fputs("]\n", f);
+    }
+}
+
+/** Write code unit `u` of UTF-16LE text. */
+void corpusPutUtf16(FILE *f, unsigned int u)
+{
+    fputc(u & 0xff, f);
+    fputc(u >> 8, f);
+}
+
+/** Wide text: Greek, Cyrillic, CJK and emoji. The same text is written as UTF-8, and as UTF-16LE with a byte order mark. */
+void corpusWideText(FILE *f, int utf16)
+{
+    static const unsigned int ranges[][2] = {{0x391, 0x3c9}, {0x410, 0x44f}, {0x4e00, 0x9fff}, {0x1f600, 0x1f64f}};
+    unsigned long long x = 0xd1b54a32d192ed03ULL;
+    int i, j;
+    if (utf16)
+        fputs("\xff\xfe", f);
+    for (i = 0; i < CORPUS_WIDE_LINES; i++)
+    {
+        int n = 20 + corpusRandom(&x) % 40;
+        for (j = 0; j < n; j++)
+        {
+            unsigned long long r = corpusRandom(&x);
+            const unsigned int *range = ranges[(r >> 8) % 4];
+            unsigned int cp = r % 6 == 0 ? ' ' : range[0] + (r >> 16) % (range[1] - range[0] + 1);
+            char buf[4];
+            if (!utf16)
+                fwrite(buf, 1, utf8Encode(buf, cp), f);
+            else if (cp >= 0x10000)
+            {
+                corpusPutUtf16(f, 0xd800 + ((cp - 0x10000) >> 10));
+                corpusPutUtf16(f, 0xdc00 + ((cp - 0x10000) & 0x3ff));
+            }
+            else
+                corpusPutUtf16(f, cp);
+        }
+        if (utf16)
+            corpusPutUtf16(f, '\n');
+        else
+            fputc('\n', f);
+    }
+}
+
+void corpusWide(FILE *f)
+{
+    corpusWideText(f, 0);
+}
+
+void corpusWide16(FILE *f)
+{
+    corpusWideText(f, 1);
+}
+
+void corpusCrlf(FILE *f)
+{
+    unsigned long long x = 0x8cb92ba72f3d8dd7ULL;
+    int i, j;
+    for (i = 0; i < CORPUS_CRLF_LINES; i++)
+    {
+        int n = 3 + corpusRandom(&x) % 15;
+        for (j = 0; j < n; j++)
+            fprintf(f, "%s%s", j ? " " : "", corpusWords[corpusRandom(&x) % CORPUS_WORDS]);
+        fputs(".\r\n", f);
+    }
+}
+
+void corpusBlob(FILE *f)
+{
+    unsigned long long x = 0x94d049bb133111ebULL;
+    long i;
+    for (i = 0; i < CORPUS_BLOB_BYTES / 8; i++)
+    {
+        unsigned long long r = corpusRandom(&x);
+        fwrite(&r, 1, 8, f);
+    }
+}
+
+void corpusSource(FILE *f)
+{
+    unsigned long long x = 0xbf58476d1ce4e5b9ULL;
+    int i;
+    fputs("#include \"items.h\"\n\n", f);
+    for (i = 0; i < CORPUS_SOURCE_FUNCTIONS; i++)
+    {
+        unsigned long long r = corpusRandom(&x);
+        fprintf(f, "static int %s_%d(struct item *it, int n)\n{\n\tint total = 0;\n\tfor (int i = 0; i < n; i++) {\n"
+                   "\t\tif (it[i].flags & 0x%llx)\n\t\t\ttotal += it[i].value * %llu; // %s %s\n\t}\n\treturn total;\n}\n",
+                corpusWords[r % CORPUS_WORDS], i, (r >> 8) % 0x10000, (r >> 24) % 100, corpusWords[(r >> 32) % CORPUS_WORDS],
+                corpusWords[(r >> 40) % CORPUS_WORDS]);
+        if (i < CORPUS_SOURCE_FUNCTIONS - 1)
+            fputc('\n', f);
+    }
+}
+
+/** --bench-corpus: write every file of the corpus to `dir`, creating it if needed. */
+void benchCorpus(const char *dir)
+{
+    static const struct
+    {
+        const char *name;
+        void (*write)(FILE *f);
+    } files[] = {{"log.txt", corpusLog}, {"long.json", corpusJson}, {"wide.txt", corpusWide}, {"wide16.txt", corpusWide16},
+                 {"crlf.txt", corpusCrlf}, {"blob.bin", corpusBlob}, {"source.c", corpusSource}};
+    char path[4096];
+    unsigned int i;
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+        die(dir);
+    for (i = 0; i < sizeof(files) / sizeof(files[0]); i++)
+    {
+        snprintf(path, sizeof(path), "%s/%s", dir, files[i].name);
+        FILE *f = fopen(path, "wb");
+        if (f == NULL)
+            die(path);
+        setvbuf(f, NULL, _IOFBF, 1 << 20);
+        files[i].write(f);
+        if (ferror(f) || fclose(f) == EOF)
+            die(path);
+        printf("%s\n", path);
+    }
+}
+
+/** input */
+
+/**
+ * editorPrompt() displays a prompt in the message bar and lets the user type a line of input after it.
+ * `prompt` is a format string containing a %s, which is where the user's input is displayed.
+ * The input is returned as a malloc()'d string when Enter is pressed, or NULL if the user pressed Escape.
+ */
+char *editorPrompt(char *prompt)
+{
+    size_t bufsize = 128;
+    char *buf = malloc(bufsize);
+    size_t buflen = 0;
+    buf[0] = '\0';
+
+    while (1)
+    {
+        editorSetStatusMessage(prompt, buf);
+        editorRefreshScreen();
+
+        int c = editorNextKey();
+        if (c == DEL_KEY || c == CTRL_KEY('h') || c == 127)
+        {
+            if (buflen != 0)
+                buf[--buflen] = '\0';
+        }
+        else if (c == '\x1b' || c == INPUT_EOF)
+        {
+            editorSetStatusMessage("");
+            free(buf);
+            return NULL;
+        }
+        else if (c == '\r')
+        {
+            if (buflen != 0)
+            {
+                editorSetStatusMessage("");
+                return buf;
+            }
+        }
+        else if (!iscntrl(c) && c < 128)
+        {
+            if (buflen == bufsize - 1)
+            {
+                bufsize *= 2;
+                buf = realloc(buf, bufsize);
+            }
+            buf[buflen++] = c;
+            buf[buflen] = '\0';
+        }
+    }
 }
 
 /**
@@ -537,27 +8467,166 @@ void editorRefreshScreen()
  */
 void initEditor()
 {
-    E.cx = 0;
-    E.cy = 0;
-    E.num_rows = 0;
+    E.buffers = NULL;
+    E.num_buffers = 0;
+    E.current = 0;
+    E.buf = NULL;
+    E.windows = NULL;
+    E.num_windows = 0;
+    E.focus = 0;
+    E.win = NULL;
+    E.line_numbers = LINE_NUMBERS_ABSOLUTE;
+    E.statusmsg[0] = '\0';
+    E.statusmsg_time = 0;
 
-    if (getWindowSize(&E.screen_rows, &E.screen_cols) == -1)
+    if (E.replay)
+    {
+        // There is no terminal to ask, replay on a screen of $LINES x $COLUMNS, 24 x 80 by default
+        E.screen_rows = getenv("LINES") ? atoi(getenv("LINES")) : 24;
+        E.screen_cols = getenv("COLUMNS") ? atoi(getenv("COLUMNS")) : 80;
+        if (E.screen_rows < 4 || E.screen_cols < 20)
+            die("screen size");
+    }
+    else if (getWindowSize(&E.screen_rows, &E.screen_cols) == -1)
         die("getWindowSize");
+    E.screen_rows -= 1; // Leave room for the message bar, each window has its own status line
+    if (E.mem_budget == 0)
+        E.mem_budget = memDefaultBudget();
+    poolInit();
+    editorAddWindow(NULL, 0, 0, E.screen_rows, E.screen_cols);
+    editorFocusWindow(0);
 }
 
+/**
+ * Usage: cedit [--replay KEYFILE] [--replay-rate KEYS] [--replay-bps BYTES] [--no-pipeline] [--memory-budget SIZE] [--intern]
+ *              [--trace FILE] [--simd LEVEL] [--bench JSONFILE [--bench-runs N] [--bench-baseline JSONFILE]] [FILE...]
+ *        cedit --bench-corpus DIR
+ *        cedit --simd-self-test
+ *  --replay KEYFILE    run headless: read the keys from KEYFILE, exactly as a terminal would send them, write the frames
+ *                      to /dev/null and print throughput and key-to-frame latency when the keys run out.
+ *  --replay-rate KEYS  make the replayed keys arrive at KEYS keys per second instead of all at once.
+ *  --replay-bps BYTES  make the replay's terminal take at most BYTES bytes per second, like a slow ssh link.
+ *  --no-pipeline       read keys and write frames on the main thread, as a baseline to compare the pipeline against.
+ *  --memory-budget SIZE  let the caches use at most SIZE bytes (with an optional K, M or G suffix) instead of 1/8 of the RAM.
+ *  --intern            keep one copy of each distinct line the editor stores itself, for very repetitive text.
+ *  --trace FILE        record what the editor spends its time on and write it to FILE at exit, as Chrome trace events.
+ *  --simd LEVEL        use the scalar, libc, sse2, avx2 or avx512 kernels instead of the widest ones the CPU supports.
+ *  --simd-self-test    check the kernels of every level the CPU supports against the scalar ones on random inputs.
+ *  --bench JSONFILE    run the benchmark scenarios on the files and write wall time and CPU counters to JSONFILE, - for stdout.
+ *  --bench-runs N      repeat the scenarios N times and write the median, the fastest run and the standard deviation.
+ *  --bench-baseline JSONFILE  compare with the results of an earlier --bench, exit with 3 if a scenario regressed.
+ *  --bench-corpus DIR  write the files of the benchmark corpus to DIR, the same bytes on every machine, see `make bench-corpus`.
+ */
 int main(int argc, char *argv[])
 {
-    enableRawMode();
+    int i, pipeline = 1;
+    const char *simd = NULL;
+    E.bench_runs = 1;
+    E.input_fd = STDIN_FILENO;
+    E.output_fd = STDOUT_FILENO;
+    for (i = 1; i < argc && strncmp(argv[i], "--", 2) == 0; i++)
+    {
+        if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+        {
+            E.replay = 1;
+            if ((E.input_fd = open(argv[++i], O_RDONLY)) == -1)
+                die(argv[i]);
+            if ((E.output_fd = open("/dev/null", O_WRONLY)) == -1)
+                die("/dev/null");
+            E.latencies_cap = 1 << 20;
+            E.latencies = malloc(sizeof(long long) * E.latencies_cap);
+        }
+        else if (strcmp(argv[i], "--replay-rate") == 0 && i + 1 < argc)
+            E.replay_rate = atol(argv[++i]);
+        else if (strcmp(argv[i], "--replay-bps") == 0 && i + 1 < argc)
+            E.replay_bps = atol(argv[++i]);
+        else if (strcmp(argv[i], "--no-pipeline") == 0)
+            pipeline = 0;
+        else if (strcmp(argv[i], "--intern") == 0)
+            E.intern = 1;
+        else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc)
+            E.bench_path = argv[++i];
+        else if (strcmp(argv[i], "--bench-runs") == 0 && i + 1 < argc)
+        {
+            if ((E.bench_runs = atoi(argv[++i])) < 1)
+            {
+                fprintf(stderr, "Invalid number of runs: %s\n", argv[i]);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--bench-baseline") == 0 && i + 1 < argc)
+            E.bench_baseline = argv[++i];
+        else if (strcmp(argv[i], "--bench-corpus") == 0 && i + 1 < argc)
+        {
+            benchCorpus(argv[++i]);
+            exit(0);
+        }
+        else if (strcmp(argv[i], "--simd") == 0 && i + 1 < argc)
+            simd = argv[++i];
+        else if (strcmp(argv[i], "--simd-self-test") == 0)
+            exit(simdSelfTest() ? 1 : 0);
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+        {
+#ifdef CEDIT_NO_TRACE
+            fprintf(stderr, "cedit was built without tracing\n");
+            exit(1);
+#endif
+            E.trace_path = argv[++i];
+            E.tracing = 1;
+            E.trace_start_ns = monotonicNs();
+        }
+        else if (strcmp(argv[i], "--memory-budget") == 0 && i + 1 < argc)
+        {
+            if ((E.mem_budget = parseSize(argv[++i])) == 0)
+            {
+                fprintf(stderr, "Invalid memory budget: %s\n", argv[i]);
+                exit(1);
+            }
+        }
+        else
+        {
+            fprintf(stderr, "Usage: cedit [--replay KEYFILE] [--replay-rate KEYS] [--replay-bps BYTES] [--no-pipeline]\n"
+                            "             [--memory-budget SIZE] [--intern] [--trace FILE] [--simd LEVEL]\n"
+                            "             [--bench JSONFILE [--bench-runs N] [--bench-baseline JSONFILE]] [FILE...]\n"
+                            "       cedit --bench-corpus DIR\n"
+                            "       cedit --simd-self-test\n");
+            exit(1);
+        }
+    }
+
+    simdSelect(simd);
+    if (E.bench_path)
+        editorBench(&argv[i], argc - i);
+    if (!E.replay)
+        enableRawMode();
     initEditor();
-    if (argc >= 2)
+    for (; i < argc; i++)
     {
-        editorOpen(argv[1]);
+        if (editorOpen(argv[i]) == -1)
+            die(argv[i]);
     }
+    if (E.num_buffers == 0)
+        editorAddBuffer(editorBufferNew());
+    else
+        editorSwitchBuffer(0);
+
+    editorSetStatusMessage("HELP: Ctrl-Q quit | Ctrl-G goto | Ctrl-O open | Ctrl-N/P buffer | Ctrl-W window");
 
+    E.replay_start_ns = monotonicNs();
+    if (pipeline)
+        editorStartPipeline();
+    editorRefreshScreen();
     while (1)
     {
-        editorRefreshScreen();
         editorProcessKeypress();
+        /**
+         * While the render stage is still writing the previous frame there is no point in queueing another one behind it.
+         * We wait for it or for the next key, whichever comes first, so every key that arrives meanwhile is applied
+         * and the next frame shows all of them at once.
+         */
+        if (E.pipeline && editorWaitForRenderOrKey())
+            continue;
+        editorRefreshScreen();
     }
 
     // while (1) {